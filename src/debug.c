@@ -5,8 +5,21 @@
  *
  * Debug library.
  *
+ * Messages are formatted into a lock-free ring of the calling thread, and
+ * a logging thread drains the rings into the log files, so that the
+ * threads handling records never wait for stdout or fflush(). Messages
+ * are written synchronously before the logging thread starts or after it
+ * stops, and for ERROR level so that errors are never lost if the daemon
+ * aborts afterwards. Errors are written to stderr and are never suppressed
+ * by the rate limit of the call site.
+ *
  * Author: Li Xi <lixi@ddn.com>
  */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "debug.h"
 
@@ -15,3 +28,407 @@ FILE *debug_log;
 FILE *error_log;
 FILE *info_log;
 FILE *warn_log;
+
+struct lcrp_log_entry {
+	/* Level of the message */
+	int	lle_level;
+	/* Formatted message */
+	char	lle_text[LCRP_LOG_MSG_SIZE];
+};
+
+/*
+ * Messages of one thread. Only the owner thread adds messages and only the
+ * logging thread removes them.
+ */
+struct lcrp_log_ring {
+	/* Next ring in the list of all rings */
+	struct lcrp_log_ring	*llr_next;
+	/* Index of the next message to write, updated by logging thread */
+	unsigned int		 llr_head;
+	/* Index of the next message to add, updated by owner thread */
+	unsigned int		 llr_tail;
+	/* Messages dropped because the ring is full */
+	unsigned int		 llr_dropped;
+	/* Owner thread has exited, protected by lcrp_log_mutex */
+	bool			 llr_retired;
+	/* Messages */
+	struct lcrp_log_entry	 llr_entries[LCRP_LOG_RING_SIZE];
+};
+
+static __thread struct lcrp_log_ring *lcrp_log_local;
+/* Retires the ring of a thread when it exits */
+static pthread_key_t lcrp_log_key;
+/* Whether the logging thread is writing the rings */
+static bool lcrp_log_async;
+/* Logging thread should exit after draining all rings */
+static bool lcrp_log_stopping;
+static pthread_t lcrp_log_thread_id;
+/* Protects lcrp_log_rings */
+static pthread_mutex_t lcrp_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Rings of all threads. Rings of exited threads are freed once drained,
+ * the others are freed when the logging thread stops.
+ */
+static struct lcrp_log_ring *lcrp_log_rings;
+/* Last message written by the logging thread, to de-duplicate */
+static struct lcrp_log_entry lcrp_log_last;
+/* Times the last message has been repeated but not written */
+static unsigned int lcrp_log_repeated;
+/* Sites with suppressed messages, reported by the logging thread */
+static struct lcrp_log_site *lcrp_log_sites;
+
+static void lcrp_log_write(int level, const char *text)
+{
+	if (debug_log != NULL)
+		fputs(text, debug_log);
+	if (info_log != NULL && level <= INFO)
+		fputs(text, info_log);
+	if (error_log != NULL && level <= ERROR)
+		fputs(text, error_log);
+	fputs(text, level <= ERROR ? stderr : stdout);
+}
+
+static void lcrp_log_flush(void)
+{
+	if (debug_log != NULL)
+		fflush(debug_log);
+	if (info_log != NULL)
+		fflush(info_log);
+	if (error_log != NULL)
+		fflush(error_log);
+	fflush(stdout);
+	fflush(stderr);
+}
+
+/*
+ * Return the number of suppressed messages to report, or -1 if this
+ * message should be suppressed
+ */
+static int lcrp_log_site_check(struct lcrp_log_site *site, int level)
+{
+	long window;
+	struct timespec now;
+
+	if (level <= ERROR)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	window = now.tv_sec / LCRP_LOG_WINDOW;
+	if (__atomic_load_n(&site->lls_window, __ATOMIC_RELAXED) != window) {
+		__atomic_store_n(&site->lls_window, window, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->lls_count, 0, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_fetch_add(&site->lls_count, 1, __ATOMIC_RELAXED) >=
+	    LCRP_LOG_BURST) {
+		__atomic_fetch_add(&site->lls_suppressed, 1, __ATOMIC_RELAXED);
+		/* So the logging thread reports it even if no more message */
+		if (!__atomic_exchange_n(&site->lls_listed, true,
+					 __ATOMIC_ACQ_REL)) {
+			site->lls_next = __atomic_load_n(&lcrp_log_sites,
+							 __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(&lcrp_log_sites,
+							    &site->lls_next,
+							    site, true,
+							    __ATOMIC_RELEASE,
+							    __ATOMIC_RELAXED))
+				;
+		}
+		return -1;
+	}
+	return __atomic_exchange_n(&site->lls_suppressed, 0, __ATOMIC_RELAXED);
+}
+
+static struct lcrp_log_ring *lcrp_log_ring_get(void)
+{
+	struct lcrp_log_ring *ring = lcrp_log_local;
+
+	if (ring != NULL)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&lcrp_log_mutex);
+	ring->llr_next = lcrp_log_rings;
+	lcrp_log_rings = ring;
+	pthread_mutex_unlock(&lcrp_log_mutex);
+	pthread_setspecific(lcrp_log_key, ring);
+	lcrp_log_local = ring;
+	return ring;
+}
+
+/*
+ * Called when the owner thread exits, the logging thread frees the ring
+ * after writing its messages
+ */
+static void lcrp_log_ring_retire(void *arg)
+{
+	struct lcrp_log_ring *ring;
+
+	pthread_mutex_lock(&lcrp_log_mutex);
+	/* The ring has been freed if the logging thread has stopped */
+	for (ring = lcrp_log_rings; ring != NULL; ring = ring->llr_next) {
+		if (ring == arg) {
+			ring->llr_retired = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lcrp_log_mutex);
+}
+
+/*
+ * Add a message into the ring of this thread. Return false if the message
+ * should be written synchronously.
+ */
+static bool lcrp_log_ring_add(int level, const char *fmt, va_list ap)
+{
+	unsigned int head;
+	struct lcrp_log_ring *ring;
+	struct lcrp_log_entry *entry;
+
+	if (!__atomic_load_n(&lcrp_log_async, __ATOMIC_ACQUIRE))
+		return false;
+
+	ring = lcrp_log_ring_get();
+	if (ring == NULL)
+		return false;
+
+	head = __atomic_load_n(&ring->llr_head, __ATOMIC_ACQUIRE);
+	if (ring->llr_tail - head >= LCRP_LOG_RING_SIZE) {
+		__atomic_store_n(&ring->llr_dropped, ring->llr_dropped + 1,
+				 __ATOMIC_RELAXED);
+		return true;
+	}
+
+	entry = &ring->llr_entries[ring->llr_tail % LCRP_LOG_RING_SIZE];
+	entry->lle_level = level;
+	if (vsnprintf(entry->lle_text, sizeof(entry->lle_text), fmt, ap) >=
+	    (int)sizeof(entry->lle_text))
+		strcpy(entry->lle_text + sizeof(entry->lle_text) - 5, "...\n");
+	__atomic_store_n(&ring->llr_tail, ring->llr_tail + 1,
+			 __ATOMIC_RELEASE);
+	return true;
+}
+
+static void lcrp_log_vmessage(int level, const char *fmt, va_list ap)
+{
+	va_list copy;
+	char text[LCRP_LOG_MSG_SIZE];
+
+	va_copy(copy, ap);
+	if (level == ERROR || !lcrp_log_ring_add(level, fmt, copy)) {
+		vsnprintf(text, sizeof(text), fmt, ap);
+		lcrp_log_write(level, text);
+		lcrp_log_flush();
+	}
+	va_end(copy);
+}
+
+static void lcrp_log_message(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	lcrp_log_vmessage(level, fmt, ap);
+	va_end(ap);
+}
+
+void _lcrp_logging(struct lcrp_log_site *site, int level, bool watch,
+		   const char *fmt, ...)
+{
+	int suppressed;
+	va_list ap;
+
+	suppressed = lcrp_log_site_check(site, level);
+	if (suppressed < 0)
+		return;
+
+	va_start(ap, fmt);
+	lcrp_log_vmessage(level, fmt, ap);
+	va_end(ap);
+
+	if (suppressed > 0)
+		lcrp_log_message(WARN,
+				 "[WARN] suppressed [%d] messages of [%s:%d]\n",
+				 suppressed, site->lls_file, site->lls_line);
+}
+
+static void lcrp_log_repeated_flush(void)
+{
+	char text[128];
+
+	if (lcrp_log_repeated == 0)
+		return;
+
+	snprintf(text, sizeof(text), "last message repeated [%u] times\n",
+		 lcrp_log_repeated);
+	lcrp_log_write(lcrp_log_last.lle_level, text);
+	lcrp_log_repeated = 0;
+}
+
+/* Write the messages in a ring, return the number of written ones */
+static int lcrp_log_ring_drain(struct lcrp_log_ring *ring)
+{
+	int count = 0;
+	unsigned int tail;
+	unsigned int dropped;
+	struct lcrp_log_entry *entry;
+	char text[128];
+
+	dropped = __atomic_exchange_n(&ring->llr_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		lcrp_log_repeated_flush();
+		snprintf(text, sizeof(text),
+			 "[WARN] dropped [%u] messages of a thread\n", dropped);
+		lcrp_log_write(WARN, text);
+	}
+
+	tail = __atomic_load_n(&ring->llr_tail, __ATOMIC_ACQUIRE);
+	while (ring->llr_head != tail) {
+		entry = &ring->llr_entries[ring->llr_head % LCRP_LOG_RING_SIZE];
+		if (entry->lle_level == lcrp_log_last.lle_level &&
+		    strcmp(entry->lle_text, lcrp_log_last.lle_text) == 0) {
+			lcrp_log_repeated++;
+		} else {
+			lcrp_log_repeated_flush();
+			lcrp_log_write(entry->lle_level, entry->lle_text);
+			lcrp_log_last = *entry;
+		}
+		__atomic_store_n(&ring->llr_head, ring->llr_head + 1,
+				 __ATOMIC_RELEASE);
+		count++;
+	}
+	return count;
+}
+
+static int lcrp_log_drain(void)
+{
+	int count = 0;
+	struct lcrp_log_ring *ring;
+	struct lcrp_log_ring **prev;
+
+	pthread_mutex_lock(&lcrp_log_mutex);
+	prev = &lcrp_log_rings;
+	while ((ring = *prev) != NULL) {
+		count += lcrp_log_ring_drain(ring);
+		/* No more message will be added into a retired ring */
+		if (ring->llr_retired) {
+			*prev = ring->llr_next;
+			free(ring);
+			continue;
+		}
+		prev = &ring->llr_next;
+	}
+	pthread_mutex_unlock(&lcrp_log_mutex);
+	return count;
+}
+
+/* Report the suppressed messages that have not been reported by sites */
+static void lcrp_log_suppressed_report(void)
+{
+	unsigned int suppressed;
+	struct lcrp_log_site *site;
+	struct lcrp_log_site *next;
+	char text[LCRP_LOG_MSG_SIZE];
+
+	site = __atomic_exchange_n(&lcrp_log_sites, NULL, __ATOMIC_ACQUIRE);
+	for (; site != NULL; site = next) {
+		/* The site could be listed again once unlisted */
+		next = site->lls_next;
+		__atomic_store_n(&site->lls_listed, false, __ATOMIC_RELEASE);
+		suppressed = __atomic_exchange_n(&site->lls_suppressed, 0,
+						 __ATOMIC_RELAXED);
+		if (suppressed == 0)
+			continue;
+		lcrp_log_repeated_flush();
+		snprintf(text, sizeof(text),
+			 "[WARN] suppressed [%u] messages of [%s:%d]\n",
+			 suppressed, site->lls_file, site->lls_line);
+		lcrp_log_write(WARN, text);
+	}
+}
+
+static void *lcrp_log_thread(void *arg)
+{
+	time_t report_time = time(NULL);
+	struct timespec delay;
+
+	delay.tv_sec = 0;
+	delay.tv_nsec = LCRP_LOG_DRAIN_MSEC * 1000000L;
+	while (!__atomic_load_n(&lcrp_log_stopping, __ATOMIC_ACQUIRE)) {
+		if (lcrp_log_drain() > 0) {
+			lcrp_log_flush();
+			continue;
+		}
+		/* Report repeats when the message stops repeating */
+		if (lcrp_log_repeated > 0) {
+			lcrp_log_repeated_flush();
+			lcrp_log_flush();
+		}
+		if (time(NULL) - report_time >= LCRP_LOG_WINDOW) {
+			lcrp_log_suppressed_report();
+			lcrp_log_flush();
+			report_time = time(NULL);
+		}
+		nanosleep(&delay, NULL);
+	}
+	return NULL;
+}
+
+/*
+ * Start the logging thread, messages are written synchronously if failed
+ */
+int lcrp_log_start(void)
+{
+	int rc;
+
+	lcrp_log_stopping = false;
+	rc = pthread_key_create(&lcrp_log_key, lcrp_log_ring_retire);
+	if (rc) {
+		LERROR("failed to create key of logging rings: %s\n",
+		       strerror(rc));
+		return -rc;
+	}
+
+	rc = pthread_create(&lcrp_log_thread_id, NULL, lcrp_log_thread, NULL);
+	if (rc) {
+		LERROR("failed to create logging thread: %s\n", strerror(rc));
+		pthread_key_delete(lcrp_log_key);
+		return -rc;
+	}
+	__atomic_store_n(&lcrp_log_async, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Stop the logging thread and write all buffered messages. Threads should
+ * have stopped logging before this.
+ */
+void lcrp_log_stop(void)
+{
+	struct lcrp_log_ring *ring;
+
+	if (!lcrp_log_async)
+		return;
+
+	__atomic_store_n(&lcrp_log_async, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&lcrp_log_stopping, true, __ATOMIC_RELEASE);
+	pthread_join(lcrp_log_thread_id, NULL);
+
+	lcrp_log_drain();
+	lcrp_log_repeated_flush();
+	lcrp_log_suppressed_report();
+	lcrp_log_flush();
+
+	pthread_mutex_lock(&lcrp_log_mutex);
+	while (lcrp_log_rings != NULL) {
+		ring = lcrp_log_rings;
+		lcrp_log_rings = ring->llr_next;
+		free(ring);
+	}
+	pthread_mutex_unlock(&lcrp_log_mutex);
+	pthread_setspecific(lcrp_log_key, NULL);
+	lcrp_log_local = NULL;
+}
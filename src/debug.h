@@ -23,52 +23,65 @@ enum {
 	DEBUG,
 };
 
+/* Messages of a call site printed in a window before being suppressed */
+#define LCRP_LOG_BURST 10
+/* Seconds of the window to rate-limit messages of a call site */
+#define LCRP_LOG_WINDOW 5
+/* Maximum size of a message, longer ones are truncated */
+#define LCRP_LOG_MSG_SIZE 1024
+/* Number of messages buffered by each thread, should be power of 2 */
+#define LCRP_LOG_RING_SIZE 128
+/* Milliseconds the logging thread sleeps when there is no message */
+#define LCRP_LOG_DRAIN_MSEC 10
+
 extern int debug_level;
 extern FILE *debug_log;
 extern FILE *info_log;
 extern FILE *error_log;
 extern FILE *warn_log;
 
-/* Print debug information. This is controlled by the value of the
- * global variable 'debug'
+/*
+ * Rate limit of a logging call site, a static variable of each call site.
+ * Updated atomically since the site could be shared by threads.
+ */
+struct lcrp_log_site {
+	/* Source file of the call site */
+	const char	*lls_file;
+	/* Line of the call site */
+	int		 lls_line;
+	/* Start second of the current window */
+	long		 lls_window;
+	/* Messages printed in the current window */
+	unsigned int	 lls_count;
+	/* Messages suppressed since the last printed one */
+	unsigned int	 lls_suppressed;
+	/* Whether in the list of sites with suppressed messages */
+	bool		 lls_listed;
+	/* Next site in the list of sites with suppressed messages */
+	struct lcrp_log_site	*lls_next;
+};
+
+void _lcrp_logging(struct lcrp_log_site *site, int level, bool watch,
+		   const char *fmt, ...);
+int lcrp_log_start(void);
+void lcrp_log_stop(void);
+
+/*
+ * Print debug information. This is controlled by the value of the
+ * global variable 'debug_level'. Messages are copied into a buffer of the
+ * thread and written by the logging thread if it has been started.
  */
-static inline void _lcrp_logging(int level, bool watch, const char *fmt, ...)
-{
-	va_list ap;
-
-	if (level > debug_level && !watch)
-		return;
-
-	if (debug_log != NULL) {
-		va_start(ap, fmt);
-		vfprintf(debug_log, fmt, ap);
-		va_end(ap);
-		fflush(debug_log);
-	}
-
-	if (info_log != NULL && level <= INFO) {
-		va_start(ap, fmt);
-		vfprintf(info_log, fmt, ap);
-		va_end(ap);
-		fflush(info_log);
-	}
-
-	if (error_log != NULL && level <= ERROR) {
-		va_start(ap, fmt);
-		vfprintf(error_log, fmt, ap);
-		va_end(ap);
-		fflush(error_log);
-	}
-
-	va_start(ap, fmt);
-	vfprintf(stdout, fmt, ap);
-	va_end(ap);
-	fflush(stdout);
-}
+#define lcrp_logging_site(level, watch, format, args...)		\
+do {									\
+	static struct lcrp_log_site __site = { __FILE__, __LINE__ };	\
+									\
+	if ((level) <= debug_level || (watch))				\
+		_lcrp_logging(&__site, level, watch, format, ##args);	\
+} while (0)
 
 #define lcrp_logging(level, watch, format, args...) \
-	_lcrp_logging(level, watch, "["#level"] [%s:%d] [%s()]: " format, \
-		      __FILE__,  __LINE__, __func__, ##args)
+	lcrp_logging_site(level, watch, "["#level"] [%s:%d] [%s()]: " \
+			  format, __FILE__,  __LINE__, __func__, ##args)
 
 #define LWARN(format, args...) \
 	lcrp_logging(WARN, false, format, ##args)
@@ -76,14 +89,23 @@ static inline void _lcrp_logging(int level, bool watch, const char *fmt, ...)
 #define LERROR(format, args...) \
 	lcrp_logging(ERROR, false, format, ##args)
 
+/* Compiled out by --disable-debug-log, arguments are still checked */
+#ifdef LCRP_NO_DEBUG_LOG
+#define LDEBUG(format, args...)						\
+do {									\
+	if (0)								\
+		lcrp_logging(DEBUG, false, format, ##args);		\
+} while (0)
+#else
 #define LDEBUG(format, args...) \
 	lcrp_logging(DEBUG, false, format, ##args)
+#endif
 
 #define LINFO(format, args...) \
 	lcrp_logging(INFO, false, format, ##args)
 
 #define _LINFO(format, args...) \
-	_lcrp_logging(INFO, false, format, ##args)
+	lcrp_logging_site(INFO, false, format, ##args)
 
 #define LERRORW(watch, format, args...) \
 	lcrp_logging(ERROR, watch, format, ##args)
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Benchmark of the record processing path of lcrpd. Records from a
+ * synthetic or replay source go through lcrp_changelog_parse_record()
+ * into a scratch access history directory, while epochs roll over and
+ * inactive epochs are cleaned up.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
+#include <linux/limits.h>
+#include <lustre/lustreapi.h>
+
+#include "debug.h"
+#include "lcrp_changelog.h"
+#include "lcrpd.h"
+#include "lcrp_stats.h"
+#include "lcrp_worker.h"
+
+#define LCRP_BENCH_DEFAULT_RECORDS	1000000
+#define LCRP_BENCH_DEFAULT_EPOCH_RECORDS 100000
+
+static void lcrp_bench_usage(void)
+{
+	LERROR("Usage: lcrp_bench [-c config] [-d dir] [-n records] [-e epoch_records] [-f fids] [-z zipf] [-t types] [-w workers] [-p] [-v]\n"
+	       "  -c: config file with the same keys as lcrpd.conf\n"
+	       "  -d: scratch access history directory, a new one by default\n"
+	       "  -n: number of records to process, default %d\n"
+	       "  -e: records of each epoch before rolling over, 0 to disable, default %d\n"
+	       "  -f: number of FIDs of synthetic source\n"
+	       "  -z: exponent of Zipf distribution of synthetic source\n"
+	       "  -t: weights of record types of synthetic source\n"
+	       "  -w: number of worker threads, 0 to handle records inline\n"
+	       "  -p: prepare directory of the next epoch before rolling over, not counted in seconds\n"
+	       "  -v: print logs of INFO level\n",
+	       LCRP_BENCH_DEFAULT_RECORDS, LCRP_BENCH_DEFAULT_EPOCH_RECORDS);
+}
+
+static long long lcrp_bench_nsec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int lcrp_bench_compare(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double lcrp_bench_percentile(unsigned int *latencies,
+				    unsigned long count, double percent)
+{
+	if (count == 0)
+		return 0;
+	return latencies[(unsigned long)((count - 1) * percent)] / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int i;
+	int rc;
+	int ret;
+	long long end;
+	long long start;
+	long long elapsed;
+	long long record_start;
+	long long rollover_max = 0;
+	long long rollover_total = 0;
+	long long prepare_total = 0;
+	bool prepare = false;
+	unsigned long count = 0;
+	unsigned long rollovers = 0;
+	unsigned long records = LCRP_BENCH_DEFAULT_RECORDS;
+	unsigned long epoch_records = LCRP_BENCH_DEFAULT_EPOCH_RECORDS;
+	unsigned int *latencies;
+	const char *config_fpath = NULL;
+	const char *fids = NULL;
+	const char *zipf = NULL;
+	const char *types = NULL;
+	const char *workers = NULL;
+	char dir_template[] = "lcrp_bench.XXXXXX";
+	char *dir = NULL;
+	struct lcrp_epoch *epoch;
+	struct lcrp_source source;
+	char spill_file[PATH_MAX + 1];
+	const char *spill;
+	struct lcrp_changelog_clear clear;
+	struct lcrp_changelog_filter filter;
+	unsigned long long dropped = 0;
+	struct lcrp_epoch_reader reader;
+	unsigned long cache_size;
+	int fd_budget;
+	int depth;
+	struct lcrp_worker_pool pool;
+	struct lcrp_worker_pool *worker_pool = NULL;
+	unsigned long long syscalls;
+
+	debug_level = WARN;
+	while ((c = getopt(argc, argv, "c:d:n:e:f:z:t:w:pvh")) != -1) {
+		switch (c) {
+		case 'c':
+			config_fpath = optarg;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			records = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			epoch_records = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fids = optarg;
+			break;
+		case 'z':
+			zipf = optarg;
+			break;
+		case 't':
+			types = optarg;
+			break;
+		case 'w':
+			workers = optarg;
+			break;
+		case 'p':
+			prepare = true;
+			break;
+		case 'v':
+			debug_level = INFO;
+			break;
+		default:
+			lcrp_bench_usage();
+			return -EINVAL;
+		}
+	}
+	if (optind != argc || records == 0) {
+		lcrp_bench_usage();
+		return -EINVAL;
+	}
+
+	rc = lcrp_init();
+	if (rc) {
+		LERROR("failed to init status\n");
+		return rc;
+	}
+	epoch = &lcrp_status->ls_epoch;
+	/* Not fatal, messages are written synchronously if failed */
+	lcrp_log_start();
+
+	rc = lcrp_set_key_value(LCRP_STR_CHANGELOG_SOURCE,
+				LCRP_SOURCE_SYNTHETIC);
+	if (rc)
+		goto out_fini;
+
+	if (config_fpath != NULL) {
+		rc = lcrp_config_load(config_fpath);
+		if (rc) {
+			LERROR("failed to load config [%s]\n", config_fpath);
+			goto out_fini;
+		}
+	}
+
+	if (fids != NULL) {
+		rc = lcrp_set_key_value(LCRP_STR_SYNTHETIC_FIDS, fids);
+		if (rc)
+			goto out_fini;
+	}
+	if (zipf != NULL) {
+		rc = lcrp_set_key_value(LCRP_STR_SYNTHETIC_ZIPF, zipf);
+		if (rc)
+			goto out_fini;
+	}
+	if (types != NULL) {
+		rc = lcrp_set_key_value(LCRP_STR_SYNTHETIC_TYPES, types);
+		if (rc)
+			goto out_fini;
+	}
+	if (workers != NULL) {
+		rc = lcrp_set_key_value(LCRP_STR_WORKER_THREADS, workers);
+		if (rc)
+			goto out_fini;
+	}
+
+	if (lcrp_status->ls_source.lsrc_ops == &lcrp_source_llapi_ops) {
+		LERROR("benchmark needs [%s] or [%s] as [%s]\n",
+		       LCRP_SOURCE_SYNTHETIC, LCRP_SOURCE_REPLAY,
+		       LCRP_STR_CHANGELOG_SOURCE);
+		rc = -EINVAL;
+		goto out_fini;
+	}
+
+	if (dir == NULL) {
+		dir = mkdtemp(dir_template);
+		if (dir == NULL) {
+			LERROR("failed to create scratch directory: %s\n",
+			       strerror(errno));
+			rc = -errno;
+			goto out_fini;
+		}
+	} else {
+		rc = lcrp_find_or_mkdir(dir);
+		if (rc)
+			goto out_fini;
+	}
+	rc = lcrp_set_key_value(LCRP_STR_LCRP_DIR, dir);
+	if (rc)
+		goto out_fini;
+
+	rc = lcrp_init_dir();
+	if (rc) {
+		LERROR("failed to init access history directory\n");
+		goto out_fini;
+	}
+
+	latencies = malloc(sizeof(*latencies) * records);
+	if (latencies == NULL) {
+		LERROR("failed to allocate latencies of [%lu] records\n",
+		       records);
+		rc = -ENOMEM;
+		goto out_fini;
+	}
+
+	rc = lcrp_fd_limit_init();
+	if (rc) {
+		LERROR("failed to init limit of open files\n");
+		goto out_free;
+	}
+
+	rc = lcrp_epoch_update();
+	if (rc) {
+		LERROR("failed to init epoch\n");
+		goto out_free;
+	}
+
+	rc = lcrp_thread_start(&lcrp_status->ls_inactive_info.liti_general,
+			       &lcrp_inactive_thread,
+			       &lcrp_status->ls_inactive_info);
+	if (rc) {
+		LERROR("failed to start inactive thread\n");
+		goto out_free;
+	}
+
+	cache_size = lcrp_status->ls_fid_cache_size;
+	fd_budget = lcrp_reader_fd_budget(lcrp_status->ls_worker_threads);
+	if (lcrp_status->ls_worker_threads > 0) {
+		depth = lcrp_worker_queue_depth(lcrp_status->ls_worker_threads);
+		spill = lcrp_spill_file(&lcrp_status->ls_source, spill_file,
+					sizeof(spill_file));
+		rc = lcrp_worker_pool_init(&pool,
+					   lcrp_status->ls_worker_threads,
+					   depth, spill,
+					   lcrp_status->ls_dir_fid, epoch,
+					   cache_size, fd_budget);
+		if (rc) {
+			LERROR("failed to start workers\n");
+			goto out_inactive;
+		}
+		worker_pool = &pool;
+		cache_size = 0;
+		fd_budget = 0;
+	}
+
+	rc = lcrp_epoch_reader_init(&reader, epoch, cache_size, fd_budget);
+	if (rc) {
+		LERROR("failed to init reader of epoch\n");
+		goto out_pool;
+	}
+
+	memset(&clear, 0, sizeof(clear));
+	clear.lcc_batch_records = lcrp_status->ls_clear_batch_records;
+	clear.lcc_batch_msec = lcrp_status->ls_clear_batch_msec;
+	gettimeofday(&clear.lcc_time, NULL);
+	filter = lcrp_status->ls_filter;
+	source = lcrp_status->ls_source;
+	rc = lcrp_source_start(&source);
+	if (rc) {
+		LERROR("failed to start Changelog source\n");
+		goto out_reader;
+	}
+
+	start = lcrp_bench_nsec();
+	while (count < records) {
+		if (epoch_records > 0 && count / epoch_records > rollovers) {
+			if (prepare) {
+				/* Done by lcrp_prepare_thread() in lcrpd */
+				record_start = lcrp_bench_nsec();
+				rc = lcrp_epoch_prepare(epoch, epoch->le_start +
+							epoch->le_seconds);
+				if (rc) {
+					LERROR("failed to prepare epoch\n");
+					break;
+				}
+				prepare_total += lcrp_bench_nsec() -
+					record_start;
+			}
+
+			/* Roll over to the next epoch without waiting for it */
+			record_start = lcrp_bench_nsec();
+			rc = _lcrp_epoch_update(epoch, epoch->le_start +
+						epoch->le_seconds);
+			if (rc) {
+				LERROR("failed to roll over epoch\n");
+				break;
+			}
+			elapsed = lcrp_bench_nsec() - record_start;
+			rollover_total += elapsed;
+			if (elapsed > rollover_max)
+				rollover_max = elapsed;
+			rollovers++;
+		}
+
+		record_start = lcrp_bench_nsec();
+		rc = lcrp_changelog_parse_record(&source,
+						 lcrp_status->ls_dir_fid,
+						 &reader, &clear, &filter,
+						 worker_pool, NULL);
+		elapsed = lcrp_bench_nsec() - record_start;
+		if (rc < 0) {
+			LERROR("failed to parse record: %s\n", strerror(-rc));
+			break;
+		} else if (rc == LRS_EOF) {
+			rc = 0;
+			break;
+		} else if (rc != LRS_OK) {
+			continue;
+		}
+		latencies[count++] = elapsed > UINT_MAX ? UINT_MAX : elapsed;
+	}
+
+	syscalls = lcrp_syscall_count;
+	if (worker_pool != NULL) {
+		ret = lcrp_worker_pool_drain(worker_pool);
+		if (ret && rc == 0)
+			rc = ret;
+		syscalls += lcrp_worker_pool_syscall_count(worker_pool);
+	}
+	ret = lcrp_changelog_clear_flush(&source, &clear, worker_pool);
+	if (ret && rc == 0)
+		rc = ret;
+	end = lcrp_bench_nsec() - prepare_total;
+	lcrp_source_fini(&source);
+
+	/* Collect the FID cache statistics of all readers */
+	lcrp_epoch_reader_fini(&reader);
+	if (worker_pool != NULL)
+		lcrp_worker_pool_fini(worker_pool);
+
+	qsort(latencies, count, sizeof(*latencies), lcrp_bench_compare);
+	printf("directory: %s\n", lcrp_status->ls_dir_access_history);
+	printf("records: %lu\n", count);
+	printf("workers: %d\n", lcrp_status->ls_worker_threads);
+	printf("seconds: %.3f\n", (end - start) / 1000000000.0);
+	printf("records/sec: %.0f\n",
+	       count * 1000000000.0 / (end - start > 0 ? end - start : 1));
+	printf("latency p50/p99/p999/max (us): %.2f/%.2f/%.2f/%.2f\n",
+	       lcrp_bench_percentile(latencies, count, 0.5),
+	       lcrp_bench_percentile(latencies, count, 0.99),
+	       lcrp_bench_percentile(latencies, count, 0.999),
+	       lcrp_bench_percentile(latencies, count, 1));
+	printf("syscalls/record: %.2f\n",
+	       count ? (double)syscalls / count : 0);
+	printf("clears: %llu, saved: %llu\n", clear.lcc_clears,
+	       clear.lcc_saved);
+	for (i = 0; i < CL_LAST; i++)
+		dropped += filter.lcf_dropped[i];
+	printf("dropped by filter: %llu\n", dropped + filter.lcf_unknown);
+	printf("FID cache hits/misses: %llu/%llu\n", epoch->le_fid_hits,
+	       epoch->le_fid_misses);
+	printf("record to processed avg/max (ms): %.3f/%.3f\n",
+	       epoch->le_lag_count ?
+	       epoch->le_lag_total / 1000000.0 / epoch->le_lag_count : 0,
+	       epoch->le_lag_max / 1000000.0);
+	printf("rollovers: %lu, avg/max (ms): %.3f/%.3f\n", rollovers,
+	       rollovers ? rollover_total / 1000000.0 / rollovers : 0,
+	       rollover_max / 1000000.0);
+	if (prepare)
+		printf("prepares avg (ms): %.3f\n",
+		       rollovers ? prepare_total / 1000000.0 / rollovers : 0);
+
+out_reader:
+	lcrp_epoch_reader_fini(&reader);
+out_pool:
+	if (worker_pool != NULL)
+		lcrp_worker_pool_fini(worker_pool);
+out_inactive:
+	ret = lcrp_thread_stop(&lcrp_status->ls_inactive_info.liti_general);
+	if (ret) {
+		LERROR("failed to stop inactive thread\n");
+		if (rc == 0)
+			rc = ret;
+	}
+
+	/* Whatever left by the inactive thread */
+	start = lcrp_bench_nsec();
+	ret = lcrp_inactive_cleanup(0, NULL);
+	if (ret) {
+		LERROR("failed to cleanup inactive directory\n");
+		if (rc == 0)
+			rc = ret;
+	}
+	printf("final inactive cleanup (ms): %.3f\n",
+	       (lcrp_bench_nsec() - start) / 1000000.0);
+	if (lcrp_stats_dump(lcrp_status->ls_stats_file) == 0)
+		printf("statistics: %s\n", lcrp_status->ls_stats_file);
+out_free:
+	free(latencies);
+out_fini:
+	lcrp_log_stop();
+	lcrp_fini();
+	return rc;
+}
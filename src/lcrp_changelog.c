@@ -4,22 +4,25 @@
  * Author: Li Xi lixi@ddn.com
  */
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <lustre/lustreapi.h>
 
 #include "debug.h"
 #include "lcrpd.h"
+#include "lcrp_drain.h"
+#include "lcrp_source.h"
+#include "lcrp_stats.h"
+#include "lcrp_worker.h"
 
-#define LCRP_INTERVAL_EOF 3
 #define LCRP_INTERVAL_RETRY 1
+/* Minimum seconds between two logs of the mix of records */
+#define LCRP_FILTER_LOG_INTERVAL 60
 
-enum changelog_record_status {
-	LRS_OK = 0, /* Got a record*/
-	LRS_RETRY = 1, /* Try to get the record again */
-	LRS_EOF = 2, /* No more record  */
-	LRS_RESTART = 3, /* Call llapi_changelog_start again  */
-};
+/* Number of system calls on the access history directory by this thread */
+__thread unsigned long long lcrp_syscall_count;
 
 static int lcrp_get_record_fid(struct changelog_rec *rec,
 			       struct lu_fid *fid)
@@ -41,32 +44,111 @@ static int lcrp_get_record_fid(struct changelog_rec *rec,
 	return 0;
 }
 
-static int lcrp_get_fid_path(const char *root, char *pbuffer, int psize,
-			     char *buffer, int size, struct lu_fid *fid)
+/*
+ * Return true if the record counts as access
+ */
+static bool lcrp_changelog_filter_match(struct lcrp_changelog_filter *filter,
+					struct changelog_rec *rec)
 {
-	int rc;
+	struct changelog_ext_openmode *omd;
+	enum changelog_rec_extra_flags cref = CLFE_INVALID;
 
-	rc = snprintf(pbuffer, psize, "%s/%04x/", root,
-		      fid->f_oid & 0xFFFF);
-	if (rc < 0) {
-		LERROR("failed to generate the parent path for fid "DFID": %s\n",
-			PFID(fid), strerror(-rc));
-		return rc;
-	} else if (rc >= psize) {
-		LERROR("failed to generate the parent path for fid "DFID" because buffser size %d is not enough\n",
-			PFID(fid), psize);
-		return -E2BIG;
+	if (rec->cr_type >= CL_LAST) {
+		filter->lcf_unknown++;
+		return false;
+	}
+
+	filter->lcf_received[rec->cr_type]++;
+	if (!filter->lcf_types[rec->cr_type])
+		goto drop;
+
+	/* Records without open mode always match */
+	if (rec->cr_flags & CLF_EXTRA_FLAGS)
+		cref = changelog_rec_extra_flags(rec)->cr_extra_flags;
+	if (cref & CLFE_OPEN) {
+		omd = changelog_rec_openmode(rec);
+		if (!(omd->cr_openflags & filter->lcf_open_modes))
+			goto drop;
+	}
+	return true;
+drop:
+	filter->lcf_dropped[rec->cr_type]++;
+	lcrp_stats_add(LCRP_COUNTER_DROPPED, 1);
+	return false;
+}
+
+/*
+ * Log the number of received and dropped records of each type, if any new
+ * record has been received since the last time and the last log is older
+ * than LCRP_FILTER_LOG_INTERVAL seconds
+ */
+void lcrp_changelog_filter_log(struct lcrp_changelog_filter *filter,
+			       const char *mdt_device)
+{
+	int type;
+	int len = 0;
+	char buf[PATH_MAX + 1];
+	unsigned long long received = filter->lcf_unknown;
+
+	for (type = 0; type < CL_LAST; type++)
+		received += filter->lcf_received[type];
+	if (received == filter->lcf_logged ||
+	    time(NULL) < filter->lcf_log_time + LCRP_FILTER_LOG_INTERVAL)
+		return;
+	filter->lcf_logged = received;
+	filter->lcf_log_time = time(NULL);
+
+	buf[0] = '\0';
+	for (type = 0; type < CL_LAST; type++) {
+		if (filter->lcf_received[type] == 0)
+			continue;
+		len += snprintf(buf + len, sizeof(buf) - len, " %s:%llu/%llu",
+				changelog_type2str(type),
+				filter->lcf_received[type],
+				filter->lcf_dropped[type]);
+		if (len >= sizeof(buf))
+			break;
 	}
+	LINFO("received/dropped records of [%s]:%s, unknown:%llu\n",
+	      mdt_device, buf, filter->lcf_unknown);
+}
 
-	rc = snprintf(buffer, size, "%s/%04x/" DFID_NOBRACE,
-		      root, fid->f_oid & 0xFFFF,
-		      PFID(fid));
+/*
+ * Account the time from when the record was created to now, when it has
+ * been processed. cr_time has seconds in the high 34 bits and nanoseconds
+ * in the low 30 bits.
+ */
+void lcrp_changelog_record_done(struct lcrp_epoch_reader *reader,
+				unsigned long long time)
+{
+	long long lag;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	lag = (now.tv_sec - (long long)(time >> 30)) * 1000000000LL +
+		now.tv_nsec - (long long)(time & ((1ULL << 30) - 1));
+	/* Clocks of MDS and client might differ */
+	if (lag < 0)
+		lag = 0;
+
+	lcrp_stats_observe(LCRP_HIST_RECORD_LAG, lag);
+	reader->ler_lag_count++;
+	reader->ler_lag_total += lag;
+	if (lag > reader->ler_lag_max)
+		reader->ler_lag_max = lag;
+}
+
+int lcrp_get_fid_name(const struct lu_fid *fid, char *buffer, int size)
+{
+	int rc;
+
+	rc = snprintf(buffer, size, DFID_NOBRACE, PFID(fid));
 	if (rc < 0) {
-		LERROR("failed to generate the path for fid "DFID": %s\n",
+		LERROR("failed to generate the name for fid "DFID": %s\n",
 			PFID(fid), strerror(-rc));
 		return rc;
 	} else if (rc >= size) {
-		LERROR("failed to generate the path for fid "DFID" because buffser size %d is not enough\n",
+		LERROR("failed to generate the name for fid "DFID" because buffser size %d is not enough\n",
 			PFID(fid), size);
 		return -E2BIG;
 	}
@@ -78,6 +160,7 @@ int lcrp_find_or_mkdir(const char *path)
 	int rc;
 	struct stat stat_buf;
 
+	lcrp_syscall_count++;
 	rc = stat(path, &stat_buf);
 	if (rc == 0) {
 		if (!S_ISDIR(stat_buf.st_mode)) {
@@ -87,8 +170,10 @@ int lcrp_find_or_mkdir(const char *path)
 		return 0;
 	} else if (rc) {
 		if (errno == ENOENT) {
+			lcrp_syscall_count++;
 			rc = mkdir(path, 0755);
-			if (rc) {
+			/* Another Changelog thread might have created it */
+			if (rc && errno != EEXIST) {
 				LERROR("failed to create %s: %s\n",
 					path, strerror(errno));
 				return -errno;
@@ -102,234 +187,710 @@ int lcrp_find_or_mkdir(const char *path)
 	return 0;
 }
 
-static int lcrp_find_or_create(const char *path)
+/*
+ * Create a regular file under a directory fd unless it already exists
+ */
+int lcrp_find_or_create_at(int dirfd, const char *name)
 {
 	int rc;
 	struct stat stat_buf;
 
-	rc = stat(path, &stat_buf);
+	/* Lookup does not lock the directory, so try it first */
+	lcrp_syscall_count++;
+	rc = fstatat(dirfd, name, &stat_buf, AT_SYMLINK_NOFOLLOW);
 	if (rc == 0) {
 		if (!S_ISREG(stat_buf.st_mode)) {
-			LERROR("%s is not regular file\n", path);
+			LERROR("%s is not regular file\n", name);
 			return -EIO;
 		}
 		return 0;
-	} else if (rc) {
-		if (errno == ENOENT) {
-			rc = creat(path, 0644);
-			if (rc < 0) {
-				LERROR("failed to create %s: %s\n",
-					path, strerror(errno));
-				return -errno;
-			}
-			close(rc);
-			rc = 0;
-		} else {
-			LERROR("failed to stat %s: %s\n", path,
-				strerror(errno));
-			return -errno;
+	} else if (errno != ENOENT) {
+		LERROR("failed to stat %s: %s\n", name, strerror(errno));
+		return -errno;
+	}
+
+	lcrp_syscall_count++;
+	rc = mknodat(dirfd, name, S_IFREG | 0644, 0);
+	/* Another thread might have created it */
+	if (rc && errno != EEXIST) {
+		LERROR("failed to create %s: %s\n", name, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Link a file to another directory fd with the same name unless it
+ * already exists there
+ */
+int lcrp_find_or_link_at(int old_dirfd, int new_dirfd, const char *name)
+{
+	int rc;
+	struct stat stat_buf;
+
+	lcrp_syscall_count++;
+	rc = fstatat(new_dirfd, name, &stat_buf, AT_SYMLINK_NOFOLLOW);
+	if (rc == 0) {
+		if (!S_ISREG(stat_buf.st_mode)) {
+			LERROR("%s is not regular file\n", name);
+			return -EIO;
 		}
+		return 0;
+	} else if (errno != ENOENT) {
+		LERROR("failed to stat %s: %s\n", name, strerror(errno));
+		return -errno;
+	}
+
+	lcrp_syscall_count++;
+	rc = linkat(old_dirfd, name, new_dirfd, name, 0);
+	/* Another thread might have linked it */
+	if (rc && errno != EEXIST) {
+		LERROR("failed to link %s: %s\n", name, strerror(errno));
+		return -errno;
 	}
 	return 0;
 }
 
-int lcrp_find_or_create_fid(const char *dir_fid, char *buf, int buf_size,
-			    struct lu_fid *fid)
+/*
+ * Get the path of the file of a FID relative to fids or the directory of an
+ * epoch, i.e. "$BUCKET/$FID"
+ */
+static int lcrp_get_fid_path(const struct lu_fid *fid, char *buffer,
+			     int size)
+{
+	int len;
+
+	len = snprintf(buffer, size, LCRP_BUCKET_FORMAT"/",
+		       LCRP_FID_BUCKET(fid));
+	if (len >= size)
+		return -E2BIG;
+	return lcrp_get_fid_name(fid, buffer + len, size - len);
+}
+
+/*
+ * Link FIDs from the bucket directories under fd_fids into the ones under
+ * fd_dest in three batches at most:
+ * 1) lookup the links, which does not lock the directories, since most
+ *    FIDs have been linked already;
+ * 2) link the missing ones, whose files under fd_fids usually exist;
+ * 3) for the FIDs whose file or bucket directory is missing, chain the
+ *    creation of the bucket directories and the file before the link,
+ *    where creating an existing bucket directory fails harmlessly.
+ * Another thread might create any of them meanwhile, which is fine.
+ */
+int lcrp_link_fids(struct lcrp_io *io, int fd_fids, int fd_dest,
+		   const struct lu_fid *fids, int count)
 {
+	int i;
 	int rc;
-	char parent_path[PATH_MAX + 1];
+	int pending = 0;
+	int todo[LCRP_LINK_BATCH];
+	char paths[LCRP_LINK_BATCH][LCRP_IO_PATHLEN];
+	struct lcrp_io_op *op;
 
-	rc = lcrp_get_fid_path(dir_fid, parent_path,
-			       sizeof(parent_path), buf, buf_size, fid);
-	if (rc) {
-		LERROR("failed to get path of fid "DFID"\n",
-			PFID(fid));
+	LASSERT(count <= LCRP_LINK_BATCH);
+	lcrp_io_reset(io);
+	for (i = 0; i < count; i++) {
+		rc = lcrp_get_fid_path(&fids[i], paths[i], sizeof(paths[i]));
+		if (rc)
+			return rc;
+		lcrp_io_queue(io, LCRP_IO_STAT, fd_dest, paths[i]);
+	}
+	rc = lcrp_io_submit(io);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < count; i++) {
+		op = &io->lio_ops[i];
+		if (op->lio_result == 0 && op->lio_mode != S_IFREG) {
+			LERROR("%s is not regular file\n", paths[i]);
+			return -EIO;
+		} else if (op->lio_result == -ENOENT) {
+			todo[pending++] = i;
+		} else if (op->lio_result) {
+			LERROR("failed to stat %s: %s\n", paths[i],
+			       strerror(-op->lio_result));
+			return op->lio_result;
+		}
+	}
+	if (pending == 0)
+		return 0;
+
+	lcrp_io_reset(io);
+	for (i = 0; i < pending; i++) {
+		op = lcrp_io_queue(io, LCRP_IO_LINK, fd_fids, paths[todo[i]]);
+		op->lio_dirfd2 = fd_dest;
+		strcpy(op->lio_path2, op->lio_path);
+	}
+	rc = lcrp_io_submit(io);
+	if (rc)
+		return rc;
+
+	count = pending;
+	pending = 0;
+	for (i = 0; i < count; i++) {
+		op = &io->lio_ops[i];
+		/* Another thread might have linked it */
+		if (op->lio_result == 0 || op->lio_result == -EEXIST)
+			continue;
+		if (op->lio_result != -ENOENT) {
+			LERROR("failed to link %s: %s\n", op->lio_path,
+			       strerror(-op->lio_result));
+			return op->lio_result;
+		}
+		todo[pending++] = todo[i];
+	}
+	if (pending == 0)
+		return 0;
+
+	lcrp_io_reset(io);
+	for (i = 0; i < pending; i++) {
+		op = lcrp_io_queue(io, LCRP_IO_MKDIR, fd_fids, paths[todo[i]]);
+		op->lio_chain = true;
+		*strchr(op->lio_path, '/') = '\0';
+		op = lcrp_io_queue(io, LCRP_IO_CREATE, fd_fids, paths[todo[i]]);
+		op->lio_chain = true;
+		op = lcrp_io_queue(io, LCRP_IO_MKDIR, fd_dest, paths[todo[i]]);
+		op->lio_chain = true;
+		*strchr(op->lio_path, '/') = '\0';
+		op = lcrp_io_queue(io, LCRP_IO_LINK, fd_fids, paths[todo[i]]);
+		op->lio_dirfd2 = fd_dest;
+		strcpy(op->lio_path2, op->lio_path);
+	}
+	rc = lcrp_io_submit(io);
+	if (rc)
 		return rc;
+
+	for (i = 0; i < pending; i++) {
+		op = &io->lio_ops[i * 4 + 1];
+		if (op->lio_result) {
+			LERROR("failed to create %s: %s\n", op->lio_path,
+			       strerror(-op->lio_result));
+			return op->lio_result;
+		}
+		op = &io->lio_ops[i * 4 + 3];
+		if (op->lio_result && op->lio_result != -EEXIST) {
+			LERROR("failed to link %s: %s\n", op->lio_path,
+			       strerror(-op->lio_result));
+			return op->lio_result;
+		}
 	}
+	return 0;
+}
+
+static int lcrp_update_fid_sync(const char *dir_fid,
+				struct lcrp_epoch_reader *reader,
+				struct lu_fid *fid)
+{
+	int rc = 0;
+	int fd_fid;
+	int fd_active;
+	unsigned long long start;
+	unsigned int bucket = LCRP_FID_BUCKET(fid);
+	char name[LCRP_FID_NAMELEN];
+	struct lcrp_index *index = reader->ler_epoch->le_index;
 
-	rc = lcrp_find_or_mkdir(parent_path);
+	/* Skip the FID if it has already been linked in this epoch */
+	if (lcrp_fidset_lookup(&reader->ler_fidset, fid))
+		return 0;
+
+	LINFO("handling fid "DFID"\n", PFID(fid));
+	start = lcrp_stats_nsec();
+	rc = lcrp_get_fid_name(fid, name, sizeof(name));
+	if (rc)
+		return rc;
+
+	rc = lcrp_dircache_get(&reader->ler_fids, bucket, &fd_fid);
+	if (rc == 0)
+		rc = lcrp_find_or_create_at(fd_fid, name);
 	if (rc) {
-		LERROR("failed to find or create directory %s\n",
-			parent_path);
+		LERROR("failed to find or create FID "DFID" under [%s]\n",
+		       PFID(fid), dir_fid);
 		return rc;
 	}
 
-	rc = lcrp_find_or_create(buf);
+	rc = lcrp_dircache_get(&reader->ler_active, bucket, &fd_active);
+	if (rc == 0)
+		rc = lcrp_find_or_link_at(fd_fid, fd_active, name);
 	if (rc) {
-		LERROR("failed to find or create file %s\n", buf);
+		LERROR(
+			"failed to find or link FID "DFID" to active directory\n",
+			PFID(fid));
 		return rc;
 	}
 
+	if (index != NULL) {
+		rc = lcrp_index_update(index, fid,
+				       reader->ler_snapshot->les_start);
+		if (rc) {
+			LERROR("failed to update index of FID "DFID"\n",
+			       PFID(fid));
+			return rc;
+		}
+	}
+	lcrp_fidset_insert(&reader->ler_fidset, fid);
+	lcrp_stats_add(LCRP_COUNTER_FIDS_LINKED, 1);
+	lcrp_stats_observe(LCRP_HIST_LINK_FID, lcrp_stats_nsec() - start);
 	return 0;
 }
 
-static int lcrp_find_or_link(const char *old_path, const char *new_path)
+/*
+ * Link up to LCRP_LINK_BATCH FIDs into the directory of the current epoch.
+ * With io_uring, the FIDs are linked by batches of operations through the
+ * root directories. Otherwise, they are linked one by one through the
+ * cached bucket directories, which saves the lookup of the bucket.
+ */
+int lcrp_update_fids(const char *dir_fid, struct lcrp_epoch_reader *reader,
+		     struct lu_fid *fids, int count)
 {
-	int rc;
-	struct stat stat_buf;
+	int i;
+	int j;
+	int rc = 0;
+	int linking = 0;
+	unsigned long long elapsed;
+	unsigned long long start;
+	struct lu_fid batch[LCRP_LINK_BATCH];
+	struct lcrp_index *index = reader->ler_epoch->le_index;
+	struct lcrp_epoch_snapshot *snapshot;
 
-	rc = stat(new_path, &stat_buf);
-	if (rc == 0) {
-		if (!S_ISREG(stat_buf.st_mode)) {
-			LERROR("%s is not regular file\n", new_path);
-			return -EIO;
+	/* Switches ler_active to the directory of the current epoch */
+	snapshot = lcrp_epoch_get(reader);
+	if (reader->ler_fids.ldc_root < 0) {
+		rc = lcrp_dircache_open(&reader->ler_fids, dir_fid);
+		if (rc)
+			goto out;
+	}
+
+	if (reader->ler_io.lio_ring == NULL) {
+		for (i = 0; i < count && rc == 0; i++)
+			rc = lcrp_update_fid_sync(dir_fid, reader, &fids[i]);
+		goto out;
+	}
+
+	LASSERT(count <= LCRP_LINK_BATCH);
+	for (i = 0; i < count; i++) {
+		/* Skip the FID if it has already been linked in this epoch */
+		if (lcrp_fidset_lookup(&reader->ler_fidset, &fids[i]))
+			continue;
+		for (j = 0; j < linking; j++) {
+			if (lcrp_fid_equal(&batch[j], &fids[i]))
+				break;
 		}
-		return 0;
-	} else if (rc) {
-		if (errno == ENOENT) {
-			rc = link(old_path, new_path);
-			if (rc < 0) {
-				LERROR("failed to link %s to %s: %s\n",
-					new_path, old_path, strerror(errno));
-				return -errno;
+		if (j == linking)
+			batch[linking++] = fids[i];
+	}
+	if (linking == 0)
+		goto out;
+
+	start = lcrp_stats_nsec();
+	rc = lcrp_link_fids(&reader->ler_io, reader->ler_fids.ldc_root,
+			    snapshot->les_fd_active, batch, linking);
+	if (rc) {
+		LERROR("failed to link [%d] FIDs to active directory\n",
+		       linking);
+		goto out;
+	}
+	elapsed = lcrp_stats_nsec() - start;
+
+	for (i = 0; i < linking; i++) {
+		if (index != NULL) {
+			rc = lcrp_index_update(index, &batch[i],
+					       snapshot->les_start);
+			if (rc) {
+				LERROR("failed to update index of FID "DFID"\n",
+				       PFID(&batch[i]));
+				goto out;
 			}
-		} else {
-			LERROR("failed to stat %s: %s\n", new_path,
-				strerror(errno));
-			return -errno;
 		}
+		lcrp_fidset_insert(&reader->ler_fidset, &batch[i]);
+		/* The FIDs of a batch share the time */
+		lcrp_stats_observe(LCRP_HIST_LINK_FID, elapsed / linking);
 	}
-	return 0;
+	lcrp_stats_add(LCRP_COUNTER_FIDS_LINKED, linking);
+out:
+	lcrp_epoch_put(reader);
+	return rc;
 }
 
-int lcrp_find_or_link_fid(const char *root, struct lu_fid *fid,
-			  const char *fid_path)
+int lcrp_update_fid(const char *dir_fid, struct lcrp_epoch_reader *reader,
+		    struct lu_fid *fid)
 {
-	int rc;
-	char link_path[PATH_MAX + 1];
-	char parent_path[PATH_MAX + 1];
+	return lcrp_update_fids(dir_fid, reader, fid, 1);
+}
 
-	rc = lcrp_get_fid_path(root, parent_path, sizeof(parent_path),
-			       link_path, sizeof(link_path), fid);
+/*
+ * Load the checkpoint of the records that have been applied. Records after
+ * it will be processed, and the ones up to it will be cleared with them.
+ * Return -ENOENT if the checkpoint does not exist.
+ */
+int lcrp_changelog_checkpoint_load(struct lcrp_changelog_clear *clear)
+{
+	int rc = 0;
+	FILE *fp;
+	unsigned long long index;
+
+	fp = fopen(clear->lcc_checkpoint, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			LERROR("failed to open [%s]: %s\n",
+			       clear->lcc_checkpoint, strerror(errno));
+		return -errno;
+	}
+	if (fscanf(fp, "%llu", &index) != 1 || fscanf(fp, " %*s") != EOF)
+		rc = -EINVAL;
+	fclose(fp);
 	if (rc) {
-		LERROR("failed to get path of fid "DFID"\n",
-			PFID(fid));
+		LERROR("invalid checkpoint in [%s]\n", clear->lcc_checkpoint);
 		return rc;
 	}
 
-	rc = lcrp_find_or_mkdir(root);
-	if (rc) {
-		LERROR("failed to find or create directory %s\n",
-			root);
-		return rc;
+	clear->lcc_index = index;
+	clear->lcc_checkpointed = index;
+	return 0;
+}
+
+/*
+ * Records that are checkpointed or cleared are never replayed, so their
+ * updates of the index should be on disk before that
+ */
+static int lcrp_changelog_index_sync(void)
+{
+	int rc;
+
+	if (lcrp_status->ls_epoch.le_index == NULL)
+		return 0;
+
+	rc = lcrp_index_sync(lcrp_status->ls_epoch.le_index);
+	if (rc)
+		LERROR("failed to sync index of FIDs\n");
+	return rc;
+}
+
+/*
+ * Sync the directory of the checkpoints, otherwise the rename that
+ * replaced a checkpoint could be lost by a crash.
+ */
+static int lcrp_changelog_checkpoint_sync_dir(void)
+{
+	int fd;
+	int rc;
+	const char *dir = lcrp_status->ls_dir_changelog_checkpoint;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		LERROR("failed to open [%s]: %s\n", dir, strerror(errno));
+		return -errno;
 	}
 
-	rc = lcrp_find_or_mkdir(parent_path);
+	rc = fsync(fd);
 	if (rc) {
-		LERROR("failed to find or create directory %s\n",
-			parent_path);
+		LERROR("failed to sync [%s]: %s\n", dir, strerror(errno));
+		rc = -errno;
+	}
+	close(fd);
+	return rc;
+}
+
+/*
+ * Save the largest index of the records that have been applied. The file
+ * is synced before it replaces the old one, so a crash leaves either of
+ * them, which are both safe to restart from.
+ */
+static int lcrp_changelog_checkpoint_save(struct lcrp_changelog_clear *clear)
+{
+	int rc;
+	FILE *fp;
+	char tmp[PATH_MAX + sizeof(".tmp")];
+
+	clear->lcc_checkpoint_pending = 0;
+	if (clear->lcc_checkpoint[0] == '\0' ||
+	    clear->lcc_index <= clear->lcc_checkpointed)
+		return 0;
+
+	rc = lcrp_changelog_index_sync();
+	if (rc)
+		return rc;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", clear->lcc_checkpoint);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		LERROR("failed to open [%s]: %s\n", tmp, strerror(errno));
+		return -errno;
+	}
+	fprintf(fp, "%llu\n", clear->lcc_index);
+	if (fflush(fp) || fsync(fileno(fp))) {
+		rc = -errno;
+		LERROR("failed to write [%s]: %s\n", tmp, strerror(-rc));
+		fclose(fp);
 		return rc;
 	}
+	rc = fclose(fp);
+	if (rc) {
+		LERROR("failed to write [%s]: %s\n", tmp, strerror(errno));
+		return -errno;
+	}
 
-	rc = lcrp_find_or_link(fid_path, link_path);
+	rc = rename(tmp, clear->lcc_checkpoint);
 	if (rc) {
-		LERROR("failed to find or create link %s to %s\n",
-			link_path, fid_path);
-		return rc;
+		LERROR("failed to rename [%s] to [%s]: %s\n", tmp,
+		       clear->lcc_checkpoint, strerror(errno));
+		return -errno;
 	}
 
+	rc = lcrp_changelog_checkpoint_sync_dir();
+	if (rc)
+		return rc;
+	LDEBUG("saved checkpoint of records up to %llu\n", clear->lcc_index);
+	clear->lcc_checkpointed = clear->lcc_index;
 	return 0;
 }
 
-static int lcrp_update_fid(const char *dir_fid, struct lcrp_epoch *epoch,
-			   struct lu_fid *fid)
+/*
+ * Clear all of the records that have been processed. If the records are
+ * handled by workers, only clear up to the oldest unfinished one.
+ */
+int lcrp_changelog_clear_flush(struct lcrp_source *source,
+			       struct lcrp_changelog_clear *clear,
+			       struct lcrp_worker_pool *pool)
 {
 	int rc;
-	char fid_path[PATH_MAX + 1];
+	int cleared;
+	unsigned long long start;
+	unsigned long long remaining;
 
-	LINFO("handling fid "DFID"\n", PFID(fid));
-	rc = lcrp_find_or_create_fid(dir_fid, fid_path, sizeof(fid_path), fid);
-	if (rc) {
-		LERROR("failed to find path of FID "DFID"\n",
-			PFID(fid));
+	if (pool != NULL)
+		clear->lcc_index = lcrp_worker_pool_watermark(pool);
+
+	/* The checkpoint is never behind the clear position */
+	rc = lcrp_changelog_checkpoint_save(clear);
+	if (rc)
+		return rc;
+
+	if (clear->lcc_index <= clear->lcc_cleared)
+		return 0;
+
+	rc = lcrp_changelog_index_sync();
+	if (rc)
 		return rc;
-	}
 
-	pthread_mutex_lock(&epoch->le_mutex);
-	rc = lcrp_find_or_link_fid(epoch->le_dir_active, fid, fid_path);
-	pthread_mutex_unlock(&epoch->le_mutex);
+	start = lcrp_stats_nsec();
+	rc = lcrp_source_clear(source, clear->lcc_index);
 	if (rc) {
-		LERROR(
-			"failed to find or link FID "DFID" to active directory\n",
-			PFID(fid));
+		LERROR("failed to clear records up to %llu: %s\n",
+		       clear->lcc_index, strerror(-rc));
 		return rc;
 	}
-	return rc;
+	lcrp_stats_add(LCRP_COUNTER_CLEARS, 1);
+	lcrp_stats_observe(LCRP_HIST_CLEAR, lcrp_stats_nsec() - start);
+
+	/* Records after the watermark are still pending */
+	cleared = clear->lcc_pending;
+	if (pool != NULL) {
+		remaining = pool->lwp_dispatched - clear->lcc_index;
+		if (remaining < (unsigned int)cleared)
+			cleared -= remaining;
+		else
+			cleared = 0;
+	}
+
+	clear->lcc_clears++;
+	if (cleared > 1)
+		clear->lcc_saved += cleared - 1;
+	LINFO("cleared [%d] records up to %llu, saved [%d] clear calls, [%llu] in total\n",
+	      cleared, clear->lcc_index, cleared > 1 ? cleared - 1 : 0,
+	      clear->lcc_saved);
+	clear->lcc_cleared = clear->lcc_index;
+	clear->lcc_pending -= cleared;
+	gettimeofday(&clear->lcc_time, NULL);
+	return 0;
 }
 
 /*
- * return "enum changelog_record_status" if no error, or the error is
- * recoverable; return negative error if unrecoverable failure.
+ * Mark a record as processed, save the checkpoint if enough records have
+ * been processed since the last save, and clear the records if the batch
+ * is full or the last clear is too old.
  */
-static int lcrp_changelog_recv(void *changelog_priv,
-			       struct changelog_rec **rec)
+static int lcrp_changelog_clear_record(struct lcrp_source *source,
+				       struct lcrp_changelog_clear *clear,
+				       struct lcrp_worker_pool *pool,
+				       unsigned long long index)
 {
 	int rc;
+	long msec;
+	struct timeval now;
 
-	rc = llapi_changelog_recv(changelog_priv, rec);
-	switch (rc) {
-	case 0:
-		return LRS_OK;
-	case 1:	/* EOF */
-		return LRS_EOF;
-	case -EINVAL:  /* FS unmounted */
-	case -EPROTO:  /* error in KUC channel */
-		return LRS_RESTART;
-	case -EINTR: /* Interruption */
-		return LRS_RETRY;
-	default:
+	if (pool == NULL)
+		clear->lcc_index = index;
+	clear->lcc_pending++;
+	clear->lcc_checkpoint_pending++;
+	if (clear->lcc_checkpoint[0] != '\0' &&
+	    clear->lcc_checkpoint_pending >= clear->lcc_checkpoint_records) {
+		if (pool != NULL)
+			clear->lcc_index = lcrp_worker_pool_watermark(pool);
+		rc = lcrp_changelog_checkpoint_save(clear);
+		if (rc)
+			return rc;
+	}
+
+	if (clear->lcc_pending >= clear->lcc_batch_records)
+		return lcrp_changelog_clear_flush(source, clear, pool);
+
+	gettimeofday(&now, NULL);
+	msec = (now.tv_sec - clear->lcc_time.tv_sec) * 1000 +
+		(now.tv_usec - clear->lcc_time.tv_usec) / 1000;
+	if (msec >= clear->lcc_batch_msec)
+		return lcrp_changelog_clear_flush(source, clear, pool);
+	return 0;
+}
+
+/*
+ * Apply the batch of the backlog, then clear all of its records
+ */
+static int lcrp_changelog_drain_flush(struct lcrp_source *source,
+				      const char *dir_fid,
+				      struct lcrp_epoch_reader *reader,
+				      struct lcrp_changelog_clear *clear,
+				      struct lcrp_worker_pool *pool,
+				      struct lcrp_drain *drain)
+{
+	int rc;
+
+	if (drain == NULL || drain->ldr_records == 0)
+		return 0;
+
+	rc = lcrp_drain_apply(drain, dir_fid, reader);
+	if (rc)
 		return rc;
+
+	/* Records before the batch might still be handled by workers */
+	if (pool != NULL) {
+		rc = lcrp_worker_pool_skip(pool, drain->ldr_last_index);
+		if (rc)
+			return rc;
+	} else {
+		clear->lcc_index = drain->ldr_last_index;
 	}
+	clear->lcc_pending += drain->ldr_records;
+	lcrp_drain_reset(drain);
+	return lcrp_changelog_clear_flush(source, clear, pool);
 }
 
 /*
  * return "enum changelog_record_status" if no error, or the error is
  * recoverable; return negative error if unrecoverable failure.
  */
-static int lcrp_changelog_parse_record(void *changelog_priv,
-				       const char *dir_fid,
-				       struct lcrp_epoch *epoch,
-				       const char *mdt_device,
-				       const char *changelog_user)
+int lcrp_changelog_parse_record(struct lcrp_source *source,
+				const char *dir_fid,
+				struct lcrp_epoch_reader *reader,
+				struct lcrp_changelog_clear *clear,
+				struct lcrp_changelog_filter *filter,
+				struct lcrp_worker_pool *pool,
+				struct lcrp_drain *drain)
 {
 	int rc;
+	int start;
+	bool draining;
 	struct changelog_rec *rec;
 	struct lu_fid fid;
+	struct lcrp_epoch *epoch = reader->ler_epoch;
+	struct lcrp_index *index;
 
-	rc = lcrp_changelog_recv(changelog_priv, &rec);
+	rc = lcrp_source_recv(source, &rec);
 	if (rc < 0) {
 		LERROR("failed to read changelog: %s\n",
 			strerror(-rc));
 		return rc;
-	} else if (rc == LRS_EOF || rc == LRS_RETRY || rc == LRS_RESTART) {
+	} else if (rc == LRS_EOF || rc == LRS_RETRY || rc == LRS_RESTART ||
+		   rc == LRS_IDLE) {
 		return rc;
 	}
 
 	LASSERT(rc == LRS_OK);
+	draining = lcrp_drain_active(drain, rec);
+	if (!lcrp_changelog_filter_match(filter, rec)) {
+		lcrp_changelog_record_done(reader, rec->cr_time);
+		/* Cleared together with the batch */
+		if (draining) {
+			lcrp_drain_add(drain, NULL, 0, rec);
+			goto drain;
+		}
+		/* Nothing to wait for before clearing it */
+		if (pool != NULL) {
+			rc = lcrp_worker_pool_skip(pool, rec->cr_index);
+			if (rc) {
+				LERROR("failed to queue spilled records on workers\n");
+				goto out;
+			}
+		}
+		goto clear;
+	}
+
 	rc = lcrp_get_record_fid(rec, &fid);
 	if (rc) {
 		LERROR("failed to get fid of record\n");
 		goto out;
 	}
 
-	rc = lcrp_update_fid(dir_fid, epoch, &fid);
-	if (rc)  {
-		LERROR("failed to update access of fid "DFID"\n",
-			PFID(&fid));
-		goto out;
+	/* Records of the backlog belong to the epoch of their time */
+	if (draining)
+		start = lcrp_drain_epoch(epoch, rec->cr_time);
+	else
+		start = __atomic_load_n(&epoch->le_start, __ATOMIC_RELAXED);
+
+	/*
+	 * Heat counts every access, even the ones in the FID cache. Workers
+	 * and batches of the backlog update it off the receive path.
+	 */
+	index = epoch->le_index;
+	if (pool == NULL && !draining && index != NULL &&
+	    index->li_half_life > 0) {
+		rc = lcrp_index_heat(index, &fid, start, rec->cr_time >> 30);
+		if (rc) {
+			LERROR("failed to update heat of fid "DFID"\n",
+			       PFID(&fid));
+			goto out;
+		}
 	}
 
-	/* clear entry */
-	rc = llapi_changelog_clear(mdt_device,
-				   changelog_user,
-				   rec->cr_index);
-	if (rc) {
-		LERROR("failed to clear record %lld\n", rec->cr_index);
-		goto out;
+	if (draining) {
+		lcrp_drain_add(drain, &fid, start, rec);
+		goto drain;
+	}
+
+	if (pool != NULL) {
+		rc = lcrp_worker_pool_dispatch(pool, &fid, rec->cr_index,
+					       rec->cr_time);
+		if (rc) {
+			LERROR("failed to dispatch fid "DFID" to worker\n",
+			       PFID(&fid));
+			goto out;
+		}
+	} else {
+		rc = lcrp_update_fid(dir_fid, reader, &fid);
+		if (rc)  {
+			LERROR("failed to update access of fid "DFID"\n",
+			       PFID(&fid));
+			goto out;
+		}
+		lcrp_changelog_record_done(reader, rec->cr_time);
 	}
 
+clear:
+	rc = lcrp_changelog_clear_record(source, clear, pool, rec->cr_index);
+	if (rc)
+		LERROR("failed to clear record %lld\n", rec->cr_index);
+	goto out;
+
+drain:
+	if (drain->ldr_records < drain->ldr_batch_records)
+		goto out;
+	rc = lcrp_changelog_drain_flush(source, dir_fid, reader, clear, pool,
+					drain);
+	if (rc)
+		LERROR("failed to apply backlog up to record %lld\n",
+		       rec->cr_index);
 out:
-	llapi_changelog_free(&rec);
+	lcrp_source_free(source, &rec);
 	return rc;
 }
 
@@ -337,28 +898,59 @@ out:
  * return "enum changelog_record_status" if no error, or the error is
  * recoverable; return negative error if unrecoverable failure.
  */
-static int lcrp_changelog_parse_records(void *changelog_priv,
+static int lcrp_changelog_parse_records(struct lcrp_source *source,
 					const char *dir_fid,
-					struct lcrp_epoch *epoch,
-					const char *mdt_device,
-					const char *changelog_user,
+					struct lcrp_epoch_reader *reader,
+					struct lcrp_changelog_clear *clear,
+					struct lcrp_changelog_filter *filter,
+					struct lcrp_worker_pool *pool,
+					struct lcrp_drain *drain,
 					bool *stopping)
 {
 	int rc = 0;
+	int ret;
 
 	while (!*stopping) {
-		rc = lcrp_changelog_parse_record(changelog_priv, dir_fid,
-						 epoch, mdt_device,
-						 changelog_user);
+		rc = lcrp_changelog_parse_record(source, dir_fid, reader,
+						 clear, filter, pool, drain);
 		if (rc < 0) {
 			LERROR("failed to parse record of Changelog: %s\n",
 			       strerror(-rc));
 			break;
-		} else if (rc == LRS_EOF) {
-			LINFO("no record to parse, sleep for [%d] seconds waiting for new ones\n",
-			      LCRP_INTERVAL_EOF);
-			sleep(LCRP_INTERVAL_EOF);
-			break;
+		} else if (rc == LRS_EOF || rc == LRS_IDLE) {
+			ret = rc;
+			/* No need to wait for a full batch */
+			rc = lcrp_changelog_drain_flush(source, dir_fid, reader,
+							clear, pool, drain);
+			if (rc) {
+				LERROR("failed to apply backlog\n");
+				break;
+			}
+			/*
+			 * Waiting for the workers when idle would tie the
+			 * reader to the slowest one again, so only clear up
+			 * to the watermark then.
+			 */
+			if (pool != NULL && ret == LRS_EOF) {
+				rc = lcrp_worker_pool_drain(pool);
+				if (rc) {
+					LERROR("failed to handle records by workers\n");
+					break;
+				}
+			}
+			rc = lcrp_changelog_clear_flush(source, clear, pool);
+			if (rc) {
+				LERROR("failed to clear processed records\n");
+				break;
+			}
+			lcrp_epoch_reader_flush(reader);
+			lcrp_changelog_filter_log(filter,
+						  source->lsrc_mdt_device);
+			lcrp_source_wait(source);
+			rc = ret;
+			/* Restart the reader to see new records */
+			if (rc == LRS_EOF)
+				break;
 		} else if (rc == LRS_RESTART) {
 			LINFO("need to restart for failure, sleep for [%d] seconds before restarting\n",
 			      LCRP_INTERVAL_RETRY);
@@ -380,42 +972,106 @@ static int lcrp_changelog_parse_records(void *changelog_priv,
  * recoverable; return negative error if unrecoverable failure.
  */
 int lcrp_changelog_consume(const char *dir_fid, struct lcrp_epoch *epoch,
-			   const char *mdt_device, const char *changelog_user,
+			   struct lcrp_source *source,
+			   struct lcrp_changelog_clear *clear,
+			   struct lcrp_changelog_filter *filter, int workers,
 			   bool *stopping)
 {
 	int rc = 0;
-	void *changelog_priv;
-	enum changelog_send_flag flags =  (CHANGELOG_FLAG_BLOCK |
-					   CHANGELOG_FLAG_JOBID |
-					   CHANGELOG_FLAG_EXTRA_FLAGS);
+	int ret;
+	struct lcrp_worker_pool pool;
+	struct lcrp_worker_pool *worker_pool = NULL;
+	struct lcrp_drain drain;
+	struct lcrp_drain *backlog = NULL;
+	struct lcrp_epoch_reader reader;
+	unsigned long cache_size = lcrp_status->ls_fid_cache_size;
+	int fd_budget = lcrp_reader_fd_budget(workers);
+	char spill_file[PATH_MAX + 1];
 
-	rc = llapi_changelog_start(&changelog_priv, flags,
-				   mdt_device, 0);
-	if (rc < 0) {
-		LERROR("failed to open Changelog file for %s: %s\n",
-		       mdt_device, strerror(-rc));
-		return rc;
+	if (workers > 0) {
+		rc = lcrp_worker_pool_init(&pool, workers,
+					   lcrp_worker_queue_depth(workers),
+					   lcrp_spill_file(source, spill_file,
+							   sizeof(spill_file)),
+					   dir_fid, epoch, cache_size,
+					   fd_budget);
+		if (rc) {
+			LERROR("failed to start [%d] workers\n", workers);
+			return rc;
+		}
+		worker_pool = &pool;
+		/* Only workers update FIDs */
+		cache_size = 0;
+		fd_budget = 0;
 	}
 
-	rc = llapi_changelog_set_xflags(changelog_priv,
-					CHANGELOG_EXTRA_FLAG_UIDGID |
-					CHANGELOG_EXTRA_FLAG_NID |
-					CHANGELOG_EXTRA_FLAG_OMODE |
-					CHANGELOG_EXTRA_FLAG_XATTR);
-	if (rc < 0) {
-		LERROR("failed to set xflags for Changelog: %s\n",
-		       strerror(-rc));
-		goto out;
+	rc = lcrp_epoch_reader_init(&reader, epoch, cache_size, fd_budget);
+	if (rc) {
+		LERROR("failed to init reader of epoch\n");
+		goto out_pool;
+	}
+
+	if (lcrp_status->ls_drain_lag > 0) {
+		rc = lcrp_drain_init(&drain, lcrp_status->ls_drain_lag,
+				     lcrp_status->ls_drain_batch_records);
+		if (rc) {
+			LERROR("failed to init drain of backlog\n");
+			goto out_reader;
+		}
+		backlog = &drain;
 	}
 
-	rc = lcrp_changelog_parse_records(changelog_priv, dir_fid, epoch,
-					  mdt_device, changelog_user, stopping);
+	/* Records that have been applied are not read again on restart */
+	source->lsrc_resume_index = clear->lcc_index;
+	rc = lcrp_source_start(source);
 	if (rc < 0) {
+		LERROR("failed to start reading Changelog\n");
+		goto out_drain;
+	}
+
+	gettimeofday(&clear->lcc_time, NULL);
+	rc = lcrp_changelog_parse_records(source, dir_fid, &reader, clear,
+					  filter, worker_pool, backlog,
+					  stopping);
+	if (rc < 0)
 		LERROR("failed to parse Changelog records\n");
-		goto out;
+
+	/* Records of the batch are read again if it is not applied */
+	if (rc >= 0 && !*stopping) {
+		ret = lcrp_changelog_drain_flush(source, dir_fid, &reader,
+						 clear, worker_pool, backlog);
+		if (ret) {
+			LERROR("failed to apply backlog\n");
+			rc = ret;
+		}
 	}
 
-out:
-	llapi_changelog_fini(&changelog_priv);
+	if (worker_pool != NULL) {
+		ret = lcrp_worker_pool_drain(worker_pool);
+		if (ret) {
+			LERROR("failed to handle records by workers\n");
+			if (rc >= 0)
+				rc = ret;
+		}
+	}
+
+	/* Records that have been processed can be cleared even on failure */
+	ret = lcrp_changelog_clear_flush(source, clear, worker_pool);
+	if (ret) {
+		LERROR("failed to clear processed records\n");
+		if (rc >= 0)
+			rc = ret;
+	}
+
+	lcrp_changelog_filter_log(filter, source->lsrc_mdt_device);
+	lcrp_source_fini(source);
+out_drain:
+	if (backlog != NULL)
+		lcrp_drain_fini(backlog);
+out_reader:
+	lcrp_epoch_reader_fini(&reader);
+out_pool:
+	if (worker_pool != NULL)
+		lcrp_worker_pool_fini(worker_pool);
 	return rc;
 }
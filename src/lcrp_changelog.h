@@ -9,31 +9,106 @@
 #define _LCRP_CHANGELOG_H_
 
 #include <pthread.h>
+#include <sys/time.h>
+#include "lcrp_epoch.h"
+#include "lcrp_source.h"
 
-struct lcrp_epoch {
-	/* Lock to protect when epoch changes */
-	pthread_mutex_t	le_mutex;
-	/* Epoch interval in seconds, should >= LCRP_MIN_EPOCH_INTERVAL */
-	int le_seconds;
-	/**
-	 * Start epoch time of active directory
-	 * Should be N * le_seconds, N = current_time / le_seconds * le_seconds
-	 *
-	 * The active time is (N * le_seconds, (N + 1) * le_seconds]
-	 * The secondary time is ((N - 1) * le_seconds, N * le_seconds]
-	 * The inactive time is (0, (N - 1) * le_seconds]
+/* Bits of cr_openflags in the OMODE extension, same as MDS_FMODE_* */
+#define LCRP_OPEN_MODE_READ	0x1
+#define LCRP_OPEN_MODE_WRITE	0x2
+#define LCRP_OPEN_MODE_EXEC	0x4
+#define LCRP_OPEN_MODE_ALL	(LCRP_OPEN_MODE_READ | LCRP_OPEN_MODE_WRITE | \
+				 LCRP_OPEN_MODE_EXEC)
+
+/*
+ * Records that count as access, and the mix of the received records.
+ * Records that do not count are dropped before any filesystem work.
+ */
+struct lcrp_changelog_filter {
+	/* Record types that count as access */
+	bool			lcf_types[CL_LAST];
+	/* Open modes that count as access, LCRP_OPEN_MODE_* */
+	unsigned int		lcf_open_modes;
+	/* Number of received records of each type */
+	unsigned long long	lcf_received[CL_LAST];
+	/* Number of received records of each type that have been dropped */
+	unsigned long long	lcf_dropped[CL_LAST];
+	/* Number of received records of unknown types, all dropped */
+	unsigned long long	lcf_unknown;
+	/* Number of received records when the counters were last logged */
+	unsigned long long	lcf_logged;
+	/* Time when the counters were last logged */
+	time_t			lcf_log_time;
+};
+
+struct lcrp_changelog_clear {
+	/* Clear after this number of records have been processed */
+	int			lcc_batch_records;
+	/* Clear after this number of milliseconds since the last clear */
+	int			lcc_batch_msec;
+	/* Largest index of the records that have been processed */
+	unsigned long long	lcc_index;
+	/* Largest index of the records that have been cleared */
+	unsigned long long	lcc_cleared;
+	/* Number of records that have been processed but not cleared */
+	int			lcc_pending;
+	/* Time of the last clear */
+	struct timeval		lcc_time;
+	/* Number of llapi_changelog_clear() calls */
+	unsigned long long	lcc_clears;
+	/* Number of llapi_changelog_clear() calls saved by batching */
+	unsigned long long	lcc_saved;
+	/*
+	 * File that saves the largest index of the records that have been
+	 * applied, so that reading restarts after it. Empty to disable.
 	 */
-	int le_start;
-	/* Directory of this epoch under active, protected by ls_mutex */
-	char le_dir_active[PATH_MAX + 1];
+	char			lcc_checkpoint[PATH_MAX + 1];
+	/* Save the checkpoint after this number of records */
+	int			lcc_checkpoint_records;
+	/* Number of records that have been processed since the last save */
+	int			lcc_checkpoint_pending;
+	/* Largest index saved in the checkpoint */
+	unsigned long long	lcc_checkpointed;
 };
 
+/* Buffer size of the name of FID file */
+#define LCRP_FID_NAMELEN 64
+/* Maximum number of FIDs linked by a batch, each takes 4 operations */
+#define LCRP_LINK_BATCH (LCRP_IO_DEPTH / 4)
+
+struct lcrp_worker_pool;
+struct lcrp_drain;
+
+extern __thread unsigned long long lcrp_syscall_count;
+
 int lcrp_find_or_mkdir(const char *path);
+int lcrp_get_fid_name(const struct lu_fid *fid, char *buffer, int size);
+int lcrp_update_fid(const char *dir_fid, struct lcrp_epoch_reader *reader,
+		    struct lu_fid *fid);
+int lcrp_update_fids(const char *dir_fid, struct lcrp_epoch_reader *reader,
+		     struct lu_fid *fids, int count);
+int lcrp_link_fids(struct lcrp_io *io, int fd_fids, int fd_dest,
+		   const struct lu_fid *fids, int count);
+int lcrp_changelog_checkpoint_load(struct lcrp_changelog_clear *clear);
+int lcrp_changelog_clear_flush(struct lcrp_source *source,
+			       struct lcrp_changelog_clear *clear,
+			       struct lcrp_worker_pool *pool);
+int lcrp_changelog_parse_record(struct lcrp_source *source,
+				const char *dir_fid,
+				struct lcrp_epoch_reader *reader,
+				struct lcrp_changelog_clear *clear,
+				struct lcrp_changelog_filter *filter,
+				struct lcrp_worker_pool *pool,
+				struct lcrp_drain *drain);
 int lcrp_changelog_consume(const char *dir_fid, struct lcrp_epoch *epoch,
-			   const char *mdt_device, const char *changelog_user,
+			   struct lcrp_source *source,
+			   struct lcrp_changelog_clear *clear,
+			   struct lcrp_changelog_filter *filter, int workers,
 			   bool *stopping);
-int lcrp_find_or_create_fid(const char *dir_fid, char *buf, int buf_size,
-			    struct lu_fid *fid);
-int lcrp_find_or_link_fid(const char *root, struct lu_fid *fid,
-			  const char *fid_path);
+void lcrp_changelog_filter_log(struct lcrp_changelog_filter *filter,
+			       const char *mdt_device);
+void lcrp_changelog_record_done(struct lcrp_epoch_reader *reader,
+				unsigned long long time);
+int lcrp_find_or_create_at(int dirfd, const char *name);
+int lcrp_find_or_link_at(int old_dirfd, int new_dirfd, const char *name);
 #endif /* _LCRP_CHANGELOG_H_ */
@@ -0,0 +1,547 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Cleanup of retired epochs under the inactive directory, and merge of
+ * epochs into the coarser directories of the next tier, which work the
+ * same way.
+ *
+ * The bucket directories of an epoch are split among cleanup threads,
+ * which read them with large getdents64() buffers. The lowest bucket that
+ * is not finished yet is saved in a checkpoint file, so that the cleanup
+ * resumes from there after restart.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "lcrp_changelog.h"
+#include "lcrp_cleanup.h"
+#include "lcrp_stats.h"
+
+/* Entry returned by getdents64(), which is not declared by glibc */
+struct lcrp_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+
+/*
+ * Wait until the next file can be cleaned up within the budget. Return
+ * -EINTR if the cleanup should stop.
+ */
+int lcrp_cleanup_budget_charge(struct lcrp_cleanup_budget *budget)
+{
+	unsigned long long count;
+	long long expected_nsec;
+	long long elapsed_nsec;
+	struct timespec now;
+	struct timespec delay;
+
+	if (lcrp_status->ls_stopping ||
+	    (budget->lcb_stopping != NULL && *budget->lcb_stopping))
+		return -EINTR;
+
+	count = __atomic_fetch_add(&budget->lcb_count, 1, __ATOMIC_RELAXED);
+	if (budget->lcb_rate <= 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_nsec = (now.tv_sec - budget->lcb_start.tv_sec) *
+		1000000000LL + now.tv_nsec - budget->lcb_start.tv_nsec;
+	expected_nsec = count * 1000000000LL / budget->lcb_rate;
+	if (expected_nsec <= elapsed_nsec)
+		return 0;
+
+	delay.tv_sec = (expected_nsec - elapsed_nsec) / 1000000000LL;
+	delay.tv_nsec = (expected_nsec - elapsed_nsec) % 1000000000LL;
+	nanosleep(&delay, NULL);
+	return 0;
+}
+
+/*
+ * Return the bucket to resume the cleanup of the epoch directory from, 0
+ * if there is no checkpoint of it.
+ */
+static unsigned int lcrp_cleanup_checkpoint_load(const char *root)
+{
+	FILE *fp;
+	size_t len;
+	unsigned int bucket;
+	char saved[PATH_MAX + 2];
+	const char *path = lcrp_status->ls_cleanup_checkpoint;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			LWARN("failed to open checkpoint [%s]: %s, ignoring\n",
+			      path, strerror(errno));
+		return 0;
+	}
+
+	/* Path is the rest of the line, which could have spaces */
+	if (fscanf(fp, "%u ", &bucket) != 1 ||
+	    bucket > LCRP_BUCKET_COUNT ||
+	    fgets(saved, sizeof(saved), fp) == NULL) {
+		LWARN("invalid checkpoint [%s], ignoring\n", path);
+		bucket = 0;
+	} else {
+		len = strlen(saved);
+		if (len > 0 && saved[len - 1] == '\n')
+			saved[len - 1] = '\0';
+		if (strcmp(saved, root) != 0)
+			bucket = 0;
+	}
+	fclose(fp);
+	return bucket;
+}
+
+/*
+ * Save the watermark of the job by replacing the checkpoint file, caller
+ * should hold lcj_mutex.
+ */
+static int lcrp_cleanup_checkpoint_save(struct lcrp_cleanup_job *job)
+{
+	int rc;
+	FILE *fp;
+	char tmp[PATH_MAX + sizeof(".tmp")];
+	const char *path = lcrp_status->ls_cleanup_checkpoint;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		LERROR("failed to open [%s]: %s\n", tmp, strerror(errno));
+		return -errno;
+	}
+	fprintf(fp, "%u %s\n", job->lcj_watermark, job->lcj_root);
+	/* Make the content durable before the rename replaces the old file */
+	if (fflush(fp) || fsync(fileno(fp))) {
+		rc = -errno;
+		LERROR("failed to write [%s]: %s\n", tmp, strerror(-rc));
+		fclose(fp);
+		return rc;
+	}
+	rc = fclose(fp);
+	if (rc) {
+		LERROR("failed to write [%s]: %s\n", tmp, strerror(errno));
+		return -errno;
+	}
+
+	rc = rename(tmp, path);
+	if (rc) {
+		LERROR("failed to rename [%s] to [%s]: %s\n", tmp, path,
+		       strerror(errno));
+		return -errno;
+	}
+	job->lcj_unsaved = 0;
+	return 0;
+}
+
+static void lcrp_cleanup_checkpoint_remove(void)
+{
+	int rc;
+	const char *path = lcrp_status->ls_cleanup_checkpoint;
+
+	rc = unlink(path);
+	if (rc && errno != ENOENT)
+		LWARN("failed to remove checkpoint [%s]: %s\n", path,
+		      strerror(errno));
+}
+
+/*
+ * Do the queued links of files in a bucket, then unlink the files that
+ * are in the destination now. A file is never unlinked if its link failed,
+ * which io_uring does not guarantee for linked SQEs, so the unlinks are
+ * another batch instead of being chained after the links.
+ */
+static int lcrp_cleanup_flush(struct lcrp_cleanup_worker *worker,
+			      const char *bucket)
+{
+	int i;
+	int rc;
+	int count = 0;
+	struct lcrp_io_op *op;
+	struct lcrp_io *io = &worker->lcw_io;
+	struct lcrp_cleanup_job *job = worker->lcw_job;
+
+	rc = lcrp_io_submit(io);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < io->lio_count; i++) {
+		op = &io->lio_ops[i];
+		/* A FID accessed in several epochs is already there */
+		if (op->lio_result && op->lio_result != -EEXIST) {
+			LERROR("failed to link [%s/%s/%s] to [%s/%s]: %s\n",
+			       job->lcj_root, bucket, op->lio_path,
+			       job->lcj_dest, bucket,
+			       strerror(-op->lio_result));
+			return op->lio_result;
+		}
+		/* Reuse the operation, which has the same dirfd and path */
+		op->lio_opcode = LCRP_IO_UNLINK;
+		op->lio_flags = 0;
+	}
+
+	rc = lcrp_io_submit(io);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < io->lio_count; i++) {
+		op = &io->lio_ops[i];
+		if (op->lio_result) {
+			LERROR("failed to unlink [%s/%s/%s]: %s\n",
+			       job->lcj_root, bucket, op->lio_path,
+			       strerror(-op->lio_result));
+			rc = op->lio_result;
+			break;
+		}
+		count++;
+	}
+	lcrp_stats_add(LCRP_COUNTER_CLEANUP_FILES, count);
+	lcrp_io_reset(io);
+	return rc;
+}
+
+/*
+ * Link the files under $EPOCH/$BUCKET into the same bucket of the
+ * destination, e.g. inactive/all, then remove the bucket directory.
+ *
+ * The files are hard links of the ones under fids, so they are linked
+ * into the destination directly. A FID accessed in several epochs is
+ * already there, and only one link is kept. If the bucket of the
+ * destination is missing or empty, the whole bucket is renamed instead.
+ * The files are moved by batches of links and unlinks.
+ */
+static int lcrp_cleanup_bucket(struct lcrp_cleanup_worker *worker,
+			       unsigned int bucket, bool *leftover)
+{
+	int rc = 0;
+	long nread;
+	long offset;
+	int hash_fd;
+	int bucket_fd = -1;
+	struct lu_fid fid;
+	struct lcrp_io_op *op;
+	struct lcrp_dirent64 *dirent;
+	struct lcrp_io *io = &worker->lcw_io;
+	struct lcrp_cleanup_job *job = worker->lcw_job;
+	char name[LCRP_BUCKET_NAMELEN];
+
+	snprintf(name, sizeof(name), LCRP_BUCKET_FORMAT, bucket);
+	rc = renameat(job->lcj_epoch_fd, name, job->lcj_dest_fd, name);
+	if (rc == 0)
+		return 0;
+	/* Never created, or removed before restart */
+	if (errno == ENOENT)
+		return 0;
+	if (errno != EEXIST && errno != ENOTEMPTY) {
+		LERROR("failed to rename [%s/%s] to [%s/%s]: %s\n",
+		       job->lcj_root, name, job->lcj_dest, name,
+		       strerror(errno));
+		return -errno;
+	}
+	rc = 0;
+
+	hash_fd = openat(job->lcj_epoch_fd, name, O_RDONLY | O_DIRECTORY);
+	if (hash_fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		LERROR("failed to open directory [%s/%s]: %s\n",
+		       job->lcj_root, name, strerror(errno));
+		return -errno;
+	}
+
+	while (rc == 0) {
+		nread = syscall(SYS_getdents64, hash_fd, worker->lcw_dents,
+				LCRP_CLEANUP_DENTS_SIZE);
+		if (nread < 0) {
+			LERROR("failed to read directory [%s/%s]: %s\n",
+			       job->lcj_root, name, strerror(errno));
+			rc = -errno;
+			break;
+		}
+		if (nread == 0)
+			break;
+
+		for (offset = 0; offset < nread; offset += dirent->d_reclen) {
+			dirent = (struct lcrp_dirent64 *)
+				(worker->lcw_dents + offset);
+
+			/* skip "." and ".." */
+			if (strcmp(dirent->d_name, ".") == 0 ||
+			    strcmp(dirent->d_name, "..") == 0)
+				continue;
+
+			/* In lcrp_update_fid(), file name is FID */
+			if (sscanf(dirent->d_name, SFID, RFID(&fid)) != 3 ||
+			    strlen(dirent->d_name) >= LCRP_IO_PATHLEN) {
+				LWARN("invalid name pattern of file [%s/%s/%s], ignoring\n",
+				      job->lcj_root, name, dirent->d_name);
+				*leftover = true;
+				continue;
+			}
+
+			rc = lcrp_cleanup_budget_charge(job->lcj_budget);
+			if (rc)
+				break;
+
+			/* Empty buckets are common, so create it lazily */
+			if (bucket_fd < 0) {
+				rc = mkdirat(job->lcj_dest_fd, name, 0755);
+				if (rc && errno != EEXIST) {
+					LERROR("failed to create directory [%s/%s]: %s\n",
+					       job->lcj_dest, name,
+					       strerror(errno));
+					rc = -errno;
+					break;
+				}
+				rc = 0;
+				bucket_fd = openat(job->lcj_dest_fd, name,
+						   O_RDONLY | O_DIRECTORY);
+				if (bucket_fd < 0) {
+					LERROR("failed to open directory [%s/%s]: %s\n",
+					       job->lcj_dest, name,
+					       strerror(errno));
+					rc = -errno;
+					break;
+				}
+			}
+
+			op = lcrp_io_queue(io, LCRP_IO_LINK, hash_fd,
+					   dirent->d_name);
+			op->lio_dirfd2 = bucket_fd;
+			strcpy(op->lio_path2, op->lio_path);
+			if (lcrp_io_space(io) == 0) {
+				rc = lcrp_cleanup_flush(worker, name);
+				if (rc)
+					break;
+			}
+		}
+		/* Finish the files of this read before the next one */
+		if (rc == 0)
+			rc = lcrp_cleanup_flush(worker, name);
+	}
+	lcrp_io_reset(io);
+	if (bucket_fd >= 0)
+		close(bucket_fd);
+	close(hash_fd);
+
+	if (rc == 0 && !*leftover) {
+		rc = unlinkat(job->lcj_epoch_fd, name, AT_REMOVEDIR);
+		if (rc) {
+			LERROR("failed to rmdir [%s/%s]: %s\n",
+			       job->lcj_root, name, strerror(errno));
+			rc = -errno;
+		}
+	}
+	return rc;
+}
+
+/*
+ * Mark the bucket as finished, and save a checkpoint once in a while
+ */
+static void lcrp_cleanup_finish(struct lcrp_cleanup_job *job,
+				unsigned int bucket, bool leftover)
+{
+	pthread_mutex_lock(&job->lcj_mutex);
+	if (leftover)
+		job->lcj_leftover = true;
+	job->lcj_done[bucket] = 1;
+	while (job->lcj_watermark < LCRP_BUCKET_COUNT &&
+	       job->lcj_done[job->lcj_watermark])
+		job->lcj_watermark++;
+	job->lcj_unsaved++;
+	/* A failure only costs rescanning some buckets after restart */
+	if (job->lcj_unsaved >= LCRP_CLEANUP_CHECKPOINT_BUCKETS)
+		lcrp_cleanup_checkpoint_save(job);
+	pthread_mutex_unlock(&job->lcj_mutex);
+}
+
+static void *lcrp_cleanup_thread(void *arg)
+{
+	int rc;
+	bool leftover;
+	unsigned int bucket;
+	struct lcrp_cleanup_worker *worker = arg;
+	struct lcrp_cleanup_job *job = worker->lcw_job;
+
+	while (__atomic_load_n(&job->lcj_error, __ATOMIC_RELAXED) == 0) {
+		bucket = __atomic_fetch_add(&job->lcj_next, 1,
+					    __ATOMIC_RELAXED);
+		if (bucket >= LCRP_BUCKET_COUNT)
+			break;
+
+		leftover = false;
+		rc = lcrp_cleanup_bucket(worker, bucket, &leftover);
+		if (rc) {
+			pthread_mutex_lock(&job->lcj_mutex);
+			if (job->lcj_error == 0)
+				job->lcj_error = rc;
+			pthread_mutex_unlock(&job->lcj_mutex);
+			break;
+		}
+		lcrp_cleanup_finish(job, bucket, leftover);
+	}
+	worker->lcw_general.lti_stopped = true;
+	return NULL;
+}
+
+static int lcrp_cleanup_run(struct lcrp_cleanup_job *job, int threads)
+{
+	int i;
+	int rc = 0;
+	int started = 0;
+	struct lcrp_cleanup_worker *workers;
+
+	workers = calloc(threads, sizeof(*workers));
+	if (workers == NULL) {
+		LERROR("failed to allocate [%d] cleanup threads\n", threads);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < threads; i++) {
+		workers[i].lcw_job = job;
+		workers[i].lcw_dents = malloc(LCRP_CLEANUP_DENTS_SIZE);
+		if (workers[i].lcw_dents == NULL) {
+			LERROR("failed to allocate buffer of cleanup thread\n");
+			rc = -ENOMEM;
+			break;
+		}
+		rc = lcrp_io_init(&workers[i].lcw_io, lcrp_status->ls_io_uring);
+		if (rc)
+			break;
+		rc = lcrp_thread_start(&workers[i].lcw_general,
+				       &lcrp_cleanup_thread, &workers[i]);
+		if (rc) {
+			LERROR("failed to start cleanup thread\n");
+			break;
+		}
+		started++;
+	}
+
+	/* Let the started threads finish the job even if some failed */
+	for (i = 0; i < started; i++) {
+		if (pthread_join(workers[i].lcw_general.lti_thread_id, NULL))
+			LERROR("failed to join cleanup thread\n");
+	}
+	for (i = 0; i < threads; i++) {
+		lcrp_io_fini(&workers[i].lcw_io);
+		free(workers[i].lcw_dents);
+	}
+	free(workers);
+
+	if (started == 0)
+		return rc;
+	return job->lcj_error;
+}
+
+/*
+ * Cleanup the epoch directory dir/name by merging it into dest with the
+ * given number of threads. Return -EINTR if stopped, in which case a
+ * checkpoint is saved.
+ */
+int lcrp_cleanup_epoch(const char *dir, const char *name, const char *dest,
+		       int threads, struct lcrp_cleanup_budget *budget)
+{
+	int rc;
+	int ret;
+	int dir_fd;
+	struct lcrp_cleanup_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		LERROR("failed to allocate cleanup job of [%s]\n", name);
+		return -ENOMEM;
+	}
+	job->lcj_dest = dest;
+	job->lcj_budget = budget;
+	job->lcj_epoch_fd = -1;
+	job->lcj_dest_fd = -1;
+	snprintf(job->lcj_root, sizeof(job->lcj_root), "%s/%s", dir, name);
+	pthread_mutex_init(&job->lcj_mutex, NULL);
+
+	dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		LERROR("failed to open directory [%s]: %s\n", dir,
+		       strerror(errno));
+		rc = -errno;
+		goto out;
+	}
+
+	job->lcj_epoch_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+	if (job->lcj_epoch_fd < 0) {
+		LERROR("failed to open directory [%s]: %s\n",
+		       job->lcj_root, strerror(errno));
+		rc = -errno;
+		goto out;
+	}
+
+	/* The coarser directory might have been moved to the next tier */
+	rc = lcrp_find_or_mkdir(dest);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n", dest);
+		goto out;
+	}
+
+	job->lcj_dest_fd = open(dest, O_RDONLY | O_DIRECTORY);
+	if (job->lcj_dest_fd < 0) {
+		LERROR("failed to open directory [%s]: %s\n", dest,
+		       strerror(errno));
+		rc = -errno;
+		goto out;
+	}
+
+	job->lcj_watermark = lcrp_cleanup_checkpoint_load(job->lcj_root);
+	job->lcj_next = job->lcj_watermark;
+	if (job->lcj_watermark > 0)
+		LINFO("resuming cleanup of [%s] from bucket [%u]\n",
+		      job->lcj_root, job->lcj_watermark);
+
+	rc = lcrp_cleanup_run(job, threads < 1 ? 1 : threads);
+	if (rc) {
+		pthread_mutex_lock(&job->lcj_mutex);
+		ret = lcrp_cleanup_checkpoint_save(job);
+		pthread_mutex_unlock(&job->lcj_mutex);
+		if (ret)
+			LERROR("failed to save checkpoint of [%s]\n",
+			       job->lcj_root);
+		goto out;
+	}
+
+	/* Keep the epoch if files with invalid names are left in it */
+	if (!job->lcj_leftover) {
+		rc = unlinkat(dir_fd, name, AT_REMOVEDIR);
+		if (rc && errno == ENOTEMPTY) {
+			LWARN("unexpected files left in [%s], ignoring\n",
+			      job->lcj_root);
+			rc = 0;
+		} else if (rc) {
+			LERROR("failed to rmdir [%s]: %s\n",
+			       job->lcj_root, strerror(errno));
+			rc = -errno;
+			goto out;
+		}
+	}
+	lcrp_cleanup_checkpoint_remove();
+out:
+	if (job->lcj_dest_fd >= 0)
+		close(job->lcj_dest_fd);
+	if (job->lcj_epoch_fd >= 0)
+		close(job->lcj_epoch_fd);
+	if (dir_fd >= 0)
+		close(dir_fd);
+	pthread_mutex_destroy(&job->lcj_mutex);
+	free(job);
+	return rc;
+}
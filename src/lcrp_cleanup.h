@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_CLEANUP_H_
+#define _LCRP_CLEANUP_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+#include "lcrp_dircache.h"
+#include "lcrp_io.h"
+#include "lcrpd.h"
+
+/* Size of the buffer of each cleanup thread to read directory entries */
+#define LCRP_CLEANUP_DENTS_SIZE (1024 * 1024)
+/* Number of finished buckets between two checkpoints */
+#define LCRP_CLEANUP_CHECKPOINT_BUCKETS 1024
+
+/*
+ * Limit of the files cleaned up per second, so that cleanup does not take
+ * the bandwidth of MDT and disk from updating FIDs. Shared by all cleanup
+ * threads.
+ */
+struct lcrp_cleanup_budget {
+	/* Files per second, 0 for unlimited */
+	int			 lcb_rate;
+	/* Number of files cleaned up since lcb_start, updated atomically */
+	unsigned long long	 lcb_count;
+	/* Start time of this cleanup pass */
+	struct timespec		 lcb_start;
+	/* Cleanup should abort when set, could be NULL */
+	bool			*lcb_stopping;
+};
+
+/*
+ * Cleanup of one retired epoch by merging it into another directory.
+ * Cleanup threads take bucket directories in increasing order, the buckets
+ * below lcj_watermark are all finished.
+ */
+struct lcrp_cleanup_job {
+	/* Path of the epoch directory, also the key of the checkpoint */
+	char				 lcj_root[PATH_MAX + 1];
+	/* Path of the directory to merge into, for logs */
+	const char			*lcj_dest;
+	/* Fd of the epoch directory */
+	int				 lcj_epoch_fd;
+	/* Fd of the directory to merge into, e.g. inactive/all */
+	int				 lcj_dest_fd;
+	/* Rate limit of the cleanup */
+	struct lcrp_cleanup_budget	*lcj_budget;
+	/* Next bucket to take, updated atomically */
+	unsigned int			 lcj_next;
+	/* Protects the fields below */
+	pthread_mutex_t			 lcj_mutex;
+	/* Buckets that have been finished */
+	unsigned char			 lcj_done[LCRP_BUCKET_COUNT];
+	/* All buckets below this have been finished */
+	unsigned int			 lcj_watermark;
+	/* Buckets finished since the last checkpoint */
+	unsigned int			 lcj_unsaved;
+	/* First failure of the cleanup threads, -EINTR if stopped */
+	int				 lcj_error;
+	/* Some files with invalid names are left in the epoch */
+	bool				 lcj_leftover;
+};
+
+struct lcrp_cleanup_worker {
+	/* Job being cleaned up */
+	struct lcrp_cleanup_job	*lcw_job;
+	/* Buffer to read directory entries */
+	char			*lcw_dents;
+	/* Batch of the links and unlinks of the files */
+	struct lcrp_io		 lcw_io;
+	/* General thread info */
+	struct lcrp_thread_info	 lcw_general;
+};
+
+int lcrp_cleanup_budget_charge(struct lcrp_cleanup_budget *budget);
+int lcrp_cleanup_epoch(const char *dir, const char *name, const char *dest,
+		       int threads, struct lcrp_cleanup_budget *budget);
+#endif /* _LCRP_CLEANUP_H_ */
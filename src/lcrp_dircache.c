@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "lcrp_changelog.h"
+#include "lcrp_dircache.h"
+
+/*
+ * Close all bucket fds, and the root fd if owned
+ */
+static void lcrp_dircache_close(struct lcrp_dircache *cache)
+{
+	int i;
+	unsigned int bucket;
+
+	for (i = 0; i < cache->ldc_count; i++) {
+		bucket = cache->ldc_slots[i];
+		close(cache->ldc_fds[bucket]);
+		cache->ldc_fds[bucket] = -1;
+		cache->ldc_referenced[bucket] = 0;
+	}
+	cache->ldc_count = 0;
+	cache->ldc_hand = 0;
+
+	if (cache->ldc_root >= 0 && cache->ldc_root_owned)
+		close(cache->ldc_root);
+	cache->ldc_root = -1;
+	cache->ldc_root_owned = false;
+}
+
+void lcrp_dircache_fini(struct lcrp_dircache *cache)
+{
+	if (cache->ldc_fds != NULL)
+		lcrp_dircache_close(cache);
+	free(cache->ldc_fds);
+	free(cache->ldc_referenced);
+	free(cache->ldc_slots);
+	cache->ldc_fds = NULL;
+	cache->ldc_referenced = NULL;
+	cache->ldc_slots = NULL;
+}
+
+int lcrp_dircache_init(struct lcrp_dircache *cache, int budget)
+{
+	int i;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->ldc_root = -1;
+	if (budget < 1)
+		budget = 1;
+	if (budget > LCRP_BUCKET_COUNT)
+		budget = LCRP_BUCKET_COUNT;
+	cache->ldc_budget = budget;
+
+	cache->ldc_fds = malloc(sizeof(*cache->ldc_fds) * LCRP_BUCKET_COUNT);
+	cache->ldc_referenced = calloc(LCRP_BUCKET_COUNT,
+				       sizeof(*cache->ldc_referenced));
+	cache->ldc_slots = calloc(budget, sizeof(*cache->ldc_slots));
+	if (cache->ldc_fds == NULL || cache->ldc_referenced == NULL ||
+	    cache->ldc_slots == NULL) {
+		LERROR("failed to allocate directory cache of [%d] fds\n",
+		       budget);
+		lcrp_dircache_fini(cache);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < LCRP_BUCKET_COUNT; i++)
+		cache->ldc_fds[i] = -1;
+	return 0;
+}
+
+/*
+ * Open the root directory, the fd is closed by the cache
+ */
+int lcrp_dircache_open(struct lcrp_dircache *cache, const char *root)
+{
+	int fd;
+
+	lcrp_syscall_count++;
+	fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		LERROR("failed to open directory [%s]: %s\n", root,
+		       strerror(errno));
+		return -errno;
+	}
+
+	lcrp_dircache_close(cache);
+	cache->ldc_root = fd;
+	cache->ldc_root_owned = true;
+	return 0;
+}
+
+/*
+ * Switch to another root directory which is not closed by the cache, all
+ * bucket fds of the old root are closed
+ */
+void lcrp_dircache_set_root(struct lcrp_dircache *cache, int root)
+{
+	lcrp_dircache_close(cache);
+	cache->ldc_root = root;
+}
+
+/*
+ * Free a slot for a new bucket fd by closing the first bucket that has
+ * not been used since the clock hand passed it
+ */
+static int lcrp_dircache_evict(struct lcrp_dircache *cache)
+{
+	int slot;
+	unsigned int bucket;
+
+	while (true) {
+		if (cache->ldc_hand >= cache->ldc_count)
+			cache->ldc_hand = 0;
+		slot = cache->ldc_hand++;
+		bucket = cache->ldc_slots[slot];
+		if (cache->ldc_referenced[bucket]) {
+			cache->ldc_referenced[bucket] = 0;
+			continue;
+		}
+
+		close(cache->ldc_fds[bucket]);
+		cache->ldc_fds[bucket] = -1;
+		return slot;
+	}
+}
+
+static int lcrp_dircache_openat(struct lcrp_dircache *cache,
+				const char *name)
+{
+	int fd;
+
+	lcrp_syscall_count++;
+	fd = openat(cache->ldc_root, name, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0 || errno != EMFILE || cache->ldc_count == 0)
+		return fd;
+
+	/* Too many open files of the process, give up one of ours */
+	cache->ldc_slots[lcrp_dircache_evict(cache)] =
+		cache->ldc_slots[cache->ldc_count - 1];
+	cache->ldc_count--;
+	lcrp_syscall_count++;
+	return openat(cache->ldc_root, name, O_RDONLY | O_DIRECTORY);
+}
+
+/*
+ * Get the fd of a bucket directory, create the directory if it does not
+ * exist. The fd stays valid until the next call on the cache.
+ */
+int lcrp_dircache_get(struct lcrp_dircache *cache, unsigned int bucket,
+		      int *fd)
+{
+	int rc;
+	int slot;
+	char name[LCRP_BUCKET_NAMELEN];
+
+	LASSERT(bucket < LCRP_BUCKET_COUNT);
+	LASSERT(cache->ldc_root >= 0);
+	if (cache->ldc_fds[bucket] >= 0) {
+		cache->ldc_hits++;
+		cache->ldc_referenced[bucket] = 1;
+		*fd = cache->ldc_fds[bucket];
+		return 0;
+	}
+
+	cache->ldc_misses++;
+	snprintf(name, sizeof(name), LCRP_BUCKET_FORMAT, bucket);
+	*fd = lcrp_dircache_openat(cache, name);
+	if (*fd < 0 && errno == ENOENT) {
+		lcrp_syscall_count++;
+		rc = mkdirat(cache->ldc_root, name, 0755);
+		/* Another thread might have created it */
+		if (rc && errno != EEXIST) {
+			LERROR("failed to create directory [%s]: %s\n",
+			       name, strerror(errno));
+			return -errno;
+		}
+		*fd = lcrp_dircache_openat(cache, name);
+	}
+	if (*fd < 0) {
+		LERROR("failed to open directory [%s]: %s\n", name,
+		       strerror(errno));
+		return -errno;
+	}
+
+	if (cache->ldc_count < cache->ldc_budget)
+		slot = cache->ldc_count++;
+	else
+		slot = lcrp_dircache_evict(cache);
+	cache->ldc_slots[slot] = bucket;
+	cache->ldc_fds[bucket] = *fd;
+	return 0;
+}
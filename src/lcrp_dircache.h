@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_DIRCACHE_H_
+#define _LCRP_DIRCACHE_H_
+
+#include <stdbool.h>
+#include <lustre/lustreapi.h>
+
+/* Number of bucket directories under fids and each epoch directory */
+#define LCRP_BUCKET_COUNT 65536
+/* Bucket directory of a FID */
+#define LCRP_FID_BUCKET(fid) ((fid)->f_oid & (LCRP_BUCKET_COUNT - 1))
+/* Name of bucket directory */
+#define LCRP_BUCKET_FORMAT "%04x"
+/* Buffer size of the name of bucket directory */
+#define LCRP_BUCKET_NAMELEN 8
+
+/*
+ * Open fds of a root directory and its bucket directories, so that files
+ * can be handled by *at() syscalls without walking the full path. Bucket
+ * directories are opened lazily and evicted by a clock when the number of
+ * open fds reaches the budget.
+ */
+struct lcrp_dircache {
+	/* Fd of the root directory, -1 if not opened */
+	int			 ldc_root;
+	/* The root fd is closed by the cache */
+	bool			 ldc_root_owned;
+	/* Fds of the bucket directories, -1 if not opened */
+	int			*ldc_fds;
+	/* Bucket has been used since the clock hand passed it */
+	unsigned char		*ldc_referenced;
+	/* Buckets that are open, in the order of the clock */
+	unsigned short		*ldc_slots;
+	/* Maximum number of bucket fds to keep open */
+	int			 ldc_budget;
+	/* Number of bucket fds that are open */
+	int			 ldc_count;
+	/* Clock hand, index of ldc_slots */
+	int			 ldc_hand;
+	/* Number of lookups that found the fd open */
+	unsigned long long	 ldc_hits;
+	/* Number of lookups that had to open the bucket */
+	unsigned long long	 ldc_misses;
+};
+
+int lcrp_dircache_init(struct lcrp_dircache *cache, int budget);
+void lcrp_dircache_fini(struct lcrp_dircache *cache);
+int lcrp_dircache_open(struct lcrp_dircache *cache, const char *root);
+void lcrp_dircache_set_root(struct lcrp_dircache *cache, int root);
+int lcrp_dircache_get(struct lcrp_dircache *cache, unsigned int bucket,
+		      int *fd);
+#endif /* _LCRP_DIRCACHE_H_ */
@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Drain of the Changelog backlog into the epochs of the records.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "lcrp_changelog.h"
+#include "lcrp_drain.h"
+#include "lcrp_stats.h"
+#include "lcrpd.h"
+
+int lcrp_drain_init(struct lcrp_drain *drain, int lag, int batch_records)
+{
+	memset(drain, 0, sizeof(*drain));
+	drain->ldr_fd_fids = -1;
+	drain->ldr_lag = lag;
+	drain->ldr_batch_records = batch_records;
+	drain->ldr_entries = malloc(sizeof(*drain->ldr_entries) *
+				    batch_records);
+	if (drain->ldr_entries == NULL) {
+		LERROR("failed to allocate batch of [%d] records\n",
+		       batch_records);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void lcrp_drain_fini(struct lcrp_drain *drain)
+{
+	if (drain->ldr_fd_fids >= 0)
+		close(drain->ldr_fd_fids);
+	drain->ldr_fd_fids = -1;
+	free(drain->ldr_entries);
+	drain->ldr_entries = NULL;
+}
+
+/*
+ * Return true if the record should go into the batch. A batch is started
+ * by a record older than ldr_lag seconds, and takes all of the following
+ * records until it is applied.
+ */
+bool lcrp_drain_active(struct lcrp_drain *drain, struct changelog_rec *rec)
+{
+	long long lag;
+
+	if (drain == NULL)
+		return false;
+	if (drain->ldr_records > 0)
+		return true;
+
+	lag = time(NULL) - (long long)(rec->cr_time >> 30);
+	if (lag >= drain->ldr_lag) {
+		if (!drain->ldr_draining)
+			LINFO("record %llu is [%lld] seconds behind, draining the backlog in batches\n",
+			      rec->cr_index, lag);
+		drain->ldr_draining = true;
+		return true;
+	}
+
+	if (drain->ldr_draining)
+		LINFO("record %llu is [%lld] seconds behind, back to streaming\n",
+		      rec->cr_index, lag);
+	drain->ldr_draining = false;
+	return false;
+}
+
+/*
+ * Return the start of the epoch of a record time. Records in the future
+ * because of clock skew belong to the current epoch.
+ */
+int lcrp_drain_epoch(struct lcrp_epoch *epoch, unsigned long long time)
+{
+	long long start;
+	int active_start = __atomic_load_n(&epoch->le_start, __ATOMIC_ACQUIRE);
+
+	start = (long long)(time >> 30) / epoch->le_seconds *
+		epoch->le_seconds;
+	if (start > active_start)
+		return active_start;
+	return start;
+}
+
+/*
+ * Add a record to the batch, fid is NULL if the record is not access
+ */
+void lcrp_drain_add(struct lcrp_drain *drain, const struct lu_fid *fid,
+		    int start, struct changelog_rec *rec)
+{
+	struct lcrp_drain_entry *entry;
+
+	LASSERT(drain->ldr_records < drain->ldr_batch_records);
+	drain->ldr_records++;
+	drain->ldr_last_index = rec->cr_index;
+	if (fid == NULL)
+		return;
+
+	entry = &drain->ldr_entries[drain->ldr_count++];
+	entry->lde_fid = *fid;
+	entry->lde_start = start;
+	entry->lde_time = rec->cr_time;
+}
+
+void lcrp_drain_reset(struct lcrp_drain *drain)
+{
+	drain->ldr_count = 0;
+	drain->ldr_records = 0;
+}
+
+/*
+ * Sort by epoch, then by bucket so that the links of a batch share bucket
+ * directories, then by FID so that repeated accesses are adjacent
+ */
+static int lcrp_drain_compare(const void *a, const void *b)
+{
+	const struct lcrp_drain_entry *e1 = a;
+	const struct lcrp_drain_entry *e2 = b;
+	unsigned int b1 = LCRP_FID_BUCKET(&e1->lde_fid);
+	unsigned int b2 = LCRP_FID_BUCKET(&e2->lde_fid);
+
+	if (e1->lde_start != e2->lde_start)
+		return e1->lde_start < e2->lde_start ? -1 : 1;
+	if (b1 != b2)
+		return b1 < b2 ? -1 : 1;
+	if (e1->lde_fid.f_seq != e2->lde_fid.f_seq)
+		return e1->lde_fid.f_seq < e2->lde_fid.f_seq ? -1 : 1;
+	if (e1->lde_fid.f_oid != e2->lde_fid.f_oid)
+		return e1->lde_fid.f_oid < e2->lde_fid.f_oid ? -1 : 1;
+	if (e1->lde_fid.f_ver != e2->lde_fid.f_ver)
+		return e1->lde_fid.f_ver < e2->lde_fid.f_ver ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Directory that the FIDs of an epoch are linked into, valid until the
+ * directories of the tiers are moved
+ */
+struct lcrp_drain_dest {
+	/* Start time of the epoch */
+	int			 ldd_start;
+	/* Fd of the directory, -1 if not open */
+	int			 ldd_fd;
+	/* Value of le_moves when the directory was opened */
+	unsigned long long	 ldd_moves;
+	/* Path of the directory */
+	char			 ldd_path[PATH_MAX + 1];
+};
+
+/*
+ * Get the directory that the epoch starting at start has been merged into
+ * by now. The caller holds le_mutex, so no directory is moved meanwhile.
+ */
+static void lcrp_drain_dest(struct lcrp_epoch *epoch, int start,
+			    char *path, size_t size)
+{
+	int tier;
+	int bucket;
+	struct lcrp_tiers *tiers = &lcrp_status->ls_tiers;
+
+	tier = lcrp_tier_locate(tiers, epoch->le_start, 0,
+				start + epoch->le_seconds);
+	if (tier == tiers->lts_count) {
+		snprintf(path, size, "%s", lcrp_status->ls_dir_inactive_all);
+		return;
+	}
+
+	bucket = lcrp_tier_bucket(tiers, tier, start);
+	snprintf(path, size, "%s/%d-%d", lcrp_status->ls_dir_tiers[tier],
+		 bucket, bucket + tiers->lts_tiers[tier].lt_seconds);
+}
+
+/*
+ * Open the directory of the epoch. Epoch rollover moves the directories of
+ * the tiers, so le_mutex is held only while resolving and opening it.
+ */
+static int lcrp_drain_dest_open(struct lcrp_epoch *epoch,
+				struct lcrp_drain_dest *dest)
+{
+	int rc;
+
+	pthread_mutex_lock(&epoch->le_mutex);
+	lcrp_drain_dest(epoch, dest->ldd_start, dest->ldd_path,
+			sizeof(dest->ldd_path));
+	rc = lcrp_find_or_mkdir(dest->ldd_path);
+	if (rc)
+		goto out;
+	dest->ldd_fd = open(dest->ldd_path, O_RDONLY | O_DIRECTORY);
+	if (dest->ldd_fd < 0) {
+		LERROR("failed to open directory [%s]: %s\n", dest->ldd_path,
+		       strerror(errno));
+		rc = -errno;
+		goto out;
+	}
+	dest->ldd_moves = epoch->le_moves;
+out:
+	pthread_mutex_unlock(&epoch->le_mutex);
+	return rc;
+}
+
+/*
+ * Link a chunk of FIDs into the directory of the epoch, and update their
+ * index. If the directory has been moved meanwhile, it could have been
+ * merged without the new links, so the chunk is linked again into where
+ * the epoch is now. Links that exist already are skipped.
+ */
+static int lcrp_drain_link(struct lcrp_drain *drain,
+			   struct lcrp_epoch_reader *reader,
+			   struct lcrp_drain_dest *dest,
+			   const struct lu_fid *fids, int count)
+{
+	int i;
+	int rc;
+	bool moved;
+	struct lcrp_epoch *epoch = reader->ler_epoch;
+	struct lcrp_index *index = epoch->le_index;
+
+	while (true) {
+		rc = lcrp_link_fids(&reader->ler_io, drain->ldr_fd_fids,
+				    dest->ldd_fd, fids, count);
+		if (rc)
+			return rc;
+
+		pthread_mutex_lock(&epoch->le_mutex);
+		moved = epoch->le_moves != dest->ldd_moves;
+		pthread_mutex_unlock(&epoch->le_mutex);
+		if (!moved)
+			break;
+
+		close(dest->ldd_fd);
+		dest->ldd_fd = -1;
+		rc = lcrp_drain_dest_open(epoch, dest);
+		if (rc)
+			return rc;
+	}
+
+	for (i = 0; index != NULL && i < count; i++) {
+		rc = lcrp_index_update(index, &fids[i], dest->ldd_start);
+		if (rc) {
+			LERROR("failed to update index of FID "DFID"\n",
+			       PFID(&fids[i]));
+			return rc;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Link the FIDs of the same epoch into the directory of the epoch
+ */
+static int lcrp_drain_apply_epoch(struct lcrp_drain *drain,
+				  struct lcrp_epoch_reader *reader,
+				  struct lcrp_drain_entry *entries, int count)
+{
+	int i;
+	int rc;
+	int linking = 0;
+	struct lu_fid fids[LCRP_LINK_BATCH];
+	struct lcrp_drain_dest dest;
+	struct lcrp_drain_entry *entry;
+
+	dest.ldd_start = entries[0].lde_start;
+	dest.ldd_fd = -1;
+	rc = lcrp_drain_dest_open(reader->ler_epoch, &dest);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < count; i++) {
+		entry = &entries[i];
+		lcrp_changelog_record_done(reader, entry->lde_time);
+		if (i > 0 && lcrp_fid_equal(&entry->lde_fid,
+					    &entries[i - 1].lde_fid))
+			continue;
+
+		fids[linking++] = entry->lde_fid;
+		if (linking < LCRP_LINK_BATCH)
+			continue;
+		rc = lcrp_drain_link(drain, reader, &dest, fids, linking);
+		if (rc)
+			break;
+		linking = 0;
+	}
+	if (rc == 0 && linking > 0)
+		rc = lcrp_drain_link(drain, reader, &dest, fids, linking);
+	if (rc)
+		LERROR("failed to link FIDs of epoch [%d] into [%s]\n",
+		       dest.ldd_start, dest.ldd_path);
+	else
+		LDEBUG("linked [%d] records of epoch [%d] into [%s]\n", count,
+		       dest.ldd_start, dest.ldd_path);
+	if (dest.ldd_fd >= 0)
+		close(dest.ldd_fd);
+	return rc;
+}
+
+/*
+ * Add the accesses of the batch to the heat of their FIDs. Heat counts
+ * every access, even the repeated ones of a batch.
+ */
+static int lcrp_drain_heat(struct lcrp_drain *drain,
+			   struct lcrp_epoch_reader *reader)
+{
+	int i;
+	int rc;
+	struct lcrp_drain_entry *entry;
+	struct lcrp_index *index = reader->ler_epoch->le_index;
+
+	if (index == NULL || index->li_half_life == 0)
+		return 0;
+
+	for (i = 0; i < drain->ldr_count; i++) {
+		entry = &drain->ldr_entries[i];
+		rc = lcrp_index_heat(index, &entry->lde_fid, entry->lde_start,
+				     entry->lde_time >> 30);
+		if (rc) {
+			LERROR("failed to update heat of fid "DFID"\n",
+			       PFID(&entry->lde_fid));
+			return rc;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Apply the batch to the epochs of the records. The batch is kept on
+ * failure, and is reset by the caller after the records are cleared.
+ */
+int lcrp_drain_apply(struct lcrp_drain *drain, const char *dir_fid,
+		     struct lcrp_epoch_reader *reader)
+{
+	int i;
+	int rc;
+	int first = 0;
+	int epochs = 0;
+	unsigned long long start = lcrp_stats_nsec();
+	struct lcrp_drain_entry *entries = drain->ldr_entries;
+
+	if (drain->ldr_fd_fids < 0) {
+		drain->ldr_fd_fids = open(dir_fid, O_RDONLY | O_DIRECTORY);
+		if (drain->ldr_fd_fids < 0) {
+			LERROR("failed to open directory [%s]: %s\n", dir_fid,
+			       strerror(errno));
+			return -errno;
+		}
+	}
+
+	rc = lcrp_drain_heat(drain, reader);
+	if (rc)
+		return rc;
+
+	qsort(entries, drain->ldr_count, sizeof(*entries),
+	      lcrp_drain_compare);
+	for (i = 1; i <= drain->ldr_count; i++) {
+		if (i < drain->ldr_count &&
+		    entries[i].lde_start == entries[first].lde_start)
+			continue;
+
+		rc = lcrp_drain_apply_epoch(drain, reader, &entries[first],
+					    i - first);
+		if (rc) {
+			LERROR("failed to apply backlog of epoch [%d]\n",
+			       entries[first].lde_start);
+			return rc;
+		}
+		epochs++;
+		first = i;
+	}
+
+	lcrp_stats_add(LCRP_COUNTER_DRAINED, drain->ldr_records);
+	lcrp_stats_observe(LCRP_HIST_DRAIN_BATCH, lcrp_stats_nsec() - start);
+	LINFO("applied batch of [%d] backlog records up to %llu to [%d] epochs\n",
+	      drain->ldr_records, drain->ldr_last_index, epochs);
+	return 0;
+}
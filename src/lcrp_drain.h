@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_DRAIN_H_
+#define _LCRP_DRAIN_H_
+
+#include <stdbool.h>
+#include <lustre/lustreapi.h>
+#include "lcrp_epoch.h"
+
+/* Accessed FID of a record in the backlog */
+struct lcrp_drain_entry {
+	/* FID of the record */
+	struct lu_fid		 lde_fid;
+	/* Start time of the epoch of the record */
+	int			 lde_start;
+	/* Time of the record, cr_time */
+	unsigned long long	 lde_time;
+};
+
+/*
+ * Records far behind the current time are the backlog, e.g. after lcrpd
+ * has been stopped for maintenance. Instead of linking them one by one
+ * into the current epoch, they are collected into a batch, sorted by
+ * epoch and bucket, and linked into the directory of the epoch of their
+ * cr_time in whatever tier it is now.
+ */
+struct lcrp_drain {
+	/* Records older than this number of seconds start a batch */
+	int			 ldr_lag;
+	/* Maximum number of records of a batch */
+	int			 ldr_batch_records;
+	/* Accessed FIDs of the batch */
+	struct lcrp_drain_entry	*ldr_entries;
+	/* Number of accessed FIDs of the batch */
+	int			 ldr_count;
+	/* Number of records of the batch, including the dropped ones */
+	int			 ldr_records;
+	/* Index of the last record of the batch */
+	unsigned long long	 ldr_last_index;
+	/* The backlog is being drained, for logging the switches only */
+	bool			 ldr_draining;
+	/* Fd of the directory that saves all fids, -1 if not opened */
+	int			 ldr_fd_fids;
+};
+
+int lcrp_drain_init(struct lcrp_drain *drain, int lag, int batch_records);
+void lcrp_drain_fini(struct lcrp_drain *drain);
+bool lcrp_drain_active(struct lcrp_drain *drain, struct changelog_rec *rec);
+int lcrp_drain_epoch(struct lcrp_epoch *epoch, unsigned long long time);
+void lcrp_drain_add(struct lcrp_drain *drain, const struct lu_fid *fid,
+		    int start, struct changelog_rec *rec);
+int lcrp_drain_apply(struct lcrp_drain *drain, const char *dir_fid,
+		     struct lcrp_epoch_reader *reader);
+void lcrp_drain_reset(struct lcrp_drain *drain);
+#endif /* _LCRP_DRAIN_H_ */
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Epoch snapshots shared by the threads that update FIDs.
+ *
+ * Readers protect the snapshot they are using by publishing its pointer
+ * in ler_snapshot, like a hazard pointer, so updating a FID takes no lock.
+ * Changing epoch swaps le_snapshot, then waits until no reader is using
+ * the old snapshot before freeing it.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "lcrp_epoch.h"
+#include "lcrpd.h"
+
+void lcrp_epoch_init(struct lcrp_epoch *epoch)
+{
+	pthread_mutex_init(&epoch->le_mutex, NULL);
+}
+
+static void lcrp_epoch_snapshot_free(struct lcrp_epoch_snapshot *snapshot)
+{
+	close(snapshot->les_fd_active);
+	free(snapshot);
+}
+
+void lcrp_epoch_fini(struct lcrp_epoch *epoch)
+{
+	LASSERT(epoch->le_readers == NULL);
+	if (epoch->le_snapshot != NULL)
+		lcrp_epoch_snapshot_free(epoch->le_snapshot);
+	epoch->le_snapshot = NULL;
+	pthread_mutex_destroy(&epoch->le_mutex);
+}
+
+/*
+ * Replace the snapshot of the epoch. When this returns, no reader is
+ * using the old snapshot any more. Caller should hold le_mutex.
+ */
+int lcrp_epoch_publish(struct lcrp_epoch *epoch, int start, int end,
+		       const char *dir_active)
+{
+	struct lcrp_epoch_reader *reader;
+	struct lcrp_epoch_snapshot *old;
+	struct lcrp_epoch_snapshot *snapshot;
+
+	snapshot = calloc(1, sizeof(*snapshot));
+	if (snapshot == NULL) {
+		LERROR("failed to allocate snapshot of epoch\n");
+		return -ENOMEM;
+	}
+	snapshot->les_start = start;
+	snapshot->les_end = end;
+	snprintf(snapshot->les_dir_active, sizeof(snapshot->les_dir_active),
+		 "%s", dir_active);
+	snapshot->les_fd_active = open(dir_active, O_RDONLY | O_DIRECTORY);
+	if (snapshot->les_fd_active < 0) {
+		LERROR("failed to open directory [%s]: %s\n", dir_active,
+		       strerror(errno));
+		free(snapshot);
+		return -errno;
+	}
+
+	old = epoch->le_snapshot;
+	if (old != NULL)
+		snapshot->les_generation = old->les_generation + 1;
+	__atomic_store_n(&epoch->le_snapshot, snapshot, __ATOMIC_SEQ_CST);
+	if (old == NULL)
+		return 0;
+
+	for (reader = epoch->le_readers; reader != NULL;
+	     reader = reader->ler_next) {
+		while (__atomic_load_n(&reader->ler_snapshot,
+				       __ATOMIC_SEQ_CST) == old)
+			sched_yield();
+	}
+	lcrp_epoch_snapshot_free(old);
+	return 0;
+}
+
+/*
+ * Half of fd_budget is used for bucket directories under fids, the other
+ * half for the ones under the epoch directory.
+ */
+int lcrp_epoch_reader_init(struct lcrp_epoch_reader *reader,
+			   struct lcrp_epoch *epoch, unsigned long cache_size,
+			   int fd_budget)
+{
+	int rc;
+
+	memset(reader, 0, sizeof(*reader));
+	/* Make sure that the first lcrp_epoch_get() sets up ler_active */
+	reader->ler_generation = ULONG_MAX;
+	rc = lcrp_fidset_init(&reader->ler_fidset, cache_size);
+	if (rc) {
+		LERROR("failed to init FID cache\n");
+		return rc;
+	}
+
+	rc = lcrp_dircache_init(&reader->ler_fids, fd_budget / 2);
+	if (rc)
+		goto out_fidset;
+
+	rc = lcrp_dircache_init(&reader->ler_active, fd_budget / 2);
+	if (rc)
+		goto out_fids;
+
+	rc = lcrp_io_init(&reader->ler_io, lcrp_status->ls_io_uring);
+	if (rc)
+		goto out_active;
+
+	reader->ler_epoch = epoch;
+	pthread_mutex_lock(&epoch->le_mutex);
+	reader->ler_next = epoch->le_readers;
+	epoch->le_readers = reader;
+	pthread_mutex_unlock(&epoch->le_mutex);
+	return 0;
+out_active:
+	lcrp_dircache_fini(&reader->ler_active);
+out_fids:
+	lcrp_dircache_fini(&reader->ler_fids);
+out_fidset:
+	lcrp_fidset_fini(&reader->ler_fidset);
+	return rc;
+}
+
+/*
+ * Add the statistics of the reader to the epoch, only called by the thread
+ * that owns the reader
+ */
+void lcrp_epoch_reader_flush(struct lcrp_epoch_reader *reader)
+{
+	unsigned long long max;
+	struct lcrp_epoch *epoch = reader->ler_epoch;
+	struct lcrp_fidset *set = &reader->ler_fidset;
+
+	__atomic_add_fetch(&epoch->le_fid_hits, set->lfs_hits,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&epoch->le_fid_misses, set->lfs_misses,
+			   __ATOMIC_RELAXED);
+	set->lfs_hits = 0;
+	set->lfs_misses = 0;
+
+	if (reader->ler_lag_count == 0)
+		return;
+	__atomic_add_fetch(&epoch->le_lag_count, reader->ler_lag_count,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&epoch->le_lag_total, reader->ler_lag_total,
+			   __ATOMIC_RELAXED);
+	max = __atomic_load_n(&epoch->le_lag_max, __ATOMIC_RELAXED);
+	while (reader->ler_lag_max > max &&
+	       !__atomic_compare_exchange_n(&epoch->le_lag_max, &max,
+					    reader->ler_lag_max, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	reader->ler_lag_count = 0;
+	reader->ler_lag_total = 0;
+	reader->ler_lag_max = 0;
+}
+
+void lcrp_epoch_reader_fini(struct lcrp_epoch_reader *reader)
+{
+	struct lcrp_epoch *epoch = reader->ler_epoch;
+	struct lcrp_epoch_reader **pprev;
+
+	if (epoch == NULL)
+		return;
+
+	LASSERT(reader->ler_snapshot == NULL);
+	pthread_mutex_lock(&epoch->le_mutex);
+	for (pprev = &epoch->le_readers; *pprev != NULL;
+	     pprev = &(*pprev)->ler_next) {
+		if (*pprev == reader) {
+			*pprev = reader->ler_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&epoch->le_mutex);
+
+	lcrp_epoch_reader_flush(reader);
+	lcrp_io_fini(&reader->ler_io);
+	lcrp_dircache_fini(&reader->ler_active);
+	lcrp_dircache_fini(&reader->ler_fids);
+	lcrp_fidset_fini(&reader->ler_fidset);
+	reader->ler_epoch = NULL;
+}
+
+/*
+ * Get the current snapshot of the epoch, which stays valid until
+ * lcrp_epoch_put(). The FID cache of the reader is reset if epoch has
+ * changed since the last time.
+ */
+struct lcrp_epoch_snapshot *lcrp_epoch_get(struct lcrp_epoch_reader *reader)
+{
+	struct lcrp_epoch *epoch = reader->ler_epoch;
+	struct lcrp_epoch_snapshot *snapshot;
+
+	do {
+		snapshot = __atomic_load_n(&epoch->le_snapshot,
+					   __ATOMIC_SEQ_CST);
+		__atomic_store_n(&reader->ler_snapshot, snapshot,
+				 __ATOMIC_SEQ_CST);
+	} while (__atomic_load_n(&epoch->le_snapshot,
+				 __ATOMIC_SEQ_CST) != snapshot);
+	LASSERT(snapshot != NULL);
+
+	if (snapshot->les_generation != reader->ler_generation) {
+		lcrp_epoch_reader_flush(reader);
+		lcrp_fidset_reset(&reader->ler_fidset);
+		lcrp_dircache_set_root(&reader->ler_active,
+				       snapshot->les_fd_active);
+		reader->ler_generation = snapshot->les_generation;
+	}
+	return snapshot;
+}
+
+void lcrp_epoch_put(struct lcrp_epoch_reader *reader)
+{
+	__atomic_store_n(&reader->ler_snapshot, NULL, __ATOMIC_RELEASE);
+}
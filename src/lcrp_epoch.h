@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_EPOCH_H_
+#define _LCRP_EPOCH_H_
+
+#include <pthread.h>
+#include <linux/limits.h>
+#include "lcrp_dircache.h"
+#include "lcrp_fidset.h"
+#include "lcrp_index.h"
+#include "lcrp_io.h"
+
+/*
+ * Immutable state of an epoch. A new snapshot is published when epoch
+ * changes, the old one is freed after no reader is using it.
+ */
+struct lcrp_epoch_snapshot {
+	/* Increased by one for each new snapshot */
+	unsigned long		 les_generation;
+	/* Start time of the epoch */
+	int			 les_start;
+	/* End time of the epoch */
+	int			 les_end;
+	/* Directory of this epoch under active */
+	char			 les_dir_active[PATH_MAX + 1];
+	/* Fd of les_dir_active, closed when the snapshot is freed */
+	int			 les_fd_active;
+};
+
+struct lcrp_epoch;
+
+/*
+ * Thread that uses the epoch snapshot to update FIDs. Each reader has
+ * its own FID cache so that no lock is needed to update FIDs.
+ */
+struct lcrp_epoch_reader {
+	/* Next reader of the epoch, protected by le_mutex */
+	struct lcrp_epoch_reader	*ler_next;
+	/* Epoch this reader is registered to */
+	struct lcrp_epoch		*ler_epoch;
+	/* Snapshot being used, NULL if not using any */
+	struct lcrp_epoch_snapshot	*ler_snapshot;
+	/* Generation of the snapshot that ler_fidset belongs to */
+	unsigned long			 ler_generation;
+	/* FIDs that have been linked into the epoch by this reader */
+	struct lcrp_fidset		 ler_fidset;
+	/* Bucket directories under fids */
+	struct lcrp_dircache		 ler_fids;
+	/* Bucket directories under the directory of the epoch */
+	struct lcrp_dircache		 ler_active;
+	/* Number of records processed since the last flush */
+	unsigned long long		 ler_lag_count;
+	/* Total nanoseconds from record time to processed */
+	unsigned long long		 ler_lag_total;
+	/* Maximum nanoseconds from record time to processed */
+	unsigned long long		 ler_lag_max;
+	/* Batch of operations to link FIDs */
+	struct lcrp_io			 ler_io;
+};
+
+struct lcrp_epoch {
+	/* Lock to serialize epoch changes and reader registrations */
+	pthread_mutex_t	le_mutex;
+	/* Epoch interval in seconds, should >= LCRP_MIN_EPOCH_INTERVAL */
+	int le_seconds;
+	/**
+	 * Start epoch time of active directory
+	 * Should be N * le_seconds, N = current_time / le_seconds * le_seconds
+	 *
+	 * The active time is (N * le_seconds, (N + 1) * le_seconds]
+	 * Older epochs are in the following tiers, see struct lcrp_tier
+	 */
+	int le_start;
+	/*
+	 * Start time of the latest epoch whose directory tree has been
+	 * prepared, read and updated with atomic operations
+	 */
+	int le_prepared;
+	/* Current snapshot, read and replaced with atomic operations */
+	struct lcrp_epoch_snapshot *le_snapshot;
+	/* Registered readers, protected by le_mutex */
+	struct lcrp_epoch_reader *le_readers;
+	/* Times the directories of tiers have been moved, under le_mutex */
+	unsigned long long le_moves;
+	/* FID cache hits of the readers, updated with atomic operations */
+	unsigned long long le_fid_hits;
+	/* FID cache misses of the readers, updated with atomic operations */
+	unsigned long long le_fid_misses;
+	/* Records processed by the readers, updated with atomic operations */
+	unsigned long long le_lag_count;
+	/* Total nanoseconds from record time to processed, atomic */
+	unsigned long long le_lag_total;
+	/* Maximum nanoseconds from record time to processed, atomic */
+	unsigned long long le_lag_max;
+	/* Index of the last access of FIDs, NULL if disabled */
+	struct lcrp_index *le_index;
+};
+
+void lcrp_epoch_init(struct lcrp_epoch *epoch);
+void lcrp_epoch_fini(struct lcrp_epoch *epoch);
+int lcrp_epoch_publish(struct lcrp_epoch *epoch, int start, int end,
+		       const char *dir_active);
+int lcrp_epoch_reader_init(struct lcrp_epoch_reader *reader,
+			   struct lcrp_epoch *epoch, unsigned long cache_size,
+			   int fd_budget);
+void lcrp_epoch_reader_fini(struct lcrp_epoch_reader *reader);
+void lcrp_epoch_reader_flush(struct lcrp_epoch_reader *reader);
+struct lcrp_epoch_snapshot *lcrp_epoch_get(struct lcrp_epoch_reader *reader);
+void lcrp_epoch_put(struct lcrp_epoch_reader *reader);
+#endif /* _LCRP_EPOCH_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcrp_fidset.h"
+
+/*
+ * Size of zero disables the set, so every lookup misses.
+ */
+int lcrp_fidset_init(struct lcrp_fidset *set, unsigned long size)
+{
+	unsigned long slots = 16;
+
+	memset(set, 0, sizeof(*set));
+	if (size == 0)
+		return 0;
+
+	while (slots < size)
+		slots <<= 1;
+
+	set->lfs_fids = calloc(slots, sizeof(*set->lfs_fids));
+	if (set->lfs_fids == NULL) {
+		LERROR("failed to allocate FID set with [%lu] slots\n",
+		       slots);
+		return -ENOMEM;
+	}
+	set->lfs_size = slots;
+	return 0;
+}
+
+void lcrp_fidset_fini(struct lcrp_fidset *set)
+{
+	free(set->lfs_fids);
+	set->lfs_fids = NULL;
+	set->lfs_size = 0;
+	set->lfs_count = 0;
+}
+
+void lcrp_fidset_reset(struct lcrp_fidset *set)
+{
+	if (set->lfs_count == 0)
+		return;
+
+	memset(set->lfs_fids, 0, set->lfs_size * sizeof(*set->lfs_fids));
+	set->lfs_count = 0;
+}
+
+bool lcrp_fidset_lookup(struct lcrp_fidset *set, const struct lu_fid *fid)
+{
+	unsigned long mask = set->lfs_size - 1;
+	unsigned long i;
+
+	if (set->lfs_fids == NULL) {
+		set->lfs_misses++;
+		return false;
+	}
+
+	for (i = lcrp_fid_hash(fid) & mask; !fid_is_zero(&set->lfs_fids[i]);
+	     i = (i + 1) & mask) {
+		if (lcrp_fid_equal(&set->lfs_fids[i], fid)) {
+			set->lfs_hits++;
+			return true;
+		}
+	}
+	set->lfs_misses++;
+	return false;
+}
+
+/*
+ * Insert the FID into the set if it is not there yet.
+ */
+void lcrp_fidset_insert(struct lcrp_fidset *set, const struct lu_fid *fid)
+{
+	unsigned long mask = set->lfs_size - 1;
+	unsigned long i;
+
+	if (set->lfs_fids == NULL || fid_is_zero(fid))
+		return;
+
+	for (i = lcrp_fid_hash(fid) & mask; !fid_is_zero(&set->lfs_fids[i]);
+	     i = (i + 1) & mask) {
+		if (lcrp_fid_equal(&set->lfs_fids[i], fid))
+			return;
+	}
+
+	/* Keep the load factor under 3/4 so that probing stays short */
+	if (set->lfs_count + 1 > set->lfs_size / 4 * 3) {
+		LDEBUG("FID set with [%lu] slots is full, resetting\n",
+		       set->lfs_size);
+		set->lfs_overflows++;
+		lcrp_fidset_reset(set);
+		i = lcrp_fid_hash(fid) & mask;
+	}
+
+	set->lfs_fids[i] = *fid;
+	set->lfs_count++;
+}
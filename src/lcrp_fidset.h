@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_FIDSET_H_
+#define _LCRP_FIDSET_H_
+
+#include <stdbool.h>
+#include <lustre/lustreapi.h>
+
+/*
+ * Open addressing hash set of FIDs, zero FID marks an empty slot
+ */
+struct lcrp_fidset {
+	/* Slots of the set, NULL if the set is disabled */
+	struct lu_fid		*lfs_fids;
+	/* Number of slots, power of 2 */
+	unsigned long		 lfs_size;
+	/* Number of FIDs in the set */
+	unsigned long		 lfs_count;
+	/* Number of lookups that found the FID */
+	unsigned long long	 lfs_hits;
+	/* Number of lookups that did not find the FID */
+	unsigned long long	 lfs_misses;
+	/* Number of times the set was reset because it was full */
+	unsigned long long	 lfs_overflows;
+};
+
+static inline unsigned long lcrp_fid_hash(const struct lu_fid *fid)
+{
+	unsigned long long hash;
+
+	hash = fid->f_seq * 0x9E3779B97F4A7C15ULL;
+	hash ^= ((unsigned long long)fid->f_oid << 32) | fid->f_ver;
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static inline bool lcrp_fid_equal(const struct lu_fid *f1,
+				  const struct lu_fid *f2)
+{
+	return f1->f_seq == f2->f_seq && f1->f_oid == f2->f_oid &&
+		f1->f_ver == f2->f_ver;
+}
+
+int lcrp_fidset_init(struct lcrp_fidset *set, unsigned long size);
+void lcrp_fidset_fini(struct lcrp_fidset *set);
+void lcrp_fidset_reset(struct lcrp_fidset *set);
+bool lcrp_fidset_lookup(struct lcrp_fidset *set, const struct lu_fid *fid);
+void lcrp_fidset_insert(struct lcrp_fidset *set, const struct lu_fid *fid);
+#endif /* _LCRP_FIDSET_H_ */
@@ -0,0 +1,818 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Epochs and cleanup of the access history directory.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <linux/limits.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <lustre/lustreapi.h>
+
+#include "debug.h"
+#include "lcrp_changelog.h"
+#include "lcrp_cleanup.h"
+#include "lcrp_stats.h"
+#include "lcrpd.h"
+
+int lcrp_init_dir(void)
+{
+	int i;
+	int rc;
+	char *resolved_path;
+	char path[PATH_MAX + 1];
+	struct lcrp_tiers *tiers = &lcrp_status->ls_tiers;
+	int interval = lcrp_status->ls_epoch.le_seconds;
+
+	if (strlen(lcrp_status->ls_dir_access_history) < 1) {
+		LERROR("unexpected zero length of access history directory\n");
+		return -EINVAL;
+	}
+
+	if (lcrp_status->ls_dir_access_history[0] == '/')
+		snprintf(path, sizeof(path), "%s",
+			 lcrp_status->ls_dir_access_history);
+	else
+		snprintf(path, sizeof(path), "%s/%s", lcrp_status->ls_cwd,
+			 lcrp_status->ls_dir_access_history);
+
+	resolved_path = realpath(path, lcrp_status->ls_dir_access_history);
+	if (resolved_path == NULL) {
+		LERROR("failed to get real path of [%s]\n", path);
+		return -errno;
+	}
+
+	snprintf(lcrp_status->ls_dir_fid, sizeof(lcrp_status->ls_dir_fid),
+		 "%s/%s", lcrp_status->ls_dir_access_history,
+		 LCRP_NAME_FIDS);
+	rc = lcrp_find_or_mkdir(lcrp_status->ls_dir_fid);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n",
+			lcrp_status->ls_dir_fid);
+		return rc;
+	}
+
+	snprintf(lcrp_status->ls_dir_active,
+		 sizeof(lcrp_status->ls_dir_active), "%s/%s",
+		 lcrp_status->ls_dir_access_history, LCRP_NAME_ACTIVE);
+	rc = lcrp_find_or_mkdir(lcrp_status->ls_dir_active);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n",
+			lcrp_status->ls_dir_active);
+		return rc;
+	}
+
+	if (tiers->lts_count == 0) {
+		lcrp_tiers_default(tiers, interval);
+	} else if (tiers->lts_tiers[0].lt_seconds != interval) {
+		LERROR("duration of active in [%s] conflicts with [%s = %d]\n",
+		       LCRP_STR_TIERS, LCRP_STR_EPOCH_INTERVAL, interval);
+		return -EINVAL;
+	}
+
+	/* Active has been created above */
+	snprintf(lcrp_status->ls_dir_tiers[0],
+		 sizeof(lcrp_status->ls_dir_tiers[0]), "%s",
+		 lcrp_status->ls_dir_active);
+	for (i = 1; i < tiers->lts_count; i++) {
+		snprintf(lcrp_status->ls_dir_tiers[i],
+			 sizeof(lcrp_status->ls_dir_tiers[i]), "%s/%s",
+			 lcrp_status->ls_dir_access_history,
+			 tiers->lts_tiers[i].lt_name);
+		rc = lcrp_find_or_mkdir(lcrp_status->ls_dir_tiers[i]);
+		if (rc) {
+			LERROR("failed to find or create directory [%s]\n",
+			       lcrp_status->ls_dir_tiers[i]);
+			return rc;
+		}
+	}
+
+	/* Queries need the tiers to tell where a FID is */
+	snprintf(path, sizeof(path), "%s/%s",
+		 lcrp_status->ls_dir_access_history, LCRP_NAME_TIERS);
+	rc = lcrp_tiers_save(tiers, path);
+	if (rc) {
+		LERROR("failed to save tiers to [%s]\n", path);
+		return rc;
+	}
+
+	snprintf(lcrp_status->ls_dir_inactive,
+		 sizeof(lcrp_status->ls_dir_inactive), "%s/%s",
+		 lcrp_status->ls_dir_access_history, LCRP_NAME_INACTIVE);
+	rc = lcrp_find_or_mkdir(lcrp_status->ls_dir_inactive);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n",
+			lcrp_status->ls_dir_inactive);
+		return rc;
+	}
+
+	snprintf(lcrp_status->ls_dir_inactive_all,
+		 sizeof(lcrp_status->ls_dir_inactive_all), "%s/%s",
+		 lcrp_status->ls_dir_inactive, LCRP_NAME_INACTIVE_ALL);
+	rc = lcrp_find_or_mkdir(lcrp_status->ls_dir_inactive_all);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n",
+			lcrp_status->ls_dir_inactive_all);
+		return rc;
+	}
+
+	snprintf(lcrp_status->ls_cleanup_checkpoint,
+		 sizeof(lcrp_status->ls_cleanup_checkpoint), "%s/%s",
+		 lcrp_status->ls_dir_access_history,
+		 LCRP_NAME_CLEANUP_CHECKPOINT);
+
+	snprintf(lcrp_status->ls_dir_changelog_checkpoint,
+		 sizeof(lcrp_status->ls_dir_changelog_checkpoint), "%s/%s",
+		 lcrp_status->ls_dir_access_history,
+		 LCRP_NAME_CHANGELOG_CHECKPOINT);
+	rc = lcrp_find_or_mkdir(lcrp_status->ls_dir_changelog_checkpoint);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n",
+			lcrp_status->ls_dir_changelog_checkpoint);
+		return rc;
+	}
+
+	snprintf(lcrp_status->ls_dir_spill,
+		 sizeof(lcrp_status->ls_dir_spill), "%s/%s",
+		 lcrp_status->ls_dir_access_history, LCRP_NAME_SPILL);
+	rc = lcrp_find_or_mkdir(lcrp_status->ls_dir_spill);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n",
+			lcrp_status->ls_dir_spill);
+		return rc;
+	}
+
+	snprintf(lcrp_status->ls_stats_file,
+		 sizeof(lcrp_status->ls_stats_file), "%s/%s",
+		 lcrp_status->ls_dir_access_history, LCRP_NAME_STATS);
+
+	if (!lcrp_status->ls_fid_index)
+		return 0;
+
+	snprintf(lcrp_status->ls_dir_fid_index,
+		 sizeof(lcrp_status->ls_dir_fid_index), "%s/%s",
+		 lcrp_status->ls_dir_access_history, LCRP_NAME_FID_INDEX);
+	rc = lcrp_index_open(&lcrp_status->ls_index,
+			     lcrp_status->ls_dir_fid_index, false);
+	if (rc) {
+		LERROR("failed to open index [%s]\n",
+		       lcrp_status->ls_dir_fid_index);
+		return rc;
+	}
+	lcrp_index_set_half_life(&lcrp_status->ls_index,
+				 lcrp_status->ls_heat_half_life);
+	lcrp_status->ls_epoch.le_index = &lcrp_status->ls_index;
+	return 0;
+}
+
+/*
+ * Whether the merge is of the epoch directory dir/name, or into it if dest
+ */
+static bool lcrp_retired_epoch_match(struct lcrp_retired_epoch *retired,
+				     const char *dir, const char *name,
+				     bool dest)
+{
+	size_t len = strlen(dir);
+
+	if (retired == NULL)
+		return false;
+	if (strcmp(retired->lre_dir, dir) == 0 &&
+	    strcmp(retired->lre_name, name) == 0)
+		return true;
+	return dest && strncmp(retired->lre_dest, dir, len) == 0 &&
+		retired->lre_dest[len] == '/' &&
+		strcmp(retired->lre_dest + len + 1, name) == 0;
+}
+
+/*
+ * Whether the epoch directory is queued or being merged, or if dest, the
+ * destination of a queued or ongoing merge. Caller should hold liti_mutex.
+ */
+static bool lcrp_merge_pending(const char *dir, const char *name, bool dest)
+{
+	struct lcrp_retired_epoch *retired;
+	struct lcrp_inactive_thread_info *info = &lcrp_status->ls_inactive_info;
+
+	if (lcrp_retired_epoch_match(info->liti_current, dir, name, dest))
+		return true;
+	for (retired = info->liti_head; retired != NULL;
+	     retired = retired->lre_next) {
+		if (lcrp_retired_epoch_match(retired, dir, name, dest))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Queue the epoch directory dir/name to merge into dest, so that the
+ * inactive thread merges it. Nothing is done if it is already queued.
+ */
+int lcrp_merge_epoch(const char *dir, const char *name, const char *dest)
+{
+	struct lcrp_retired_epoch *retired;
+	struct lcrp_inactive_thread_info *info = &lcrp_status->ls_inactive_info;
+
+	retired = calloc(1, sizeof(*retired));
+	if (retired == NULL) {
+		LERROR("failed to allocate retired epoch [%s]\n", name);
+		return -ENOMEM;
+	}
+	snprintf(retired->lre_name, sizeof(retired->lre_name), "%s", name);
+	snprintf(retired->lre_dir, sizeof(retired->lre_dir), "%s", dir);
+	snprintf(retired->lre_dest, sizeof(retired->lre_dest), "%s", dest);
+
+	pthread_mutex_lock(&info->liti_mutex);
+	if (lcrp_merge_pending(dir, name, false)) {
+		pthread_mutex_unlock(&info->liti_mutex);
+		free(retired);
+		return 0;
+	}
+	if (info->liti_tail == NULL)
+		info->liti_head = retired;
+	else
+		info->liti_tail->lre_next = retired;
+	info->liti_tail = retired;
+	pthread_cond_signal(&info->liti_cond);
+	pthread_mutex_unlock(&info->liti_mutex);
+	return 0;
+}
+
+/*
+ * Queue an epoch that has been moved into the inactive directory, so that
+ * the inactive thread cleans it up
+ */
+int lcrp_retire_epoch(const char *name)
+{
+	return lcrp_merge_epoch(lcrp_status->ls_dir_inactive, name,
+				lcrp_status->ls_dir_inactive_all);
+}
+
+static struct lcrp_retired_epoch *lcrp_retired_epoch_pop(void)
+{
+	struct lcrp_retired_epoch *retired;
+	struct lcrp_inactive_thread_info *info = &lcrp_status->ls_inactive_info;
+
+	pthread_mutex_lock(&info->liti_mutex);
+	retired = info->liti_head;
+	if (retired != NULL) {
+		info->liti_head = retired->lre_next;
+		if (info->liti_head == NULL)
+			info->liti_tail = NULL;
+		retired->lre_next = NULL;
+	}
+	info->liti_current = retired;
+	pthread_mutex_unlock(&info->liti_mutex);
+	return retired;
+}
+
+/*
+ * Free an epoch whose merge has been finished or failed
+ */
+static void lcrp_retired_epoch_done(struct lcrp_retired_epoch *retired)
+{
+	struct lcrp_inactive_thread_info *info = &lcrp_status->ls_inactive_info;
+
+	pthread_mutex_lock(&info->liti_mutex);
+	info->liti_current = NULL;
+	pthread_mutex_unlock(&info->liti_mutex);
+	free(retired);
+}
+
+/*
+ * Put back an epoch whose cleanup has been interrupted to the queue head
+ */
+static void lcrp_retired_epoch_requeue(struct lcrp_retired_epoch *retired)
+{
+	struct lcrp_inactive_thread_info *info = &lcrp_status->ls_inactive_info;
+
+	pthread_mutex_lock(&info->liti_mutex);
+	info->liti_current = NULL;
+	retired->lre_next = info->liti_head;
+	info->liti_head = retired;
+	if (info->liti_tail == NULL)
+		info->liti_tail = retired;
+	pthread_mutex_unlock(&info->liti_mutex);
+}
+
+/*
+ * Queue the epochs left in the inactive directory, e.g. by the last run
+ * of the daemon
+ */
+int lcrp_inactive_scan(void)
+{
+	int ret;
+	int end;
+	DIR *dir;
+	int start;
+	int rc = 0;
+	const char *root;
+	struct dirent *dirent;
+
+	root = lcrp_status->ls_dir_inactive;
+	dir = opendir(root);
+	if (dir == NULL) {
+		LERROR("failed to open directory [%s]: %s\n",
+		       root, strerror(errno));
+		return -errno;
+	}
+
+	while (true) {
+		errno = 0;
+		dirent = readdir(dir);
+		if (dirent == NULL) {
+			if (errno != 0) {
+				LERROR("failed to read directory [%s]: %s\n",
+				       root,
+				       strerror(errno));
+				rc = -errno;
+			}
+			break;
+		}
+
+		/* skip "." and ".." */
+		if (strcmp(dirent->d_name, ".") == 0 ||
+		    strcmp(dirent->d_name, "..") == 0 ||
+		    strcmp(dirent->d_name, LCRP_NAME_INACTIVE_ALL) == 0)
+			continue;
+
+		if (sscanf(dirent->d_name, "%d-%d", &start, &end) != 2) {
+			LWARN("invalid name pattern of file [%s/%s], ignoring\n",
+			      root, dirent->d_name);
+			continue;
+		}
+		if (start >= end) {
+			LWARN("invalid start/end of file [%s/%s], ignoring\n",
+			      root, dirent->d_name);
+			continue;
+		}
+		rc = lcrp_retire_epoch(dirent->d_name);
+		if (rc)
+			break;
+	}
+
+	ret = closedir(dir);
+	if (ret) {
+		LERROR("failed to close dir [%s]: %s\n", root,
+		       strerror(errno));
+		if (rc == 0)
+			rc = -errno;
+	}
+	return rc;
+}
+
+/*
+ * Merge the queued epochs, no more than rate files per second if rate is
+ * positive. Return -EINTR if stopped before all of them are merged.
+ */
+int lcrp_inactive_cleanup(int rate, bool *stopping)
+{
+	int rc = 0;
+	int ret;
+	unsigned long long start;
+	struct lcrp_cleanup_budget budget;
+	struct lcrp_retired_epoch *retired;
+	struct lcrp_inactive_thread_info *info = &lcrp_status->ls_inactive_info;
+
+	if (__atomic_load_n(&info->liti_head, __ATOMIC_ACQUIRE) == NULL)
+		return 0;
+
+	memset(&budget, 0, sizeof(budget));
+	budget.lcb_rate = rate;
+	budget.lcb_stopping = stopping;
+	clock_gettime(CLOCK_MONOTONIC, &budget.lcb_start);
+	while ((retired = lcrp_retired_epoch_pop()) != NULL) {
+		start = lcrp_stats_nsec();
+		ret = lcrp_cleanup_epoch(retired->lre_dir, retired->lre_name,
+					 retired->lre_dest,
+					 lcrp_status->ls_cleanup_threads,
+					 &budget);
+		if (ret == -EINTR) {
+			lcrp_retired_epoch_requeue(retired);
+			rc = ret;
+			break;
+		}
+		if (ret) {
+			LERROR("failed to merge dir [%s/%s] into [%s]\n",
+			       retired->lre_dir, retired->lre_name,
+			       retired->lre_dest);
+			if (rc == 0)
+				rc = ret;
+		} else {
+			LDEBUG("merged epoch [%s/%s] into [%s]\n",
+			       retired->lre_dir, retired->lre_name,
+			       retired->lre_dest);
+			lcrp_stats_add(LCRP_COUNTER_CLEANUP_EPOCHS, 1);
+			lcrp_stats_observe(LCRP_HIST_CLEANUP_EPOCH,
+					   lcrp_stats_nsec() - start);
+		}
+		lcrp_retired_epoch_done(retired);
+	}
+	return rc;
+}
+
+void *lcrp_inactive_thread(void *arg)
+{
+	int rc;
+	struct timespec deadline;
+	struct lcrp_inactive_thread_info *info = arg;
+	struct lcrp_thread_info *general = &info->liti_general;
+
+	while ((!lcrp_status->ls_stopping) && !(general->lti_stopping)) {
+		/* Wake up every second to check whether to stop */
+		pthread_mutex_lock(&info->liti_mutex);
+		if (info->liti_head == NULL) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec++;
+			pthread_cond_timedwait(&info->liti_cond,
+					       &info->liti_mutex, &deadline);
+		}
+		pthread_mutex_unlock(&info->liti_mutex);
+
+		rc = lcrp_inactive_cleanup(lcrp_status->ls_cleanup_rate,
+					   &general->lti_stopping);
+		if (rc == -EINTR)
+			break;
+		if (rc) {
+			LERROR("failed to cleanup inactive directory\n");
+			break;
+		}
+	}
+	general->lti_stopped = true;
+	return NULL;
+}
+
+/*
+ * Move the epoch directory root/name to dest, or queue it to merge into
+ * dest if dest exists already. Return 1 if queued.
+ */
+static int lcrp_degrade_move(const char *root, const char *name,
+			     const char *dest, const char *merge_dest)
+{
+	int rc;
+	char subdir[PATH_MAX + 1];
+
+	snprintf(subdir, sizeof(subdir), "%s/%s", root, name);
+	rc = rename(subdir, dest);
+	if (rc == 0)
+		return 0;
+	if (errno != EEXIST && errno != ENOTEMPTY) {
+		LERROR("failed to rename [%s] to [%s]: %s\n",
+		       subdir, dest, strerror(errno));
+		return -errno;
+	}
+
+	LDEBUG("[%s] exists, merging [%s] into [%s]\n", dest, subdir,
+	       merge_dest);
+	rc = lcrp_merge_epoch(root, name, merge_dest);
+	if (rc)
+		return rc;
+	return 1;
+}
+
+/*
+ * Move the epoch directories of a tier that have got too old for it to
+ * the tier they belong to, merging them into the directory aligned to the
+ * duration of that tier. Directories older than the last tier are moved
+ * into the inactive directory.
+ */
+static int lcrp_degrade_directory(struct lcrp_epoch *epoch, int tier)
+{
+	int ret;
+	int end;
+	DIR *dir;
+	int start;
+	int rc = 0;
+	int target;
+	int bucket;
+	bool pending;
+	const char *root;
+	struct dirent *dirent;
+	char newdir[PATH_MAX + 1];
+	const char *inactive_all = lcrp_status->ls_dir_inactive_all;
+	struct lcrp_tiers *tiers = &lcrp_status->ls_tiers;
+	struct lcrp_inactive_thread_info *info = &lcrp_status->ls_inactive_info;
+
+	root = lcrp_status->ls_dir_tiers[tier];
+	dir = opendir(root);
+	if (dir == NULL) {
+		LERROR("failed to open directory [%s]: %s\n",
+		       root, strerror(errno));
+		rc = -errno;
+		goto out;
+	}
+
+	while (rc == 0) {
+		errno = 0;
+		dirent = readdir(dir);
+		if (dirent == NULL) {
+			if (errno != 0) {
+				LERROR("failed to read directory [%s]: %s\n",
+				       root,
+				       strerror(errno));
+				rc = -errno;
+			}
+			break;
+		}
+
+		/* skip "." and ".." */
+		if (strcmp(dirent->d_name, ".") == 0 ||
+		    strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		if (sscanf(dirent->d_name, "%d-%d", &start, &end) != 2) {
+			LWARN("invalid name pattern of file [%s/%s], ignoring\n",
+			      root, dirent->d_name);
+			continue;
+		}
+		if (start >= end) {
+			LWARN("invalid start/end of file [%s/%s], ignoring\n",
+			      root, dirent->d_name);
+			continue;
+		}
+
+		target = lcrp_tier_locate(tiers, epoch->le_start, tier, end);
+		if (target == tier) {
+			LDEBUG("[%s/%s] is %s\n", root, dirent->d_name,
+			       tiers->lts_tiers[tier].lt_name);
+			continue;
+		}
+
+		/*
+		 * The inactive thread removes it after merging, or merges other
+		 * directories into it, which would be lost once it is moved
+		 */
+		pthread_mutex_lock(&info->liti_mutex);
+		pending = lcrp_merge_pending(root, dirent->d_name, true);
+		pthread_mutex_unlock(&info->liti_mutex);
+		if (pending) {
+			LDEBUG("[%s/%s] is being merged, skipping\n", root,
+			       dirent->d_name);
+			continue;
+		}
+
+		if (target == tiers->lts_count) {
+			LDEBUG("[%s/%s] is inactive\n", root, dirent->d_name);
+			snprintf(newdir, sizeof(newdir), "%s/%s",
+				 lcrp_status->ls_dir_inactive, dirent->d_name);
+			rc = lcrp_degrade_move(root, dirent->d_name, newdir,
+					       inactive_all);
+			if (rc == 0)
+				rc = lcrp_retire_epoch(dirent->d_name);
+		} else {
+			bucket = lcrp_tier_bucket(tiers, target, start);
+			LDEBUG("[%s/%s] is %s\n", root, dirent->d_name,
+			       tiers->lts_tiers[target].lt_name);
+			snprintf(newdir, sizeof(newdir), "%s/%d-%d",
+				 lcrp_status->ls_dir_tiers[target], bucket,
+				 bucket + tiers->lts_tiers[target].lt_seconds);
+			rc = lcrp_degrade_move(root, dirent->d_name, newdir,
+					       newdir);
+		}
+		if (rc > 0)
+			rc = 0;
+	}
+
+	ret = closedir(dir);
+	if (ret) {
+		LERROR("failed to close dir [%s]: %s\n", root,
+		       strerror(errno));
+		if (rc == 0)
+			rc = -errno;
+		goto out;
+	}
+
+out:
+	return rc;
+}
+
+/*
+ * Cascade the epoch directories through the tiers, from the oldest tier
+ * so that each directory is moved at most once
+ */
+static int lcrp_degrade(struct lcrp_epoch *epoch)
+{
+	int rc;
+	int tier;
+
+	for (tier = lcrp_status->ls_tiers.lts_count - 1; tier >= 0; tier--) {
+		rc = lcrp_degrade_directory(epoch, tier);
+		if (rc) {
+			LERROR("failed to degrade directory [%s]\n",
+			       lcrp_status->ls_dir_tiers[tier]);
+			return rc;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Create the directory of the epoch that starts at start and all of its
+ * bucket directories, so that rolling over to the epoch only switches
+ * the snapshot and its first records do not pay for mkdir. The bucket
+ * directories are created by batches of LCRP_IO_DEPTH.
+ */
+int lcrp_epoch_prepare(struct lcrp_epoch *epoch, int start)
+{
+	int i;
+	int fd;
+	int rc;
+	unsigned int bucket;
+	int end = start + epoch->le_seconds;
+	char name[LCRP_BUCKET_NAMELEN];
+	char dir_active[PATH_MAX + 1];
+	struct lcrp_io *io;
+	struct lcrp_io_op *op;
+
+	snprintf(dir_active, sizeof(dir_active), "%s/%d-%d",
+		 lcrp_status->ls_dir_active, start, end);
+	rc = lcrp_find_or_mkdir(dir_active);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n",
+		       dir_active);
+		return rc;
+	}
+
+	io = malloc(sizeof(*io));
+	if (io == NULL) {
+		LERROR("failed to allocate batch of operations\n");
+		return -ENOMEM;
+	}
+	rc = lcrp_io_init(io, lcrp_status->ls_io_uring);
+	if (rc)
+		goto out_free;
+
+	fd = open(dir_active, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		LERROR("failed to open directory [%s]: %s\n", dir_active,
+		       strerror(errno));
+		rc = -errno;
+		goto out_fini;
+	}
+
+	for (bucket = 0; bucket < LCRP_BUCKET_COUNT; bucket++) {
+		snprintf(name, sizeof(name), LCRP_BUCKET_FORMAT, bucket);
+		lcrp_io_queue(io, LCRP_IO_MKDIR, fd, name);
+		if (lcrp_io_space(io) > 0 && bucket < LCRP_BUCKET_COUNT - 1)
+			continue;
+
+		if (lcrp_status->ls_stopping) {
+			rc = -EINTR;
+			break;
+		}
+
+		rc = lcrp_io_submit(io);
+		if (rc)
+			break;
+		for (i = 0; i < io->lio_count; i++) {
+			op = &io->lio_ops[i];
+			/* Readers of the current epoch might have created it */
+			if (op->lio_result && op->lio_result != -EEXIST) {
+				LERROR("failed to create directory [%s/%s]: %s\n",
+				       dir_active, op->lio_path,
+				       strerror(-op->lio_result));
+				rc = op->lio_result;
+				break;
+			}
+		}
+		if (rc)
+			break;
+		lcrp_io_reset(io);
+	}
+	close(fd);
+out_fini:
+	lcrp_io_fini(io);
+out_free:
+	free(io);
+
+	if (rc == 0) {
+		__atomic_store_n(&epoch->le_prepared, start, __ATOMIC_RELEASE);
+		LINFO("prepared directory [%s]\n", dir_active);
+	}
+	return rc;
+}
+
+/*
+ * Prepare the directory of the next epoch as soon as the current one
+ * starts
+ */
+void *lcrp_prepare_thread(void *arg)
+{
+	int rc;
+	int next;
+	struct lcrp_epoch *epoch = &lcrp_status->ls_epoch;
+	struct lcrp_prepare_thread_info *info = arg;
+	struct lcrp_thread_info *general = &info->lpti_general;
+
+	while ((!lcrp_status->ls_stopping) && !(general->lti_stopping)) {
+		next = __atomic_load_n(&epoch->le_start, __ATOMIC_ACQUIRE) +
+			epoch->le_seconds;
+		if (__atomic_load_n(&epoch->le_prepared,
+				    __ATOMIC_ACQUIRE) != next) {
+			rc = lcrp_epoch_prepare(epoch, next);
+			/* Not fatal, the rollover creates what is missing */
+			if (rc && rc != -EINTR)
+				LERROR("failed to prepare directory of epoch [%d-%d]\n",
+				       next, next + epoch->le_seconds);
+		}
+		sleep(1);
+	}
+	general->lti_stopped = true;
+	return NULL;
+}
+
+int _lcrp_epoch_update(struct lcrp_epoch *epoch, int current_second)
+{
+	int rc;
+	int interval = epoch->le_seconds;
+	unsigned long long lag_count;
+	unsigned long long start = lcrp_stats_nsec();
+	char dir_active[PATH_MAX + 1];
+
+	LASSERT(current_second > interval);
+	pthread_mutex_lock(&epoch->le_mutex);
+	if (epoch->le_start != 0)
+		LINFO("FID cache before epoch [%d-%d]: [%llu] hits, [%llu] misses\n",
+		      current_second, current_second + interval,
+		      __atomic_load_n(&epoch->le_fid_hits, __ATOMIC_RELAXED),
+		      __atomic_load_n(&epoch->le_fid_misses,
+				      __ATOMIC_RELAXED));
+
+	lag_count = __atomic_load_n(&epoch->le_lag_count, __ATOMIC_RELAXED);
+	if (lag_count > 0)
+		LINFO("time from record to processed before epoch [%d-%d]: avg [%.3f] ms, max [%.3f] ms\n",
+		      current_second, current_second + interval,
+		      __atomic_load_n(&epoch->le_lag_total, __ATOMIC_RELAXED) /
+		      1000000.0 / lag_count,
+		      __atomic_load_n(&epoch->le_lag_max, __ATOMIC_RELAXED) /
+		      1000000.0);
+
+	if (__atomic_load_n(&epoch->le_prepared,
+			    __ATOMIC_ACQUIRE) != current_second)
+		LINFO("directory of epoch [%d-%d] is not prepared\n",
+		      current_second, current_second + interval);
+
+	/* Create the new directory before any reader can see it */
+	snprintf(dir_active, sizeof(dir_active), "%s/%d-%d",
+		 lcrp_status->ls_dir_active, current_second,
+		 current_second + interval);
+	rc = lcrp_find_or_mkdir(dir_active);
+	if (rc) {
+		LERROR("failed to find or create directory [%s]\n",
+		       dir_active);
+		goto out;
+	}
+
+	/* No reader is linking into the old directory after this */
+	rc = lcrp_epoch_publish(epoch, current_second,
+				current_second + interval, dir_active);
+	if (rc) {
+		LERROR("failed to publish epoch [%d-%d]\n", current_second,
+		       current_second + interval);
+		goto out;
+	}
+
+	__atomic_store_n(&epoch->le_start, current_second, __ATOMIC_RELEASE);
+	/* Directories opened before this might be moved by degrading */
+	epoch->le_moves++;
+	rc = lcrp_degrade(epoch);
+	if (rc) {
+		LERROR("failed to degrade to udpate epoch\n");
+		goto out;
+	}
+	lcrp_stats_add(LCRP_COUNTER_ROLLOVERS, 1);
+	lcrp_stats_observe(LCRP_HIST_ROLLOVER, lcrp_stats_nsec() - start);
+out:
+	pthread_mutex_unlock(&epoch->le_mutex);
+	LINFO("updated epoch to [%d-%d]\n", epoch->le_start,
+	      epoch->le_start + interval);
+	return rc;
+}
+
+int lcrp_epoch_update(void)
+{
+	int rc;
+	int seconds;
+	struct timeval this_time;
+	struct lcrp_epoch *epoch = &lcrp_status->ls_epoch;
+	int interval = epoch->le_seconds;
+
+	gettimeofday(&this_time, NULL);
+	seconds = this_time.tv_sec;
+	seconds = seconds / interval * interval;
+	if (seconds != epoch->le_start) {
+		rc = _lcrp_epoch_update(epoch, seconds);
+		if (rc) {
+			LERROR("failed to update epoch\n");
+			return rc;
+		}
+	}
+	return 0;
+}
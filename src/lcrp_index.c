@@ -0,0 +1,670 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Persistent index from FID to the epoch it was last accessed.
+ *
+ * The index is split into LCRP_INDEX_SHARDS files under the fid_index
+ * directory, each of them an open addressing hash table mapped into
+ * memory. Updates are done in place under the lock of the shard, so the
+ * pages are written back by the kernel. Dirty shards are synced to disk
+ * periodically and before records are cleared from Changelog, so that
+ * the updates of cleared records are never lost.
+ *
+ * A shard is grown by the main thread once it is half full, so that the
+ * threads handling records seldom wait for the copy and sync of a shard.
+ * They only grow the shard themselves if it gets 3/4 full before that.
+ *
+ * Crash safety:
+ *  - The checksum of an entry is written after the other fields, so an
+ *    entry torn by a crash is detected. The record being handled when
+ *    crashing has not been cleared from Changelog, so it is replayed.
+ *  - A shard that is not closed cleanly is rebuilt into a new file by
+ *    inserting the valid entries, which is then renamed over the old one.
+ *    Growing a shard uses the same shadow copy, so the old file is never
+ *    modified while being rehashed.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "lcrp_fidset.h"
+#include "lcrp_index.h"
+
+static __u32 lcrp_index_checksum(const struct lcrp_index_entry *entry)
+{
+	__u32 heat;
+	unsigned long long hash;
+
+	memcpy(&heat, &entry->lie_heat, sizeof(heat));
+	hash = lcrp_fid_hash(&entry->lie_fid);
+	hash ^= (__u32)entry->lie_epoch * 0x9E3779B97F4A7C15ULL;
+	hash ^= ((unsigned long long)entry->lie_heat_time << 32) | heat;
+	hash ^= hash >> 29;
+	hash *= 0xBF58476D1CE4E5B9ULL;
+	hash ^= hash >> 32;
+	/* Zero is never a valid checksum */
+	return (__u32)hash | 1;
+}
+
+bool lcrp_index_entry_valid(const struct lcrp_index_entry *entry)
+{
+	return !fid_is_zero(&entry->lie_fid) &&
+		entry->lie_check == lcrp_index_checksum(entry);
+}
+
+static struct lcrp_index_shard *
+lcrp_index_shard(struct lcrp_index *index, unsigned long long hash)
+{
+	return &index->li_shards[hash >> (64 - LCRP_INDEX_SHARD_BITS)];
+}
+
+/*
+ * Return the entry of the FID, or the empty entry to insert it into
+ */
+static struct lcrp_index_entry *
+lcrp_index_probe(struct lcrp_index_entry *entries, __u64 capacity,
+		 const struct lu_fid *fid, unsigned long long hash)
+{
+	__u64 i;
+	__u64 mask = capacity - 1;
+	struct lcrp_index_entry *entry;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		entry = &entries[i];
+		if (fid_is_zero(&entry->lie_fid) ||
+		    lcrp_fid_equal(&entry->lie_fid, fid))
+			return entry;
+	}
+}
+
+static size_t lcrp_index_map_size(__u64 capacity)
+{
+	return LCRP_INDEX_HEADER_SIZE +
+		capacity * sizeof(struct lcrp_index_entry);
+}
+
+static int lcrp_index_path(struct lcrp_index *index, int i,
+			   const char *suffix, char *path, size_t size)
+{
+	int rc;
+
+	rc = snprintf(path, size, "%s/%02d%s", index->li_dir, i, suffix);
+	if (rc >= size) {
+		LERROR("path of shard [%d] under [%s] is too long\n", i,
+		       index->li_dir);
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+static int lcrp_index_sync_dir(struct lcrp_index *index)
+{
+	int fd;
+	int rc;
+
+	fd = open(index->li_dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		LERROR("failed to open [%s]: %s\n", index->li_dir,
+		       strerror(errno));
+		return -errno;
+	}
+
+	rc = fsync(fd);
+	if (rc) {
+		LERROR("failed to sync [%s]: %s\n", index->li_dir,
+		       strerror(errno));
+		rc = -errno;
+	}
+	close(fd);
+	return rc;
+}
+
+static void lcrp_index_shard_unmap(struct lcrp_index_shard *shard)
+{
+	if (shard->lis_header != NULL)
+		munmap(shard->lis_header, shard->lis_size);
+	if (shard->lis_fd >= 0)
+		close(shard->lis_fd);
+	shard->lis_header = NULL;
+	shard->lis_entries = NULL;
+	shard->lis_size = 0;
+	shard->lis_fd = -1;
+}
+
+static int lcrp_index_shard_map(struct lcrp_index_shard *shard, int fd,
+				const char *path, bool readonly)
+{
+	ssize_t ret;
+	size_t size;
+	void *map;
+	struct stat st;
+	struct lcrp_index_header header;
+
+	ret = pread(fd, &header, sizeof(header), 0);
+	if (ret != sizeof(header)) {
+		LERROR("failed to read header of [%s]\n", path);
+		return ret < 0 ? -errno : -EIO;
+	}
+
+	/* Reported by the caller */
+	if (header.lih_magic == LCRP_INDEX_MAGIC &&
+	    header.lih_version != LCRP_INDEX_VERSION)
+		return -EPROTO;
+
+	if (header.lih_magic != LCRP_INDEX_MAGIC ||
+	    header.lih_capacity == 0 ||
+	    (header.lih_capacity & (header.lih_capacity - 1)) != 0) {
+		LERROR("invalid header of [%s]\n", path);
+		return -EINVAL;
+	}
+
+	size = lcrp_index_map_size(header.lih_capacity);
+	if (fstat(fd, &st) || st.st_size < size) {
+		LERROR("[%s] is truncated\n", path);
+		return -EINVAL;
+	}
+
+	map = mmap(NULL, size, readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		LERROR("failed to map [%s]: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	shard->lis_fd = fd;
+	shard->lis_header = map;
+	shard->lis_entries = map + LCRP_INDEX_HEADER_SIZE;
+	shard->lis_size = size;
+	return 0;
+}
+
+/*
+ * Write the valid entries of a shard into a new file with the given
+ * capacity, and replace the shard with it. The shard could be unmapped.
+ */
+static int lcrp_index_shard_rebuild(struct lcrp_index *index, int i,
+				    __u64 capacity)
+{
+	int fd;
+	int rc;
+	__u64 j;
+	__u64 count = 0;
+	__u64 dropped = 0;
+	size_t size = lcrp_index_map_size(capacity);
+	void *map;
+	char path[PATH_MAX + 1];
+	char tmp[PATH_MAX + 1];
+	struct lcrp_index_header *header;
+	struct lcrp_index_entry *entries;
+	struct lcrp_index_entry *entry;
+	struct lcrp_index_shard *shard = &index->li_shards[i];
+
+	rc = lcrp_index_path(index, i, "", path, sizeof(path));
+	if (rc)
+		return rc;
+	rc = lcrp_index_path(index, i, ".tmp", tmp, sizeof(tmp));
+	if (rc)
+		return rc;
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LERROR("failed to create [%s]: %s\n", tmp, strerror(errno));
+		return -errno;
+	}
+
+	rc = ftruncate(fd, size);
+	if (rc) {
+		LERROR("failed to truncate [%s]: %s\n", tmp, strerror(errno));
+		rc = -errno;
+		goto out_close;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		LERROR("failed to map [%s]: %s\n", tmp, strerror(errno));
+		rc = -errno;
+		goto out_close;
+	}
+	header = map;
+	entries = map + LCRP_INDEX_HEADER_SIZE;
+
+	for (j = 0; shard->lis_header != NULL &&
+	     j < shard->lis_header->lih_capacity; j++) {
+		entry = &shard->lis_entries[j];
+		if (fid_is_zero(&entry->lie_fid))
+			continue;
+		if (!lcrp_index_entry_valid(entry)) {
+			dropped++;
+			continue;
+		}
+		*lcrp_index_probe(entries, capacity, &entry->lie_fid,
+				  lcrp_fid_hash(&entry->lie_fid)) = *entry;
+		count++;
+	}
+	if (dropped > 0)
+		LWARN("dropped [%llu] torn entries of [%s]\n", dropped, path);
+
+	header->lih_magic = LCRP_INDEX_MAGIC;
+	header->lih_version = LCRP_INDEX_VERSION;
+	header->lih_shard = i;
+	header->lih_clean = 0;
+	header->lih_capacity = capacity;
+	header->lih_count = count;
+	header->lih_half_life = index->li_half_life;
+	rc = msync(map, size, MS_SYNC);
+	if (rc) {
+		LERROR("failed to sync [%s]: %s\n", tmp, strerror(errno));
+		rc = -errno;
+		goto out_unmap;
+	}
+
+	rc = rename(tmp, path);
+	if (rc) {
+		LERROR("failed to rename [%s] to [%s]: %s\n", tmp, path,
+		       strerror(errno));
+		rc = -errno;
+		goto out_unmap;
+	}
+
+	/* The new file is in use anyway, only durability of rename is lost */
+	lcrp_index_sync_dir(index);
+
+	lcrp_index_shard_unmap(shard);
+	shard->lis_fd = fd;
+	shard->lis_header = header;
+	shard->lis_entries = entries;
+	shard->lis_size = size;
+	shard->lis_dirty = false;
+	return 0;
+out_unmap:
+	munmap(map, size);
+out_close:
+	close(fd);
+	unlink(tmp);
+	return rc;
+}
+
+static int lcrp_index_shard_open(struct lcrp_index *index, int i,
+				 int *recovered)
+{
+	int fd;
+	int rc;
+	char path[PATH_MAX + 1];
+	struct lcrp_index_shard *shard = &index->li_shards[i];
+
+	rc = lcrp_index_path(index, i, "", path, sizeof(path));
+	if (rc)
+		return rc;
+	fd = open(path, index->li_readonly ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		if (errno == ENOENT && !index->li_readonly)
+			return lcrp_index_shard_rebuild(index, i,
+						LCRP_INDEX_INITIAL_CAPACITY);
+		LERROR("failed to open [%s]: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	rc = lcrp_index_shard_map(shard, fd, path, index->li_readonly);
+	if (rc) {
+		close(fd);
+		if (rc != -EPROTO)
+			return rc;
+		if (index->li_readonly) {
+			LERROR("[%s] is of another version than [%d]\n", path,
+			       LCRP_INDEX_VERSION);
+			return rc;
+		}
+		/* Entries of other versions can not be read, start over */
+		LWARN("discarding [%s] of another version than [%d]\n", path,
+		      LCRP_INDEX_VERSION);
+		return lcrp_index_shard_rebuild(index, i,
+						LCRP_INDEX_INITIAL_CAPACITY);
+	}
+
+	if (index->li_readonly)
+		return 0;
+
+	if (!shard->lis_header->lih_clean) {
+		LDEBUG("[%s] was not closed cleanly, recovering\n", path);
+		(*recovered)++;
+		return lcrp_index_shard_rebuild(index, i,
+					shard->lis_header->lih_capacity);
+	}
+
+	shard->lis_header->lih_clean = 0;
+	rc = msync(shard->lis_header, LCRP_INDEX_HEADER_SIZE, MS_SYNC);
+	if (rc) {
+		LERROR("failed to sync [%s]: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+int lcrp_index_open(struct lcrp_index *index, const char *dir, bool readonly)
+{
+	int i;
+	int rc;
+	int recovered = 0;
+	struct lcrp_index_shard *shard;
+
+	memset(index, 0, sizeof(*index));
+	snprintf(index->li_dir, sizeof(index->li_dir), "%s", dir);
+	index->li_readonly = readonly;
+	for (i = 0; i < LCRP_INDEX_SHARDS; i++) {
+		shard = &index->li_shards[i];
+		pthread_mutex_init(&shard->lis_mutex, NULL);
+		shard->lis_fd = -1;
+	}
+
+	if (!readonly) {
+		rc = mkdir(dir, 0755);
+		if (rc && errno != EEXIST) {
+			LERROR("failed to create [%s]: %s\n", dir,
+			       strerror(errno));
+			rc = -errno;
+			goto error;
+		}
+	}
+
+	for (i = 0; i < LCRP_INDEX_SHARDS; i++) {
+		rc = lcrp_index_shard_open(index, i, &recovered);
+		if (rc)
+			goto error;
+	}
+	/* Decay the heat in queries the same way as lcrpd does */
+	if (readonly)
+		index->li_half_life =
+			index->li_shards[0].lis_header->lih_half_life;
+	if (recovered > 0)
+		LWARN("recovered [%d] shards of [%s] not closed cleanly\n",
+		      recovered, dir);
+	return 0;
+error:
+	lcrp_index_close(index);
+	return rc;
+}
+
+/*
+ * Sync the shards and mark them as closed cleanly
+ */
+void lcrp_index_close(struct lcrp_index *index)
+{
+	int i;
+	struct lcrp_index_shard *shard;
+
+	for (i = 0; i < LCRP_INDEX_SHARDS; i++) {
+		shard = &index->li_shards[i];
+		if (shard->lis_header != NULL && !index->li_readonly) {
+			/* Entries should be on disk before the clean mark */
+			if (msync(shard->lis_header, shard->lis_size,
+				  MS_SYNC) == 0) {
+				shard->lis_header->lih_clean = 1;
+				msync(shard->lis_header,
+				      LCRP_INDEX_HEADER_SIZE, MS_SYNC);
+			}
+		}
+		lcrp_index_shard_unmap(shard);
+		pthread_mutex_destroy(&shard->lis_mutex);
+	}
+}
+
+/*
+ * Write the dirty pages of the index to disk, so that at most the updates
+ * since the last sync are lost on power failure
+ */
+int lcrp_index_sync(struct lcrp_index *index)
+{
+	int i;
+	int rc = 0;
+	struct lcrp_index_shard *shard;
+
+	for (i = 0; i < LCRP_INDEX_SHARDS; i++) {
+		shard = &index->li_shards[i];
+		pthread_mutex_lock(&shard->lis_mutex);
+		if (!shard->lis_dirty) {
+			pthread_mutex_unlock(&shard->lis_mutex);
+			continue;
+		}
+		if (msync(shard->lis_header, shard->lis_size, MS_SYNC)) {
+			LERROR("failed to sync shard [%d] of [%s]: %s\n", i,
+			       index->li_dir, strerror(errno));
+			if (rc == 0)
+				rc = -errno;
+		} else {
+			shard->lis_dirty = false;
+		}
+		pthread_mutex_unlock(&shard->lis_mutex);
+	}
+	return rc;
+}
+
+/*
+ * Grow the shards that are half full, called periodically
+ */
+int lcrp_index_grow(struct lcrp_index *index)
+{
+	int i;
+	int rc = 0;
+	struct lcrp_index_header *header;
+	struct lcrp_index_shard *shard;
+
+	LASSERT(!index->li_readonly);
+	for (i = 0; i < LCRP_INDEX_SHARDS; i++) {
+		shard = &index->li_shards[i];
+		pthread_mutex_lock(&shard->lis_mutex);
+		header = shard->lis_header;
+		if (header->lih_count * 2 > header->lih_capacity) {
+			rc = lcrp_index_shard_rebuild(index, i,
+						      header->lih_capacity * 2);
+			if (rc)
+				LERROR("failed to grow shard [%d] of [%s]\n",
+				       i, index->li_dir);
+		}
+		pthread_mutex_unlock(&shard->lis_mutex);
+		if (rc)
+			break;
+	}
+	return rc;
+}
+
+/*
+ * Find the entry of the FID, or insert it as accessed in the given epoch.
+ * Return NULL if failed to grow the shard. Shard should be locked.
+ */
+static struct lcrp_index_entry *
+lcrp_index_find_or_insert(struct lcrp_index *index,
+			  struct lcrp_index_shard *shard,
+			  const struct lu_fid *fid, unsigned long long hash,
+			  __s64 epoch)
+{
+	int rc;
+	struct lcrp_index_header *header = shard->lis_header;
+	struct lcrp_index_entry *entry;
+
+	entry = lcrp_index_probe(shard->lis_entries, header->lih_capacity,
+				 fid, hash);
+	if (!fid_is_zero(&entry->lie_fid))
+		return entry;
+
+	/* Keep the load factor under 3/4 if not grown in time */
+	if ((header->lih_count + 1) * 4 > header->lih_capacity * 3) {
+		rc = lcrp_index_shard_rebuild(index, shard - index->li_shards,
+					      header->lih_capacity * 2);
+		if (rc) {
+			LERROR("failed to grow shard of [%s]\n",
+			       index->li_dir);
+			return NULL;
+		}
+		header = shard->lis_header;
+		entry = lcrp_index_probe(shard->lis_entries,
+					 header->lih_capacity, fid, hash);
+	}
+
+	entry->lie_fid = *fid;
+	entry->lie_epoch = epoch;
+	entry->lie_heat_time = 0;
+	entry->lie_heat = 0;
+	__atomic_store_n(&entry->lie_check, lcrp_index_checksum(entry),
+			 __ATOMIC_RELEASE);
+	header->lih_count++;
+	shard->lis_dirty = true;
+	return entry;
+}
+
+/*
+ * Record that the FID has been accessed in the epoch starting at the given
+ * time. An older epoch never overwrites a newer one.
+ */
+int lcrp_index_update(struct lcrp_index *index, const struct lu_fid *fid,
+		      __s64 epoch)
+{
+	int rc = 0;
+	unsigned long long hash = lcrp_fid_hash(fid);
+	struct lcrp_index_shard *shard = lcrp_index_shard(index, hash);
+	struct lcrp_index_entry *entry;
+
+	LASSERT(!index->li_readonly);
+	pthread_mutex_lock(&shard->lis_mutex);
+	entry = lcrp_index_find_or_insert(index, shard, fid, hash, epoch);
+	if (entry == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	if (entry->lie_epoch >= epoch)
+		goto out;
+	entry->lie_epoch = epoch;
+	__atomic_store_n(&entry->lie_check, lcrp_index_checksum(entry),
+			 __ATOMIC_RELEASE);
+	shard->lis_dirty = true;
+out:
+	pthread_mutex_unlock(&shard->lis_mutex);
+	return rc;
+}
+
+static double lcrp_index_decay(unsigned int half_life, __s64 seconds)
+{
+	return exp2(-(double)seconds / half_life);
+}
+
+/*
+ * Add one access at the given time to the heat of the FID. Records of
+ * different MDTs could come out of order, so an access older than the
+ * heat is added with its decay instead of decaying the heat backward.
+ */
+int lcrp_index_heat(struct lcrp_index *index, const struct lu_fid *fid,
+		    __s64 epoch, __s64 time)
+{
+	int rc = 0;
+	unsigned int half_life = index->li_half_life;
+	unsigned long long hash = lcrp_fid_hash(fid);
+	struct lcrp_index_shard *shard = lcrp_index_shard(index, hash);
+	struct lcrp_index_entry *entry;
+
+	LASSERT(!index->li_readonly);
+	if (half_life == 0)
+		return 0;
+
+	pthread_mutex_lock(&shard->lis_mutex);
+	entry = lcrp_index_find_or_insert(index, shard, fid, hash, epoch);
+	if (entry == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	if (time >= entry->lie_heat_time) {
+		entry->lie_heat = entry->lie_heat *
+			lcrp_index_decay(half_life,
+					 time - entry->lie_heat_time) + 1;
+		entry->lie_heat_time = time;
+	} else {
+		entry->lie_heat += lcrp_index_decay(half_life,
+						    entry->lie_heat_time -
+						    time);
+	}
+	__atomic_store_n(&entry->lie_check, lcrp_index_checksum(entry),
+			 __ATOMIC_RELEASE);
+	shard->lis_dirty = true;
+out:
+	pthread_mutex_unlock(&shard->lis_mutex);
+	return rc;
+}
+
+/*
+ * Heat of an entry decayed to the given time
+ */
+double lcrp_index_heat_get(struct lcrp_index *index,
+			   const struct lcrp_index_entry *entry, __s64 now)
+{
+	if (index->li_half_life == 0 || now <= entry->lie_heat_time)
+		return entry->lie_heat;
+	return entry->lie_heat *
+		lcrp_index_decay(index->li_half_life,
+				 now - entry->lie_heat_time);
+}
+
+/*
+ * Set the half-life of heat, saved in the shards for queries
+ */
+void lcrp_index_set_half_life(struct lcrp_index *index,
+			      unsigned int half_life)
+{
+	int i;
+
+	index->li_half_life = half_life;
+	for (i = 0; i < LCRP_INDEX_SHARDS; i++)
+		index->li_shards[i].lis_header->lih_half_life = half_life;
+}
+
+/*
+ * Return -ENOENT if the FID has never been accessed. A read-only index
+ * could be updated by lcrpd at the same time, so an entry is copied and
+ * then verified by its checksum.
+ */
+int lcrp_index_lookup(struct lcrp_index *index, const struct lu_fid *fid,
+		      struct lcrp_index_entry *entry)
+{
+	int rc = -ENOENT;
+	int retry;
+	__u64 i;
+	__u64 capacity;
+	unsigned long long hash = lcrp_fid_hash(fid);
+	struct lcrp_index_shard *shard = lcrp_index_shard(index, hash);
+	struct lcrp_index_entry *slot;
+
+	if (!index->li_readonly)
+		pthread_mutex_lock(&shard->lis_mutex);
+	capacity = shard->lis_header->lih_capacity;
+	for (i = 0; i < capacity; i++) {
+		slot = &shard->lis_entries[(hash + i) & (capacity - 1)];
+		for (retry = 0; retry < 3; retry++) {
+			__atomic_load(&slot->lie_check, &entry->lie_check,
+				      __ATOMIC_ACQUIRE);
+			entry->lie_fid = slot->lie_fid;
+			entry->lie_epoch = slot->lie_epoch;
+			entry->lie_heat_time = slot->lie_heat_time;
+			entry->lie_heat = slot->lie_heat;
+			if (fid_is_zero(&entry->lie_fid) ||
+			    !lcrp_fid_equal(&entry->lie_fid, fid) ||
+			    lcrp_index_entry_valid(entry))
+				break;
+		}
+		if (fid_is_zero(&entry->lie_fid))
+			break;
+		if (!lcrp_fid_equal(&entry->lie_fid, fid))
+			continue;
+		rc = lcrp_index_entry_valid(entry) ? 0 : -EAGAIN;
+		break;
+	}
+	if (!index->li_readonly)
+		pthread_mutex_unlock(&shard->lis_mutex);
+	return rc;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_INDEX_H_
+#define _LCRP_INDEX_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <linux/limits.h>
+#include <lustre/lustreapi.h>
+
+/* Number of bits of FID hash to select the shard */
+#define LCRP_INDEX_SHARD_BITS 6
+/* Number of shards of the index, each shard is a file */
+#define LCRP_INDEX_SHARDS (1 << LCRP_INDEX_SHARD_BITS)
+/* Number of entries of a new shard, power of 2 */
+#define LCRP_INDEX_INITIAL_CAPACITY 4096
+/* Size of the header of a shard file, entries start after it */
+#define LCRP_INDEX_HEADER_SIZE 4096
+/* "LCRI" */
+#define LCRP_INDEX_MAGIC 0x4952434C
+/* Version 2 added heat to the entries */
+#define LCRP_INDEX_VERSION 2
+/*
+ * Seconds between two syncs of the index to disk. The index is also synced
+ * before records are cleared from Changelog.
+ */
+#define LCRP_INDEX_SYNC_INTERVAL 60
+
+/*
+ * Last access and heat of a FID. Zero FID marks an empty entry. lie_check
+ * is written last, so an entry torn by a crash is detected and dropped.
+ *
+ * Heat is increased by one for each access and halves every half-life
+ * since then. It is decayed only when updated or read, so lie_heat is
+ * the heat at lie_heat_time.
+ */
+struct lcrp_index_entry {
+	/* FID of the file */
+	struct lu_fid		lie_fid;
+	/* Start time of the last epoch that the FID was accessed in */
+	__s32			lie_epoch;
+	/* Time in seconds when lie_heat was calculated */
+	__u32			lie_heat_time;
+	/* Heat at lie_heat_time */
+	float			lie_heat;
+	/* Checksum of the other fields */
+	__u32			lie_check;
+};
+
+struct lcrp_index_header {
+	/* LCRP_INDEX_MAGIC */
+	__u32			lih_magic;
+	/* LCRP_INDEX_VERSION */
+	__u32			lih_version;
+	/* Index of this shard */
+	__u32			lih_shard;
+	/* Non-zero if the shard was closed cleanly */
+	__u32			lih_clean;
+	/* Number of entries, power of 2 */
+	__u64			lih_capacity;
+	/* Number of used entries */
+	__u64			lih_count;
+	/* Half-life of heat in seconds, 0 if heat is not tracked */
+	__u32			lih_half_life;
+};
+
+struct lcrp_index_shard {
+	/* Protects the shard against updates and rebuilds */
+	pthread_mutex_t			 lis_mutex;
+	/* Fd of the shard file, -1 if not open */
+	int				 lis_fd;
+	/* Mapping of the shard file */
+	struct lcrp_index_header	*lis_header;
+	/* Entries after the header */
+	struct lcrp_index_entry		*lis_entries;
+	/* Size of the mapping */
+	size_t				 lis_size;
+	/* Updated since the last sync */
+	bool				 lis_dirty;
+};
+
+/*
+ * Persistent index from FID to the epoch it was last accessed. Shards are
+ * open addressing hash tables in files mapped into memory and updated in
+ * place. A shard is grown or recovered by writing a new file and renaming
+ * it over the old one.
+ */
+struct lcrp_index {
+	/* Directory of the shard files */
+	char			li_dir[PATH_MAX + 1];
+	/* Opened for queries only, no lock is used */
+	bool			li_readonly;
+	/* Half-life of heat in seconds, 0 if heat is not tracked */
+	unsigned int		li_half_life;
+	/* Shards, selected by the high bits of FID hash */
+	struct lcrp_index_shard	li_shards[LCRP_INDEX_SHARDS];
+};
+
+int lcrp_index_open(struct lcrp_index *index, const char *dir, bool readonly);
+void lcrp_index_close(struct lcrp_index *index);
+int lcrp_index_sync(struct lcrp_index *index);
+int lcrp_index_grow(struct lcrp_index *index);
+int lcrp_index_update(struct lcrp_index *index, const struct lu_fid *fid,
+		      __s64 epoch);
+int lcrp_index_heat(struct lcrp_index *index, const struct lu_fid *fid,
+		    __s64 epoch, __s64 time);
+void lcrp_index_set_half_life(struct lcrp_index *index,
+			      unsigned int half_life);
+double lcrp_index_heat_get(struct lcrp_index *index,
+			   const struct lcrp_index_entry *entry, __s64 now);
+bool lcrp_index_entry_valid(const struct lcrp_index_entry *entry);
+int lcrp_index_lookup(struct lcrp_index *index, const struct lu_fid *fid,
+		      struct lcrp_index_entry *entry);
+#endif /* _LCRP_INDEX_H_ */
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Batches of operations on the access history directory.
+ *
+ * If lcrpd is built with io_uring and the kernel supports all of the
+ * operations, a batch is submitted to io_uring by raw syscalls, and the
+ * chained operations are linked SQEs that run in order. Otherwise, the
+ * operations are done by synchronous syscalls one by one.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "lcrp_changelog.h"
+#include "lcrp_io.h"
+
+#ifdef LCRP_HAVE_IO_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+struct lcrp_io_ring {
+	/* Fd of io_uring */
+	int			 lir_fd;
+	/* Mapping of the submission queue ring */
+	void			*lir_sq_ring;
+	size_t			 lir_sq_ring_size;
+	/* Mapping of the completion queue ring */
+	void			*lir_cq_ring;
+	size_t			 lir_cq_ring_size;
+	/* Mapping of the SQE array */
+	struct io_uring_sqe	*lir_sqes;
+	size_t			 lir_sqes_size;
+	/* Fields of the submission queue ring */
+	unsigned int		*lir_sq_tail;
+	unsigned int		*lir_sq_mask;
+	unsigned int		*lir_sq_array;
+	/* Fields of the completion queue ring */
+	unsigned int		*lir_cq_head;
+	unsigned int		*lir_cq_tail;
+	unsigned int		*lir_cq_mask;
+	struct io_uring_cqe	*lir_cqes;
+	/* Buffers of LCRP_IO_STAT, one for each operation */
+	struct statx		 lir_statx[LCRP_IO_DEPTH];
+};
+
+/* Operations that lcrpd submits to io_uring */
+static const int lcrp_io_uring_opcodes[] = {
+	[LCRP_IO_STAT] = IORING_OP_STATX,
+	[LCRP_IO_MKDIR] = IORING_OP_MKDIRAT,
+	[LCRP_IO_CREATE] = IORING_OP_OPENAT,
+	[LCRP_IO_LINK] = IORING_OP_LINKAT,
+	[LCRP_IO_UNLINK] = IORING_OP_UNLINKAT,
+};
+
+static void lcrp_io_ring_free(struct lcrp_io_ring *ring)
+{
+	if (ring->lir_sqes != NULL)
+		munmap(ring->lir_sqes, ring->lir_sqes_size);
+	if (ring->lir_cq_ring != NULL)
+		munmap(ring->lir_cq_ring, ring->lir_cq_ring_size);
+	if (ring->lir_sq_ring != NULL)
+		munmap(ring->lir_sq_ring, ring->lir_sq_ring_size);
+	if (ring->lir_fd >= 0)
+		close(ring->lir_fd);
+	free(ring);
+}
+
+static void *lcrp_io_ring_mmap(int fd, size_t size, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, offset);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	return ptr;
+}
+
+/*
+ * Return 0 if the kernel supports all of the operations of lcrpd. Kernels
+ * older than 5.15 have io_uring but no mkdirat, linkat or unlinkat.
+ */
+static int lcrp_io_ring_probe(struct lcrp_io_ring *ring)
+{
+	int i;
+	int rc;
+	int opcode;
+	struct io_uring_probe *probe;
+
+	probe = calloc(1, sizeof(*probe) +
+		       256 * sizeof(struct io_uring_probe_op));
+	if (probe == NULL)
+		return -ENOMEM;
+
+	rc = syscall(__NR_io_uring_register, ring->lir_fd,
+		     IORING_REGISTER_PROBE, probe, 256);
+	if (rc < 0) {
+		rc = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < sizeof(lcrp_io_uring_opcodes) /
+	     sizeof(lcrp_io_uring_opcodes[0]); i++) {
+		opcode = lcrp_io_uring_opcodes[i];
+		if (opcode > probe->last_op ||
+		    !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+			rc = -EOPNOTSUPP;
+			break;
+		}
+	}
+out:
+	free(probe);
+	return rc;
+}
+
+static int lcrp_io_ring_alloc(struct lcrp_io_ring **pring)
+{
+	int rc;
+	struct io_uring_params params;
+	struct lcrp_io_ring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return -ENOMEM;
+
+	memset(&params, 0, sizeof(params));
+	ring->lir_fd = syscall(__NR_io_uring_setup, LCRP_IO_DEPTH, &params);
+	if (ring->lir_fd < 0) {
+		rc = -errno;
+		goto out_free;
+	}
+
+	rc = lcrp_io_ring_probe(ring);
+	if (rc)
+		goto out_free;
+
+	ring->lir_sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ring->lir_sq_ring = lcrp_io_ring_mmap(ring->lir_fd,
+					      ring->lir_sq_ring_size,
+					      IORING_OFF_SQ_RING);
+	ring->lir_cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->lir_cq_ring = lcrp_io_ring_mmap(ring->lir_fd,
+					      ring->lir_cq_ring_size,
+					      IORING_OFF_CQ_RING);
+	ring->lir_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->lir_sqes = lcrp_io_ring_mmap(ring->lir_fd, ring->lir_sqes_size,
+					   IORING_OFF_SQES);
+	if (ring->lir_sq_ring == NULL || ring->lir_cq_ring == NULL ||
+	    ring->lir_sqes == NULL) {
+		rc = -errno;
+		goto out_free;
+	}
+
+	ring->lir_sq_tail = (void *)((char *)ring->lir_sq_ring +
+				     params.sq_off.tail);
+	ring->lir_sq_mask = (void *)((char *)ring->lir_sq_ring +
+				     params.sq_off.ring_mask);
+	ring->lir_sq_array = (void *)((char *)ring->lir_sq_ring +
+				      params.sq_off.array);
+	ring->lir_cq_head = (void *)((char *)ring->lir_cq_ring +
+				     params.cq_off.head);
+	ring->lir_cq_tail = (void *)((char *)ring->lir_cq_ring +
+				     params.cq_off.tail);
+	ring->lir_cq_mask = (void *)((char *)ring->lir_cq_ring +
+				     params.cq_off.ring_mask);
+	ring->lir_cqes = (void *)((char *)ring->lir_cq_ring +
+				  params.cq_off.cqes);
+	*pring = ring;
+	return 0;
+out_free:
+	lcrp_io_ring_free(ring);
+	return rc;
+}
+
+static void lcrp_io_ring_prep(struct lcrp_io_ring *ring,
+			      struct lcrp_io_op *op, int index)
+{
+	unsigned int tail = *ring->lir_sq_tail + index;
+	unsigned int slot = tail & *ring->lir_sq_mask;
+	struct io_uring_sqe *sqe = &ring->lir_sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = lcrp_io_uring_opcodes[op->lio_opcode];
+	sqe->fd = op->lio_dirfd;
+	sqe->addr = (uintptr_t)op->lio_path;
+	sqe->user_data = index;
+	if (op->lio_chain)
+		sqe->flags |= IOSQE_IO_HARDLINK;
+
+	switch (op->lio_opcode) {
+	case LCRP_IO_STAT:
+		sqe->len = STATX_TYPE;
+		sqe->off = (uintptr_t)&ring->lir_statx[index];
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		break;
+	case LCRP_IO_MKDIR:
+		sqe->len = 0755;
+		break;
+	case LCRP_IO_CREATE:
+		sqe->len = 0644;
+		sqe->open_flags = O_RDONLY | O_CREAT | O_CLOEXEC;
+		break;
+	case LCRP_IO_LINK:
+		sqe->len = op->lio_dirfd2;
+		sqe->addr2 = (uintptr_t)op->lio_path2;
+		break;
+	case LCRP_IO_UNLINK:
+		sqe->unlink_flags = op->lio_flags;
+		break;
+	}
+	ring->lir_sq_array[slot] = slot;
+}
+
+/*
+ * Take the results of the completed operations, return the number of them
+ */
+static int lcrp_io_ring_reap(struct lcrp_io *io)
+{
+	int i;
+	int done = 0;
+	unsigned int head;
+	unsigned int tail;
+	struct io_uring_cqe *cqe;
+	struct lcrp_io_op *op;
+	struct lcrp_io_ring *ring = io->lio_ring;
+
+	head = *ring->lir_cq_head;
+	tail = __atomic_load_n(ring->lir_cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ring->lir_cqes[head & *ring->lir_cq_mask];
+		i = cqe->user_data;
+		op = &io->lio_ops[i];
+		op->lio_result = cqe->res;
+		if (op->lio_opcode == LCRP_IO_STAT && cqe->res == 0)
+			op->lio_mode = ring->lir_statx[i].stx_mode & S_IFMT;
+		/* Only the file is wanted, not the open fd */
+		if (op->lio_opcode == LCRP_IO_CREATE && cqe->res >= 0) {
+			close(cqe->res);
+			op->lio_result = 0;
+		}
+		done++;
+	}
+	__atomic_store_n(ring->lir_cq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+
+/*
+ * Clean up the ring after io_uring_enter() failed, so that no completion
+ * of the failed batch is taken by the next one. The SQEs that the kernel
+ * has not consumed are taken back, and the submitted operations are
+ * waited for. If waiting fails too, the ring is replaced, or dropped for
+ * synchronous syscalls if a new one could not be allocated.
+ */
+static void lcrp_io_ring_recover(struct lcrp_io *io, int submit, int done)
+{
+	int rc;
+	int inflight = io->lio_count - submit - done;
+	struct lcrp_io_ring *ring = io->lio_ring;
+
+	__atomic_store_n(ring->lir_sq_tail, *ring->lir_sq_tail - submit,
+			 __ATOMIC_RELEASE);
+	while (inflight > 0) {
+		lcrp_syscall_count++;
+		rc = syscall(__NR_io_uring_enter, ring->lir_fd, 0, inflight,
+			     IORING_ENTER_GETEVENTS, NULL, 0);
+		if (rc < 0 && errno != EINTR) {
+			LERROR("failed to wait for [%d] operations of io_uring: %s, replacing it\n",
+			       inflight, strerror(errno));
+			/* Fds of the unreaped CREATE operations are lost */
+			lcrp_io_ring_free(ring);
+			io->lio_ring = NULL;
+			lcrp_io_ring_alloc(&io->lio_ring);
+			return;
+		}
+		inflight -= lcrp_io_ring_reap(io);
+	}
+}
+
+/*
+ * Submit all of the operations by one io_uring_enter() and wait for them
+ */
+static int lcrp_io_ring_submit(struct lcrp_io *io)
+{
+	int i;
+	int rc;
+	int done = 0;
+	int submit = io->lio_count;
+	struct lcrp_io_ring *ring = io->lio_ring;
+
+	for (i = 0; i < io->lio_count; i++)
+		lcrp_io_ring_prep(ring, &io->lio_ops[i], i);
+	__atomic_store_n(ring->lir_sq_tail, *ring->lir_sq_tail + io->lio_count,
+			 __ATOMIC_RELEASE);
+
+	while (done < io->lio_count) {
+		lcrp_syscall_count++;
+		rc = syscall(__NR_io_uring_enter, ring->lir_fd, submit,
+			     io->lio_count - done, IORING_ENTER_GETEVENTS,
+			     NULL, 0);
+		if (rc < 0 && errno != EINTR) {
+			rc = -errno;
+			LERROR("failed to submit [%d] operations to io_uring: %s\n",
+			       submit, strerror(-rc));
+			lcrp_io_ring_recover(io, submit, done);
+			return rc;
+		}
+		if (rc > 0)
+			submit -= rc;
+		done += lcrp_io_ring_reap(io);
+	}
+	return 0;
+}
+#else /* !LCRP_HAVE_IO_URING */
+static void lcrp_io_ring_free(struct lcrp_io_ring *ring)
+{
+}
+
+static int lcrp_io_ring_alloc(struct lcrp_io_ring **pring)
+{
+	return -EOPNOTSUPP;
+}
+
+static int lcrp_io_ring_submit(struct lcrp_io *io)
+{
+	return -EOPNOTSUPP;
+}
+#endif /* LCRP_HAVE_IO_URING */
+
+/*
+ * Use io_uring if uring is true and it is supported, fall back to
+ * synchronous syscalls otherwise
+ */
+int lcrp_io_init(struct lcrp_io *io, bool uring)
+{
+	int rc;
+	static bool warned;
+
+	memset(io, 0, sizeof(*io));
+	if (!uring)
+		return 0;
+
+	rc = lcrp_io_ring_alloc(&io->lio_ring);
+	if (rc == -ENOMEM) {
+		LERROR("failed to allocate io_uring\n");
+		return rc;
+	}
+	/* Every thread would complain about the same thing */
+	if (rc && !__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+		LWARN("io_uring is not usable: %s, falling back to synchronous syscalls\n",
+		      strerror(-rc));
+	return 0;
+}
+
+void lcrp_io_fini(struct lcrp_io *io)
+{
+	if (io->lio_ring != NULL)
+		lcrp_io_ring_free(io->lio_ring);
+	io->lio_ring = NULL;
+}
+
+void lcrp_io_reset(struct lcrp_io *io)
+{
+	io->lio_count = 0;
+}
+
+/*
+ * Queue an operation, the caller fills in the other fields if needed
+ */
+struct lcrp_io_op *lcrp_io_queue(struct lcrp_io *io,
+				 enum lcrp_io_opcode opcode, int dirfd,
+				 const char *path)
+{
+	struct lcrp_io_op *op;
+
+	LASSERT(io->lio_count < LCRP_IO_DEPTH);
+	op = &io->lio_ops[io->lio_count++];
+	memset(op, 0, sizeof(*op));
+	op->lio_opcode = opcode;
+	op->lio_dirfd = dirfd;
+	snprintf(op->lio_path, sizeof(op->lio_path), "%s", path);
+	return op;
+}
+
+static int lcrp_io_sync_one(struct lcrp_io_op *op)
+{
+	int rc;
+	struct stat stat_buf;
+
+	lcrp_syscall_count++;
+	switch (op->lio_opcode) {
+	case LCRP_IO_STAT:
+		rc = fstatat(op->lio_dirfd, op->lio_path, &stat_buf,
+			     AT_SYMLINK_NOFOLLOW);
+		if (rc == 0)
+			op->lio_mode = stat_buf.st_mode & S_IFMT;
+		break;
+	case LCRP_IO_MKDIR:
+		rc = mkdirat(op->lio_dirfd, op->lio_path, 0755);
+		break;
+	case LCRP_IO_CREATE:
+		rc = mknodat(op->lio_dirfd, op->lio_path, S_IFREG | 0644, 0);
+		if (rc && errno == EEXIST)
+			rc = 0;
+		break;
+	case LCRP_IO_LINK:
+		rc = linkat(op->lio_dirfd, op->lio_path, op->lio_dirfd2,
+			    op->lio_path2, 0);
+		break;
+	case LCRP_IO_UNLINK:
+		rc = unlinkat(op->lio_dirfd, op->lio_path, op->lio_flags);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return rc ? -errno : 0;
+}
+
+/*
+ * Do all of the queued operations. Return 0 if they have been done, in
+ * which case the result of each one is in lio_result.
+ */
+int lcrp_io_submit(struct lcrp_io *io)
+{
+	int i;
+	struct lcrp_io_op *op;
+
+	if (io->lio_count == 0)
+		return 0;
+	if (io->lio_ring != NULL)
+		return lcrp_io_ring_submit(io);
+
+	/* In order, so chained operations are done one after another */
+	for (i = 0; i < io->lio_count; i++) {
+		op = &io->lio_ops[i];
+		op->lio_result = lcrp_io_sync_one(op);
+	}
+	return 0;
+}
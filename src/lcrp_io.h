@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_IO_H_
+#define _LCRP_IO_H_
+
+#include <stdbool.h>
+
+/* Maximum number of operations of a batch, also the entries of io_uring */
+#define LCRP_IO_DEPTH 256
+/* Buffer size of the path of an operation, e.g. "$BUCKET/$FID" */
+#define LCRP_IO_PATHLEN 80
+
+enum lcrp_io_opcode {
+	/* Get the file type of lio_path into lio_mode */
+	LCRP_IO_STAT = 0,
+	/* Create directory lio_path */
+	LCRP_IO_MKDIR,
+	/* Create regular file lio_path unless it exists */
+	LCRP_IO_CREATE,
+	/* Link lio_path to lio_path2 under lio_dirfd2 */
+	LCRP_IO_LINK,
+	/* Remove lio_path, lio_flags could be AT_REMOVEDIR */
+	LCRP_IO_UNLINK,
+};
+
+struct lcrp_io_op {
+	/* What to do */
+	enum lcrp_io_opcode	lio_opcode;
+	/*
+	 * Start the next operation after this one completes, whatever its
+	 * result. io_uring does not break a chain on the failure of some
+	 * operations, e.g. link, so the caller checks every result.
+	 */
+	bool			lio_chain;
+	/* Directory fd that lio_path is relative to */
+	int			lio_dirfd;
+	/* Path of the file */
+	char			lio_path[LCRP_IO_PATHLEN];
+	/* Directory fd that lio_path2 is relative to, LCRP_IO_LINK only */
+	int			lio_dirfd2;
+	/* Path of the new link, LCRP_IO_LINK only */
+	char			lio_path2[LCRP_IO_PATHLEN];
+	/* Flags of the syscall */
+	int			lio_flags;
+	/* 0 or negative errno */
+	int			lio_result;
+	/* File type, S_IFMT bits of st_mode, LCRP_IO_STAT only */
+	unsigned int		lio_mode;
+};
+
+struct lcrp_io_ring;
+
+/*
+ * Batch of operations on the access history directory. With io_uring, a
+ * batch is submitted by one syscall and the operations are in flight
+ * together, which hides the latency of each one on network filesystems.
+ * Otherwise, the operations are done by one syscall each, in order.
+ * Either way, a batch is finished when lcrp_io_submit() returns.
+ */
+struct lcrp_io {
+	/* io_uring of this batch, NULL for synchronous syscalls */
+	struct lcrp_io_ring	*lio_ring;
+	/* Number of queued operations */
+	int			 lio_count;
+	/* Queued operations */
+	struct lcrp_io_op	 lio_ops[LCRP_IO_DEPTH];
+};
+
+int lcrp_io_init(struct lcrp_io *io, bool uring);
+void lcrp_io_fini(struct lcrp_io *io);
+struct lcrp_io_op *lcrp_io_queue(struct lcrp_io *io,
+				 enum lcrp_io_opcode opcode, int dirfd,
+				 const char *path);
+int lcrp_io_submit(struct lcrp_io *io);
+void lcrp_io_reset(struct lcrp_io *io);
+
+/* Number of operations that can still be queued */
+static inline int lcrp_io_space(struct lcrp_io *io)
+{
+	return LCRP_IO_DEPTH - io->lio_count;
+}
+#endif /* _LCRP_IO_H_ */
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Library to query the access history saved by lcrpd.
+ *
+ * Queries read the index of FID last access that lcrpd keeps under
+ * fid_index, so they cost a scan of a few dozen bytes per FID rather than
+ * a readdir over the hardlinks of every tier. The tier of a FID is
+ * derived from the epoch it was last accessed in, the current epoch under
+ * the active directory, and the tiers saved by lcrpd.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcrp_query.h"
+
+/* Same as the names of directories under lcrp_dir used by lcrpd */
+#define LCRP_QUERY_NAME_ACTIVE "active"
+#define LCRP_QUERY_NAME_FID_INDEX "fid_index"
+#define LCRP_QUERY_NAME_INACTIVE "inactive"
+
+/*
+ * Only lcrp_query_* are exported by the library, so its debug_level can
+ * not be set directly by applications.
+ */
+void lcrp_query_set_log_level(int level)
+{
+	debug_level = level;
+}
+
+/*
+ * Number of tiers including inactive, i.e. the number of valid entries of
+ * the counts of lcrp_query_count()
+ */
+int lcrp_query_tier_count(struct lcrp_query *query)
+{
+	return query->lq_tiers.lts_count + 1;
+}
+
+const char *lcrp_query_tier_name(struct lcrp_query *query, int tier)
+{
+	if (tier == query->lq_tiers.lts_count)
+		return LCRP_QUERY_NAME_INACTIVE;
+	if (tier < 0 || tier > query->lq_tiers.lts_count)
+		return "unknown";
+	return query->lq_tiers.lts_tiers[tier].lt_name;
+}
+
+/*
+ * Find the current epoch from the directories under active. The directory
+ * of the next epoch could have been prepared, and the previous one could
+ * be waiting to be merged into the next tier, so the current epoch is the
+ * latest one that has started. Fall back to the earliest one if none has
+ * started, e.g. the epochs of lcrp_bench are in the future.
+ */
+static int lcrp_query_epoch_init(struct lcrp_query *query,
+				 const char *lcrp_dir)
+{
+	int start;
+	int end;
+	DIR *dir;
+	bool found = false;
+	bool started = false;
+	time_t now = time(NULL);
+	struct dirent *dirent;
+	char path[PATH_MAX + 1];
+
+	snprintf(path, sizeof(path), "%s/%s", lcrp_dir,
+		 LCRP_QUERY_NAME_ACTIVE);
+	dir = opendir(path);
+	if (dir == NULL) {
+		LERROR("failed to open directory [%s]: %s\n", path,
+		       strerror(errno));
+		return -errno;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		if (sscanf(dirent->d_name, "%d-%d", &start, &end) != 2 ||
+		    end <= start)
+			continue;
+		if (found) {
+			if (start > now && (started ||
+					    start > query->lq_active_start))
+				continue;
+			if (start <= now && started &&
+			    start < query->lq_active_start)
+				continue;
+		}
+		query->lq_active_start = start;
+		query->lq_interval = end - start;
+		started = start <= now;
+		found = true;
+	}
+	closedir(dir);
+
+	if (!found) {
+		LERROR("no epoch under directory [%s]\n", path);
+		return -ENOENT;
+	}
+	return 0;
+}
+
+int lcrp_query_open(struct lcrp_query *query, const char *lcrp_dir)
+{
+	int rc;
+	char path[PATH_MAX + 1];
+
+	memset(query, 0, sizeof(*query));
+	rc = lcrp_query_epoch_init(query, lcrp_dir);
+	if (rc)
+		return rc;
+
+	/* Saved by lcrpd since tiers are configurable */
+	snprintf(path, sizeof(path), "%s/%s", lcrp_dir, LCRP_NAME_TIERS);
+	rc = lcrp_tiers_load(&query->lq_tiers, path);
+	if (rc == -ENOENT)
+		lcrp_tiers_default(&query->lq_tiers, query->lq_interval);
+	else if (rc)
+		return rc;
+	query->lq_interval = query->lq_tiers.lts_tiers[0].lt_seconds;
+
+	snprintf(path, sizeof(path), "%s/%s", lcrp_dir,
+		 LCRP_QUERY_NAME_FID_INDEX);
+	rc = lcrp_index_open(&query->lq_index, path, true);
+	if (rc) {
+		LERROR("failed to open index [%s]\n", path);
+		return rc;
+	}
+	return 0;
+}
+
+void lcrp_query_close(struct lcrp_query *query)
+{
+	lcrp_index_close(&query->lq_index);
+}
+
+/*
+ * Follow the epoch through the tiers the same way as lcrpd degrades its
+ * directory, which is merged into a coarser directory in each tier
+ */
+int lcrp_query_tier(struct lcrp_query *query, __s64 epoch)
+{
+	int tier = 0;
+	int next;
+	int start = epoch;
+	int end = epoch + query->lq_interval;
+	struct lcrp_tiers *tiers = &query->lq_tiers;
+
+	while ((next = lcrp_tier_locate(tiers, query->lq_active_start, tier,
+					end)) != tier) {
+		tier = next;
+		if (tier == tiers->lts_count)
+			break;
+		start = lcrp_tier_bucket(tiers, tier, start);
+		end = start + tiers->lts_tiers[tier].lt_seconds;
+	}
+	return tier;
+}
+
+/*
+ * Return -ENOENT if the FID has never been accessed since the index was
+ * created. Heat is decayed to the current time.
+ */
+int lcrp_query_lookup(struct lcrp_query *query, const struct lu_fid *fid,
+		      int *tier, __s64 *epoch, double *heat)
+{
+	int rc;
+	struct lcrp_index_entry entry;
+
+	rc = lcrp_index_lookup(&query->lq_index, fid, &entry);
+	if (rc)
+		return rc;
+
+	*epoch = entry.lie_epoch;
+	*tier = lcrp_query_tier(query, entry.lie_epoch);
+	*heat = lcrp_index_heat_get(&query->lq_index, &entry, time(NULL));
+	return 0;
+}
+
+/*
+ * Copy the next batch of FIDs that have not been accessed since the given
+ * time into entries, i.e. their last epoch ended before it. Return the
+ * number of copied entries, 0 if the scan is finished.
+ */
+int lcrp_query_cold(struct lcrp_query *query,
+		    struct lcrp_query_cursor *cursor, time_t before,
+		    struct lcrp_index_entry *entries, int count)
+{
+	int copied = 0;
+	struct lcrp_index_shard *shard;
+	struct lcrp_index_entry *entry;
+
+	for (; cursor->lqc_shard < LCRP_INDEX_SHARDS; cursor->lqc_shard++,
+	     cursor->lqc_position = 0) {
+		shard = &query->lq_index.li_shards[cursor->lqc_shard];
+		for (; cursor->lqc_position < shard->lis_header->lih_capacity;
+		     cursor->lqc_position++) {
+			if (copied == count)
+				return copied;
+			entry = &shard->lis_entries[cursor->lqc_position];
+			if (fid_is_zero(&entry->lie_fid) ||
+			    entry->lie_epoch + query->lq_interval > before)
+				continue;
+			entries[copied] = *entry;
+			/* Skip the entry being updated by lcrpd */
+			if (lcrp_index_entry_valid(&entries[copied]))
+				copied++;
+		}
+	}
+	return copied;
+}
+
+int lcrp_query_count(struct lcrp_query *query,
+		     unsigned long long counts[LCRP_QUERY_TIERS])
+{
+	int i;
+	__u64 j;
+	struct lcrp_index_shard *shard;
+	struct lcrp_index_entry *entry;
+
+	memset(counts, 0, sizeof(*counts) * LCRP_QUERY_TIERS);
+	for (i = 0; i < LCRP_INDEX_SHARDS; i++) {
+		shard = &query->lq_index.li_shards[i];
+		for (j = 0; j < shard->lis_header->lih_capacity; j++) {
+			entry = &shard->lis_entries[j];
+			if (fid_is_zero(&entry->lie_fid))
+				continue;
+			counts[lcrp_query_tier(query, entry->lie_epoch)]++;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Library to query the access history saved by lcrpd, without walking
+ * the directory tree.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_QUERY_H_
+#define _LCRP_QUERY_H_
+
+#include <time.h>
+#include "lcrp_index.h"
+#include "lcrp_tier.h"
+
+/*
+ * Tiers are numbered from 0 for active, lts_count of lq_tiers is
+ * inactive
+ */
+#define LCRP_QUERY_TIERS (LCRP_MAX_TIERS + 1)
+
+/* Levels of the messages printed by the library, errors go to stderr */
+#define LCRP_QUERY_LOG_ERROR	0
+#define LCRP_QUERY_LOG_WARN	1
+#define LCRP_QUERY_LOG_INFO	2
+#define LCRP_QUERY_LOG_DEBUG	3
+
+struct lcrp_query {
+	/* Index of FID last access, opened read-only */
+	struct lcrp_index	lq_index;
+	/* Tiers configured by lcrpd */
+	struct lcrp_tiers	lq_tiers;
+	/* Start time of the current epoch */
+	__s64			lq_active_start;
+	/* Seconds of each epoch */
+	__s64			lq_interval;
+};
+
+/* Position of a scan over the index, zero it to start from the beginning */
+struct lcrp_query_cursor {
+	/* Shard being scanned */
+	int	lqc_shard;
+	/* Next entry to check in the shard */
+	__u64	lqc_position;
+};
+
+void lcrp_query_set_log_level(int level);
+int lcrp_query_open(struct lcrp_query *query, const char *lcrp_dir);
+void lcrp_query_close(struct lcrp_query *query);
+int lcrp_query_tier_count(struct lcrp_query *query);
+const char *lcrp_query_tier_name(struct lcrp_query *query, int tier);
+int lcrp_query_tier(struct lcrp_query *query, __s64 epoch);
+int lcrp_query_lookup(struct lcrp_query *query, const struct lu_fid *fid,
+		      int *tier, __s64 *epoch, double *heat);
+int lcrp_query_cold(struct lcrp_query *query,
+		    struct lcrp_query_cursor *cursor, time_t before,
+		    struct lcrp_index_entry *entries, int count);
+int lcrp_query_count(struct lcrp_query *query,
+		     unsigned long long counts[LCRP_QUERY_TIERS]);
+#endif /* _LCRP_QUERY_H_ */
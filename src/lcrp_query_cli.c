@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Command to query the access history saved by lcrpd.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcrp_query.h"
+
+/* Number of entries to get from the index in each batch */
+#define LCRP_QUERY_BATCH 1024
+
+static void lcrp_query_usage(void)
+{
+	LERROR("Usage: lcrp_query -d lcrp_dir <command>\n"
+	       "  lookup <FID>...: print the tier, last epoch and heat of FIDs\n"
+	       "  cold <time>: list FIDs not accessed since seconds since Epoch\n"
+	       "  count: print the number of FIDs in each tier\n");
+}
+
+static int lcrp_query_parse_fid(const char *string, struct lu_fid *fid)
+{
+	if (*string == '[')
+		string++;
+	if (sscanf(string, SFID, RFID(fid)) != 3 || fid_is_zero(fid)) {
+		LERROR("invalid FID [%s]\n", string);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int lcrp_query_cmd_lookup(struct lcrp_query *query, int argc,
+				 char *argv[])
+{
+	int i;
+	int rc = 0;
+	int ret;
+	__s64 epoch;
+	int tier;
+	double heat;
+	struct lu_fid fid;
+
+	for (i = 0; i < argc; i++) {
+		ret = lcrp_query_parse_fid(argv[i], &fid);
+		if (ret == 0)
+			ret = lcrp_query_lookup(query, &fid, &tier, &epoch,
+						&heat);
+		if (ret == -ENOENT) {
+			printf(DFID" none\n", PFID(&fid));
+			continue;
+		} else if (ret) {
+			LERROR("failed to lookup [%s]: %s\n", argv[i],
+			       strerror(-ret));
+			if (rc == 0)
+				rc = ret;
+			continue;
+		}
+		printf(DFID" %s %lld %.3f\n", PFID(&fid),
+		       lcrp_query_tier_name(query, tier), (long long)epoch,
+		       heat);
+	}
+	return rc;
+}
+
+static int lcrp_query_cmd_cold(struct lcrp_query *query, const char *value)
+{
+	int i;
+	int count;
+	char *end;
+	time_t before;
+	struct lcrp_query_cursor cursor;
+	struct lcrp_index_entry entries[LCRP_QUERY_BATCH];
+
+	before = strtoll(value, &end, 0);
+	if (*value == '\0' || *end != '\0') {
+		LERROR("invalid time [%s]\n", value);
+		return -EINVAL;
+	}
+
+	memset(&cursor, 0, sizeof(cursor));
+	while ((count = lcrp_query_cold(query, &cursor, before, entries,
+					LCRP_QUERY_BATCH)) > 0) {
+		for (i = 0; i < count; i++)
+			printf(DFID" %lld\n", PFID(&entries[i].lie_fid),
+			       (long long)entries[i].lie_epoch);
+	}
+	return count;
+}
+
+static int lcrp_query_cmd_count(struct lcrp_query *query)
+{
+	int rc;
+	int tier;
+	unsigned long long counts[LCRP_QUERY_TIERS];
+
+	rc = lcrp_query_count(query, counts);
+	if (rc)
+		return rc;
+
+	for (tier = 0; tier < lcrp_query_tier_count(query); tier++)
+		printf("%s %llu\n", lcrp_query_tier_name(query, tier),
+		       counts[tier]);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int rc;
+	const char *command;
+	const char *lcrp_dir = NULL;
+	struct lcrp_query query;
+
+	/* Only print errors, which go to stderr, stdout is for results */
+	debug_level = ERROR;
+	lcrp_query_set_log_level(LCRP_QUERY_LOG_ERROR);
+	while ((c = getopt(argc, argv, "d:h")) != -1) {
+		switch (c) {
+		case 'd':
+			lcrp_dir = optarg;
+			break;
+		default:
+			lcrp_query_usage();
+			return -EINVAL;
+		}
+	}
+	if (lcrp_dir == NULL || optind >= argc) {
+		lcrp_query_usage();
+		return -EINVAL;
+	}
+	command = argv[optind++];
+
+	rc = lcrp_query_open(&query, lcrp_dir);
+	if (rc) {
+		LERROR("failed to open access history [%s]\n", lcrp_dir);
+		return rc;
+	}
+
+	if (strcmp(command, "lookup") == 0 && optind < argc) {
+		rc = lcrp_query_cmd_lookup(&query, argc - optind,
+					   argv + optind);
+	} else if (strcmp(command, "cold") == 0 && optind + 1 == argc) {
+		rc = lcrp_query_cmd_cold(&query, argv[optind]);
+	} else if (strcmp(command, "count") == 0 && optind == argc) {
+		rc = lcrp_query_cmd_count(&query);
+	} else {
+		lcrp_query_usage();
+		rc = -EINVAL;
+	}
+
+	lcrp_query_close(&query);
+	return rc;
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Source of Changelog records. Records are read from Lustre through
+ * liblustreapi or the Changelog device, generated synthetically, or
+ * replayed from a trace file.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcrp_source.h"
+#include "lcrp_stats.h"
+
+static const struct lcrp_source_operations *lcrp_source_types[] = {
+	&lcrp_source_llapi_ops,
+	&lcrp_source_chardev_ops,
+	&lcrp_source_synthetic_ops,
+	&lcrp_source_replay_ops,
+};
+
+int lcrp_source_init(struct lcrp_source *source, const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lcrp_source_types); i++) {
+		if (strcmp(lcrp_source_types[i]->lsop_name, name) == 0) {
+			source->lsrc_ops = lcrp_source_types[i];
+			return 0;
+		}
+	}
+	LERROR("unknown Changelog source [%s]\n", name);
+	return -EINVAL;
+}
+
+static int lcrp_trace_open(struct lcrp_source *source)
+{
+	struct lcrp_trace_header header;
+
+	source->lsrc_trace = fopen(source->lsrc_trace_file, "ab");
+	if (source->lsrc_trace == NULL) {
+		LERROR("failed to open trace file [%s]: %s\n",
+		       source->lsrc_trace_file, strerror(errno));
+		return -errno;
+	}
+
+	if (ftell(source->lsrc_trace) > 0)
+		return 0;
+
+	header.lth_magic = LCRP_TRACE_MAGIC;
+	header.lth_version = LCRP_TRACE_VERSION;
+	if (fwrite(&header, sizeof(header), 1, source->lsrc_trace) != 1) {
+		LERROR("failed to write header of trace file [%s]\n",
+		       source->lsrc_trace_file);
+		fclose(source->lsrc_trace);
+		source->lsrc_trace = NULL;
+		return -EIO;
+	}
+	return 0;
+}
+
+static int lcrp_trace_write(struct lcrp_source *source,
+			    struct changelog_rec *rec)
+{
+	__u32 size = changelog_rec_size(rec) + rec->cr_namelen;
+
+	if (fwrite(&size, sizeof(size), 1, source->lsrc_trace) != 1 ||
+	    fwrite(rec, size, 1, source->lsrc_trace) != 1) {
+		LERROR("failed to write record %llu to trace file [%s]\n",
+		       rec->cr_index, source->lsrc_trace_file);
+		return -EIO;
+	}
+	return 0;
+}
+
+int lcrp_source_start(struct lcrp_source *source)
+{
+	int rc;
+
+	if (source->lsrc_trace_file[0] != '\0') {
+		rc = lcrp_trace_open(source);
+		if (rc)
+			return rc;
+	}
+
+	/* Synthetic and replay sources continue after the applied records */
+	if (source->lsrc_last_index < source->lsrc_resume_index)
+		source->lsrc_last_index = source->lsrc_resume_index;
+
+	rc = source->lsrc_ops->lsop_start(source);
+	if (rc) {
+		LERROR("failed to start Changelog source [%s]\n",
+		       source->lsrc_ops->lsop_name);
+		if (source->lsrc_trace != NULL) {
+			fclose(source->lsrc_trace);
+			source->lsrc_trace = NULL;
+		}
+		return rc;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &source->lsrc_rate_start);
+	source->lsrc_rate_count = 0;
+	return 0;
+}
+
+/*
+ * Sleep if records are being received faster than lsrc_rate
+ */
+static void lcrp_source_throttle(struct lcrp_source *source)
+{
+	long long expected_nsec;
+	long long elapsed_nsec;
+	struct timespec now;
+	struct timespec delay;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_nsec = (now.tv_sec - source->lsrc_rate_start.tv_sec) *
+		1000000000LL + now.tv_nsec - source->lsrc_rate_start.tv_nsec;
+	expected_nsec = source->lsrc_rate_count * 1000000000LL /
+		source->lsrc_rate;
+	if (expected_nsec <= elapsed_nsec)
+		return;
+
+	delay.tv_sec = (expected_nsec - elapsed_nsec) / 1000000000LL;
+	delay.tv_nsec = (expected_nsec - elapsed_nsec) % 1000000000LL;
+	nanosleep(&delay, NULL);
+}
+
+/*
+ * return "enum changelog_record_status" if no error, or the error is
+ * recoverable; return negative error if unrecoverable failure.
+ */
+int lcrp_source_recv(struct lcrp_source *source, struct changelog_rec **rec)
+{
+	int rc;
+
+	if (source->lsrc_rate > 0)
+		lcrp_source_throttle(source);
+
+	rc = source->lsrc_ops->lsop_recv(source, rec);
+	if (rc != LRS_OK)
+		return rc;
+
+	source->lsrc_rate_count++;
+	source->lsrc_wait_msec = 0;
+	lcrp_stats_add(LCRP_COUNTER_RECORDS, 1);
+	source->lsrc_last_index = (*rec)->cr_index;
+	if (source->lsrc_trace != NULL) {
+		rc = lcrp_trace_write(source, *rec);
+		if (rc) {
+			lcrp_source_free(source, rec);
+			return rc;
+		}
+	}
+	return LRS_OK;
+}
+
+/*
+ * Wait before getting records again when the source is idle or at EOF.
+ * The wait doubles while no record comes, and is reset as soon as a
+ * record is received.
+ */
+void lcrp_source_wait(struct lcrp_source *source)
+{
+	struct timespec delay;
+
+	if (source->lsrc_wait_msec == 0)
+		source->lsrc_wait_msec = LCRP_SOURCE_WAIT_MIN_MSEC;
+	else if (source->lsrc_wait_msec < LCRP_SOURCE_WAIT_MAX_MSEC)
+		source->lsrc_wait_msec *= 2;
+	if (source->lsrc_wait_msec > LCRP_SOURCE_WAIT_MAX_MSEC)
+		source->lsrc_wait_msec = LCRP_SOURCE_WAIT_MAX_MSEC;
+
+	delay.tv_sec = source->lsrc_wait_msec / 1000;
+	delay.tv_nsec = (source->lsrc_wait_msec % 1000) * 1000000;
+	nanosleep(&delay, NULL);
+}
+
+void lcrp_source_free(struct lcrp_source *source, struct changelog_rec **rec)
+{
+	source->lsrc_ops->lsop_free(source, rec);
+}
+
+int lcrp_source_clear(struct lcrp_source *source, unsigned long long index)
+{
+	return source->lsrc_ops->lsop_clear(source, index);
+}
+
+void lcrp_source_fini(struct lcrp_source *source)
+{
+	source->lsrc_ops->lsop_fini(source);
+	if (source->lsrc_trace != NULL) {
+		fclose(source->lsrc_trace);
+		source->lsrc_trace = NULL;
+	}
+}
+
+static int lcrp_llapi_start(struct lcrp_source *source)
+{
+	int rc;
+	long long startrec = 0;
+	enum changelog_send_flag flags = (CHANGELOG_FLAG_JOBID |
+					  CHANGELOG_FLAG_EXTRA_FLAGS);
+
+	/*
+	 * Records that have been applied but not cleared yet are not read
+	 * again. Otherwise, start from the first record not cleared.
+	 */
+	if (source->lsrc_resume_index > 0)
+		startrec = source->lsrc_resume_index + 1;
+
+	/*
+	 * Keep the reader open and poll it without blocking, so that new
+	 * records are seen without restarting the reader.
+	 */
+	if (!source->lsrc_nofollow) {
+		rc = llapi_changelog_start(&source->lsrc_private,
+					   flags | CHANGELOG_FLAG_FOLLOW,
+					   source->lsrc_mdt_device, startrec);
+		if (rc == -EINVAL || rc == -EOPNOTSUPP) {
+			LWARN("Changelog of %s cannot be followed, restarting the reader at its end\n",
+			      source->lsrc_mdt_device);
+			source->lsrc_nofollow = true;
+		}
+	}
+	if (source->lsrc_nofollow)
+		rc = llapi_changelog_start(&source->lsrc_private,
+					   flags | CHANGELOG_FLAG_BLOCK,
+					   source->lsrc_mdt_device, startrec);
+	if (rc < 0) {
+		LERROR("failed to open Changelog file for %s: %s\n",
+		       source->lsrc_mdt_device, strerror(-rc));
+		return rc;
+	}
+
+	rc = llapi_changelog_set_xflags(source->lsrc_private,
+					CHANGELOG_EXTRA_FLAG_UIDGID |
+					CHANGELOG_EXTRA_FLAG_NID |
+					CHANGELOG_EXTRA_FLAG_OMODE |
+					CHANGELOG_EXTRA_FLAG_XATTR);
+	if (rc < 0) {
+		LERROR("failed to set xflags for Changelog: %s\n",
+		       strerror(-rc));
+		llapi_changelog_fini(&source->lsrc_private);
+		return rc;
+	}
+	return 0;
+}
+
+static int lcrp_llapi_recv(struct lcrp_source *source,
+			   struct changelog_rec **rec)
+{
+	int rc;
+
+	rc = llapi_changelog_recv(source->lsrc_private, rec);
+	switch (rc) {
+	case 0:
+		return LRS_OK;
+	case 1:	/* EOF */
+		return LRS_EOF;
+	case -EAGAIN: /* No new record of the followed Changelog */
+		if (!source->lsrc_nofollow)
+			return LRS_IDLE;
+		return LRS_RETRY;
+	case -EINVAL:  /* FS unmounted */
+	case -EPROTO:  /* error in KUC channel */
+		return LRS_RESTART;
+	case -EINTR: /* Interruption */
+		return LRS_RETRY;
+	default:
+		return rc;
+	}
+}
+
+static void lcrp_llapi_free(struct lcrp_source *source,
+			    struct changelog_rec **rec)
+{
+	llapi_changelog_free(rec);
+}
+
+static int lcrp_llapi_clear(struct lcrp_source *source,
+			    unsigned long long index)
+{
+	return llapi_changelog_clear(source->lsrc_mdt_device,
+				     source->lsrc_changelog_user, index);
+}
+
+static void lcrp_llapi_fini(struct lcrp_source *source)
+{
+	llapi_changelog_fini(&source->lsrc_private);
+}
+
+const struct lcrp_source_operations lcrp_source_llapi_ops = {
+	.lsop_name	= LCRP_SOURCE_LLAPI,
+	.lsop_start	= lcrp_llapi_start,
+	.lsop_recv	= lcrp_llapi_recv,
+	.lsop_free	= lcrp_llapi_free,
+	.lsop_clear	= lcrp_llapi_clear,
+	.lsop_fini	= lcrp_llapi_fini,
+};
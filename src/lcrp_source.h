@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_SOURCE_H_
+#define _LCRP_SOURCE_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <linux/limits.h>
+#include <lustre/lustreapi.h>
+
+enum changelog_record_status {
+	LRS_OK = 0, /* Got a record*/
+	LRS_RETRY = 1, /* Try to get the record again */
+	LRS_EOF = 2, /* No more record  */
+	LRS_RESTART = 3, /* Call llapi_changelog_start again  */
+	LRS_IDLE = 4, /* No record for now, the source stays open */
+};
+
+/* Milliseconds to wait when the source becomes idle or reaches EOF */
+#define LCRP_SOURCE_WAIT_MIN_MSEC	1
+/* Maximum milliseconds to wait while the source stays idle */
+#define LCRP_SOURCE_WAIT_MAX_MSEC	1000
+
+#define LCRP_SOURCE_LLAPI	"llapi"
+#define LCRP_SOURCE_CHARDEV	"chardev"
+#define LCRP_SOURCE_SYNTHETIC	"synthetic"
+#define LCRP_SOURCE_REPLAY	"replay"
+
+/* "LCRT" in little endian */
+#define LCRP_TRACE_MAGIC	0x5452434CU
+#define LCRP_TRACE_VERSION	1
+/* Maximum size of a record in trace file */
+#define LCRP_TRACE_MAX_RECORD	65536
+
+/*
+ * Trace file starts with this header, followed by records. Each record is
+ * a __u32 of size followed by the changelog_rec with its extensions and
+ * name, i.e. changelog_rec_size(rec) + rec->cr_namelen bytes.
+ */
+struct lcrp_trace_header {
+	__u32	lth_magic;
+	__u32	lth_version;
+};
+
+struct lcrp_synthetic_config {
+	/* Number of different FIDs to generate */
+	unsigned long		lsc_fids;
+	/* Exponent of Zipf distribution of FIDs, 0 for uniform */
+	double			lsc_zipf;
+	/* Weight of each record type, all zero means CL_OPEN only */
+	unsigned int		lsc_type_weights[CL_LAST];
+	/* Number of records to generate before EOF, 0 for unlimited */
+	unsigned long long	lsc_records;
+	/* Seed of random numbers */
+	unsigned int		lsc_seed;
+};
+
+struct lcrp_source;
+
+struct lcrp_source_operations {
+	/* Name of the source type */
+	const char *lsop_name;
+	/* Start to read records, return negative error on failure */
+	int (*lsop_start)(struct lcrp_source *source);
+	/*
+	 * Get a record, return "enum changelog_record_status" if no error,
+	 * or the error is recoverable; return negative error if
+	 * unrecoverable failure.
+	 */
+	int (*lsop_recv)(struct lcrp_source *source,
+			 struct changelog_rec **rec);
+	/* Release a record returned by lsop_recv */
+	void (*lsop_free)(struct lcrp_source *source,
+			  struct changelog_rec **rec);
+	/* Clear all records up to index, return negative error on failure */
+	int (*lsop_clear)(struct lcrp_source *source,
+			  unsigned long long index);
+	/* Stop reading records */
+	void (*lsop_fini)(struct lcrp_source *source);
+};
+
+struct lcrp_source {
+	/* Operations of the source type */
+	const struct lcrp_source_operations	*lsrc_ops;
+	/* MDT device to get Changelog from */
+	const char				*lsrc_mdt_device;
+	/* Changelog user */
+	const char				*lsrc_changelog_user;
+	/* Index of the last received record */
+	unsigned long long			 lsrc_last_index;
+	/* Records up to this index have been applied, start reading after */
+	unsigned long long			 lsrc_resume_index;
+	/* Private data of the started source */
+	void					*lsrc_private;
+	/* Changelog cannot be followed, so the reader is restarted at EOF */
+	bool					 lsrc_nofollow;
+	/* Milliseconds of the next wait, 0 if records are coming */
+	long					 lsrc_wait_msec;
+	/* Records per second to receive, 0 for unlimited */
+	unsigned long				 lsrc_rate;
+	/* Time when the rate limit started */
+	struct timespec				 lsrc_rate_start;
+	/* Number of records received since lsrc_rate_start */
+	unsigned long long			 lsrc_rate_count;
+	/* Config of synthetic source */
+	struct lcrp_synthetic_config		 lsrc_synthetic;
+	/* Trace file to replay records from */
+	char					 lsrc_replay_file[PATH_MAX + 1];
+	/* Trace file to capture received records into, empty to disable */
+	char					 lsrc_trace_file[PATH_MAX + 1];
+	/* Opened trace file to capture records into */
+	FILE					*lsrc_trace;
+};
+
+extern const struct lcrp_source_operations lcrp_source_llapi_ops;
+extern const struct lcrp_source_operations lcrp_source_chardev_ops;
+extern const struct lcrp_source_operations lcrp_source_synthetic_ops;
+extern const struct lcrp_source_operations lcrp_source_replay_ops;
+
+int lcrp_source_init(struct lcrp_source *source, const char *name);
+int lcrp_source_start(struct lcrp_source *source);
+int lcrp_source_recv(struct lcrp_source *source, struct changelog_rec **rec);
+void lcrp_source_wait(struct lcrp_source *source);
+void lcrp_source_free(struct lcrp_source *source, struct changelog_rec **rec);
+int lcrp_source_clear(struct lcrp_source *source, unsigned long long index);
+void lcrp_source_fini(struct lcrp_source *source);
+#endif /* _LCRP_SOURCE_H_ */
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Source of Changelog records read from the Changelog device of the MDT,
+ * i.e. /dev/changelog-$MDT. Records are read in bulk into a reusable
+ * buffer and given out in place, while llapi_changelog_recv() allocates
+ * and copies every record.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "lcrp_source.h"
+
+/* Directory of the Changelog devices */
+#define LCRP_CHARDEV_DIR "/dev"
+/* Size of the buffer that records are read into */
+#define LCRP_CHARDEV_BUFFER_SIZE (4 * 1024 * 1024)
+
+struct lcrp_chardev {
+	/* Opened Changelog device */
+	int	 lcd_fd;
+	/* Path of the Changelog device */
+	char	 lcd_path[PATH_MAX + 1];
+	/* Buffer of the records read from the device */
+	char	*lcd_buffer;
+	/* Number of bytes in lcd_buffer */
+	size_t	 lcd_length;
+	/* Offset of the next record in lcd_buffer */
+	size_t	 lcd_offset;
+};
+
+static void lcrp_chardev_fini(struct lcrp_source *source)
+{
+	struct lcrp_chardev *dev = source->lsrc_private;
+
+	if (dev == NULL)
+		return;
+	if (dev->lcd_fd >= 0)
+		close(dev->lcd_fd);
+	free(dev->lcd_buffer);
+	free(dev);
+	source->lsrc_private = NULL;
+}
+
+static int lcrp_chardev_start(struct lcrp_source *source)
+{
+	int rc;
+	struct stat st;
+	struct lcrp_chardev *dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (dev == NULL)
+		return -ENOMEM;
+	dev->lcd_fd = -1;
+	source->lsrc_private = dev;
+
+	dev->lcd_buffer = malloc(LCRP_CHARDEV_BUFFER_SIZE);
+	if (dev->lcd_buffer == NULL) {
+		rc = -ENOMEM;
+		goto error;
+	}
+
+	snprintf(dev->lcd_path, sizeof(dev->lcd_path), "%s/changelog-%s",
+		 LCRP_CHARDEV_DIR, source->lsrc_mdt_device);
+	/* Never block, so that an idle Changelog does not hang the thread */
+	dev->lcd_fd = open(dev->lcd_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (dev->lcd_fd < 0) {
+		rc = -errno;
+		LERROR("failed to open Changelog device [%s]: %s\n",
+		       dev->lcd_path, strerror(errno));
+		goto error;
+	}
+
+	/*
+	 * The offset of the Changelog device is the index of the record to
+	 * start from. Records up to lsrc_last_index are skipped anyway.
+	 */
+	if (source->lsrc_last_index > 0 && fstat(dev->lcd_fd, &st) == 0 &&
+	    S_ISCHR(st.st_mode) &&
+	    lseek(dev->lcd_fd, source->lsrc_last_index + 1, SEEK_SET) < 0) {
+		rc = -errno;
+		LERROR("failed to seek Changelog device [%s] to record %llu: %s\n",
+		       dev->lcd_path, source->lsrc_last_index + 1,
+		       strerror(errno));
+		goto error;
+	}
+	return 0;
+error:
+	lcrp_chardev_fini(source);
+	return rc;
+}
+
+/*
+ * Return the record at lcd_offset, or NULL if it is not complete in the
+ * buffer. The extensions are walked through cr_flags and cr_extra_flags,
+ * so the record is used as the MDT wrote it, without being remapped.
+ */
+static struct changelog_rec *lcrp_chardev_peek(struct lcrp_chardev *dev,
+					       size_t *size)
+{
+	size_t remain = dev->lcd_length - dev->lcd_offset;
+	struct changelog_rec *rec;
+
+	if (remain < sizeof(*rec))
+		return NULL;
+	rec = (struct changelog_rec *)(dev->lcd_buffer + dev->lcd_offset);
+	/* The extra flags are needed to get the size of the extensions */
+	if (remain < changelog_rec_offset(rec->cr_flags & CLF_SUPPORTED,
+					  CLFE_INVALID))
+		return NULL;
+	*size = changelog_rec_size(rec) + rec->cr_namelen;
+	if (remain < *size)
+		return NULL;
+	return rec;
+}
+
+/*
+ * Move the incomplete record to the start of the buffer and read more
+ * records after it
+ */
+static int lcrp_chardev_read(struct lcrp_source *source,
+			     struct lcrp_chardev *dev)
+{
+	ssize_t nread;
+	size_t remain = dev->lcd_length - dev->lcd_offset;
+
+	if (remain == LCRP_CHARDEV_BUFFER_SIZE) {
+		LERROR("record larger than [%d] bytes from Changelog device [%s]\n",
+		       LCRP_CHARDEV_BUFFER_SIZE, dev->lcd_path);
+		return -EINVAL;
+	}
+	if (dev->lcd_offset > 0) {
+		memmove(dev->lcd_buffer, dev->lcd_buffer + dev->lcd_offset,
+			remain);
+		dev->lcd_offset = 0;
+		dev->lcd_length = remain;
+	}
+
+	nread = read(dev->lcd_fd, dev->lcd_buffer + dev->lcd_length,
+		     LCRP_CHARDEV_BUFFER_SIZE - dev->lcd_length);
+	if (nread < 0) {
+		switch (errno) {
+		case EAGAIN: /* No new record */
+			return LRS_IDLE;
+		case EINTR: /* Interruption */
+			return LRS_RETRY;
+		case EINVAL: /* FS unmounted */
+		case EPROTO:
+			return LRS_RESTART;
+		default:
+			LERROR("failed to read Changelog device [%s]: %s\n",
+			       dev->lcd_path, strerror(errno));
+			return -errno;
+		}
+	}
+	/* Restart to seek past the last received record */
+	if (nread == 0)
+		return LRS_EOF;
+	dev->lcd_length += nread;
+	return LRS_OK;
+}
+
+static int lcrp_chardev_recv(struct lcrp_source *source,
+			     struct changelog_rec **rec)
+{
+	int rc;
+	size_t size;
+	struct changelog_rec *next;
+	struct lcrp_chardev *dev = source->lsrc_private;
+
+	/*
+	 * Records before the last received one have been received before
+	 * the source restarted, skip them.
+	 */
+	do {
+		while ((next = lcrp_chardev_peek(dev, &size)) == NULL) {
+			rc = lcrp_chardev_read(source, dev);
+			if (rc != LRS_OK)
+				return rc;
+		}
+		dev->lcd_offset += size;
+	} while (next->cr_index <= source->lsrc_last_index);
+
+	*rec = next;
+	return LRS_OK;
+}
+
+/*
+ * The record stays in the buffer until the next lcrp_chardev_recv(), so
+ * nothing to free
+ */
+static void lcrp_chardev_free(struct lcrp_source *source,
+			      struct changelog_rec **rec)
+{
+	*rec = NULL;
+}
+
+static int lcrp_chardev_clear(struct lcrp_source *source,
+			      unsigned long long index)
+{
+	return llapi_changelog_clear(source->lsrc_mdt_device,
+				     source->lsrc_changelog_user, index);
+}
+
+const struct lcrp_source_operations lcrp_source_chardev_ops = {
+	.lsop_name	= LCRP_SOURCE_CHARDEV,
+	.lsop_start	= lcrp_chardev_start,
+	.lsop_recv	= lcrp_chardev_recv,
+	.lsop_free	= lcrp_chardev_free,
+	.lsop_clear	= lcrp_chardev_clear,
+	.lsop_fini	= lcrp_chardev_fini,
+};
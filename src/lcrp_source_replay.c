@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Source of Changelog records replayed from a trace file that was captured
+ * with "trace_file".
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcrp_source.h"
+
+/* Buffer size of stdio stream, larger is better for streaming */
+#define LCRP_REPLAY_BUFFER_SIZE (4 * 1024 * 1024)
+
+struct lcrp_replay {
+	/* Opened trace file */
+	FILE			*lrp_file;
+	/* Buffer of stdio stream */
+	char			*lrp_stream_buffer;
+	/* Buffer of the record being replayed */
+	struct changelog_rec	*lrp_rec;
+};
+
+static void lcrp_replay_fini(struct lcrp_source *source)
+{
+	struct lcrp_replay *replay = source->lsrc_private;
+
+	if (replay == NULL)
+		return;
+	if (replay->lrp_file != NULL)
+		fclose(replay->lrp_file);
+	free(replay->lrp_stream_buffer);
+	free(replay->lrp_rec);
+	free(replay);
+	source->lsrc_private = NULL;
+}
+
+static int lcrp_replay_start(struct lcrp_source *source)
+{
+	int rc;
+	struct lcrp_replay *replay;
+	struct lcrp_trace_header header;
+
+	if (source->lsrc_replay_file[0] == '\0') {
+		LERROR("no trace file is configured for replay source\n");
+		return -EINVAL;
+	}
+
+	replay = calloc(1, sizeof(*replay));
+	if (replay == NULL)
+		return -ENOMEM;
+	source->lsrc_private = replay;
+
+	replay->lrp_rec = malloc(LCRP_TRACE_MAX_RECORD);
+	replay->lrp_stream_buffer = malloc(LCRP_REPLAY_BUFFER_SIZE);
+	if (replay->lrp_rec == NULL || replay->lrp_stream_buffer == NULL) {
+		rc = -ENOMEM;
+		goto error;
+	}
+
+	replay->lrp_file = fopen(source->lsrc_replay_file, "rb");
+	if (replay->lrp_file == NULL) {
+		LERROR("failed to open trace file [%s]: %s\n",
+		       source->lsrc_replay_file, strerror(errno));
+		rc = -errno;
+		goto error;
+	}
+	setvbuf(replay->lrp_file, replay->lrp_stream_buffer, _IOFBF,
+		LCRP_REPLAY_BUFFER_SIZE);
+
+	if (fread(&header, sizeof(header), 1, replay->lrp_file) != 1 ||
+	    header.lth_magic != LCRP_TRACE_MAGIC ||
+	    header.lth_version != LCRP_TRACE_VERSION) {
+		LERROR("[%s] is not a valid trace file\n",
+		       source->lsrc_replay_file);
+		rc = -EINVAL;
+		goto error;
+	}
+	return 0;
+error:
+	lcrp_replay_fini(source);
+	return rc;
+}
+
+static int lcrp_replay_read(struct lcrp_source *source,
+			    struct lcrp_replay *replay)
+{
+	__u32 size;
+
+	if (fread(&size, sizeof(size), 1, replay->lrp_file) != 1) {
+		if (feof(replay->lrp_file))
+			return LRS_EOF;
+		LERROR("failed to read trace file [%s]\n",
+		       source->lsrc_replay_file);
+		return -EIO;
+	}
+
+	if (size < sizeof(struct changelog_rec) ||
+	    size > LCRP_TRACE_MAX_RECORD) {
+		LERROR("invalid record size [%u] in trace file [%s]\n",
+		       size, source->lsrc_replay_file);
+		return -EINVAL;
+	}
+
+	if (fread(replay->lrp_rec, size, 1, replay->lrp_file) != 1) {
+		LERROR("truncated record in trace file [%s]\n",
+		       source->lsrc_replay_file);
+		return -EIO;
+	}
+	return LRS_OK;
+}
+
+static int lcrp_replay_recv(struct lcrp_source *source,
+			    struct changelog_rec **rec)
+{
+	int rc;
+	struct lcrp_replay *replay = source->lsrc_private;
+
+	/*
+	 * Records before the last received one have been replayed before the
+	 * source restarted, skip them.
+	 */
+	do {
+		rc = lcrp_replay_read(source, replay);
+		if (rc != LRS_OK)
+			return rc;
+	} while (replay->lrp_rec->cr_index <= source->lsrc_last_index);
+
+	*rec = replay->lrp_rec;
+	return LRS_OK;
+}
+
+/* The buffer of record is reused, so nothing to free */
+static void lcrp_replay_free(struct lcrp_source *source,
+			     struct changelog_rec **rec)
+{
+	*rec = NULL;
+}
+
+static int lcrp_replay_clear(struct lcrp_source *source,
+			     unsigned long long index)
+{
+	return 0;
+}
+
+const struct lcrp_source_operations lcrp_source_replay_ops = {
+	.lsop_name	= LCRP_SOURCE_REPLAY,
+	.lsop_start	= lcrp_replay_start,
+	.lsop_recv	= lcrp_replay_recv,
+	.lsop_free	= lcrp_replay_free,
+	.lsop_clear	= lcrp_replay_clear,
+	.lsop_fini	= lcrp_replay_fini,
+};
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Synthetic source of Changelog records, used for load testing without
+ * a Lustre MDT.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcrp_source.h"
+
+/* Sequence of the generated FIDs, in the range of normal sequences */
+#define LCRP_SYNTHETIC_SEQ 0x200000401ULL
+
+struct lcrp_synthetic {
+	/* Buffer of the generated record */
+	struct changelog_rec	*lsy_rec;
+	/* Cumulative distribution of FID ranks, NULL if uniform */
+	double			*lsy_cdf;
+	/* Cumulative weights of record types */
+	unsigned int		 lsy_type_cdf[CL_LAST];
+	/* Sum of all type weights */
+	unsigned int		 lsy_type_total;
+	/* State of random number generator */
+	unsigned long long	 lsy_random;
+};
+
+/* xorshift64* generator, fast and good enough for load generation */
+static unsigned long long lcrp_synthetic_random(struct lcrp_synthetic *syn)
+{
+	syn->lsy_random ^= syn->lsy_random >> 12;
+	syn->lsy_random ^= syn->lsy_random << 25;
+	syn->lsy_random ^= syn->lsy_random >> 27;
+	return syn->lsy_random * 0x2545F4914F6CDD1DULL;
+}
+
+/* Return random number in [0, 1) */
+static double lcrp_synthetic_uniform(struct lcrp_synthetic *syn)
+{
+	return (lcrp_synthetic_random(syn) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static int lcrp_synthetic_init_cdf(struct lcrp_synthetic *syn,
+				   struct lcrp_synthetic_config *config)
+{
+	unsigned long i;
+	double sum = 0;
+
+	syn->lsy_cdf = malloc(sizeof(*syn->lsy_cdf) * config->lsc_fids);
+	if (syn->lsy_cdf == NULL) {
+		LERROR("failed to allocate distribution of [%lu] FIDs\n",
+		       config->lsc_fids);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < config->lsc_fids; i++) {
+		sum += 1.0 / pow(i + 1, config->lsc_zipf);
+		syn->lsy_cdf[i] = sum;
+	}
+	for (i = 0; i < config->lsc_fids; i++)
+		syn->lsy_cdf[i] /= sum;
+	return 0;
+}
+
+/* Return rank of the FID to generate, 0 is the hottest one */
+static unsigned long lcrp_synthetic_rank(struct lcrp_synthetic *syn,
+					 unsigned long fids)
+{
+	unsigned long low = 0;
+	unsigned long high = fids - 1;
+	unsigned long middle;
+	double value;
+
+	if (syn->lsy_cdf == NULL)
+		return lcrp_synthetic_random(syn) % fids;
+
+	value = lcrp_synthetic_uniform(syn);
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (syn->lsy_cdf[middle] < value)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+static enum changelog_rec_type
+lcrp_synthetic_type(struct lcrp_synthetic *syn)
+{
+	unsigned int value;
+	int i;
+
+	if (syn->lsy_type_total == 0)
+		return CL_OPEN;
+
+	value = lcrp_synthetic_random(syn) % syn->lsy_type_total;
+	for (i = 0; i < CL_LAST; i++) {
+		if (value < syn->lsy_type_cdf[i])
+			return i;
+	}
+	return CL_OPEN;
+}
+
+static void lcrp_synthetic_fini(struct lcrp_source *source)
+{
+	struct lcrp_synthetic *syn = source->lsrc_private;
+
+	if (syn == NULL)
+		return;
+	free(syn->lsy_rec);
+	free(syn->lsy_cdf);
+	free(syn);
+	source->lsrc_private = NULL;
+}
+
+static int lcrp_synthetic_start(struct lcrp_source *source)
+{
+	int i;
+	int rc;
+	struct lcrp_synthetic *syn;
+	struct lcrp_synthetic_config *config = &source->lsrc_synthetic;
+
+	if (config->lsc_fids == 0) {
+		LERROR("no FID to generate for synthetic source\n");
+		return -EINVAL;
+	}
+
+	syn = calloc(1, sizeof(*syn));
+	if (syn == NULL)
+		return -ENOMEM;
+	source->lsrc_private = syn;
+
+	syn->lsy_rec = calloc(1, sizeof(*syn->lsy_rec));
+	if (syn->lsy_rec == NULL) {
+		rc = -ENOMEM;
+		goto error;
+	}
+
+	if (config->lsc_zipf > 0) {
+		rc = lcrp_synthetic_init_cdf(syn, config);
+		if (rc)
+			goto error;
+	}
+
+	for (i = 0; i < CL_LAST; i++) {
+		syn->lsy_type_total += config->lsc_type_weights[i];
+		syn->lsy_type_cdf[i] = syn->lsy_type_total;
+	}
+
+	/* Seed should not be zero for xorshift, and differ for each restart */
+	syn->lsy_random = ((unsigned long long)config->lsc_seed << 32) +
+		source->lsrc_last_index + 1;
+	return 0;
+error:
+	lcrp_synthetic_fini(source);
+	return rc;
+}
+
+static int lcrp_synthetic_recv(struct lcrp_source *source,
+			       struct changelog_rec **rec)
+{
+	struct lcrp_synthetic *syn = source->lsrc_private;
+	struct lcrp_synthetic_config *config = &source->lsrc_synthetic;
+	struct changelog_rec *generated = syn->lsy_rec;
+	struct timespec now;
+
+	if (config->lsc_records > 0 &&
+	    source->lsrc_last_index >= config->lsc_records)
+		return LRS_EOF;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(generated, 0, sizeof(*generated));
+	generated->cr_flags = CLF_VERSION;
+	generated->cr_type = lcrp_synthetic_type(syn);
+	generated->cr_index = source->lsrc_last_index + 1;
+	generated->cr_prev = source->lsrc_last_index;
+	/* Seconds in high 34 bits, nanoseconds in low 30 bits */
+	generated->cr_time = ((unsigned long long)now.tv_sec << 30) |
+		now.tv_nsec;
+	generated->cr_tfid.f_seq = LCRP_SYNTHETIC_SEQ;
+	generated->cr_tfid.f_oid = lcrp_synthetic_rank(syn, config->lsc_fids) +
+		1;
+	generated->cr_pfid.f_seq = LCRP_SYNTHETIC_SEQ;
+	generated->cr_pfid.f_oid = 1;
+	*rec = generated;
+	return LRS_OK;
+}
+
+/* The buffer of record is reused, so nothing to free */
+static void lcrp_synthetic_free(struct lcrp_source *source,
+				struct changelog_rec **rec)
+{
+	*rec = NULL;
+}
+
+static int lcrp_synthetic_clear(struct lcrp_source *source,
+				unsigned long long index)
+{
+	return 0;
+}
+
+const struct lcrp_source_operations lcrp_source_synthetic_ops = {
+	.lsop_name	= LCRP_SOURCE_SYNTHETIC,
+	.lsop_start	= lcrp_synthetic_start,
+	.lsop_recv	= lcrp_synthetic_recv,
+	.lsop_free	= lcrp_synthetic_free,
+	.lsop_clear	= lcrp_synthetic_clear,
+	.lsop_fini	= lcrp_synthetic_fini,
+};
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Statistics of the daemon, dumped in the text format of Prometheus.
+ *
+ * Each thread updates its own block of counters and histograms without
+ * any lock. When a thread exits, its counters and histograms are folded
+ * into the block of retired threads and its block is freed, both under
+ * the lock that readers hold, so readers never see a freed one.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcrp_stats.h"
+#include "lcrpd.h"
+
+__thread struct lcrp_stats_block *lcrp_stats_local;
+
+/* Protects lcrp_stats_blocks */
+static pthread_mutex_t lcrp_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* All registered blocks */
+static struct lcrp_stats_block *lcrp_stats_blocks;
+/* Counters and histograms of exited threads, protected by the mutex */
+static struct lcrp_stats_block lcrp_stats_retired;
+/* Retires the block of a thread when it exits */
+static pthread_key_t lcrp_stats_key;
+static pthread_once_t lcrp_stats_key_once = PTHREAD_ONCE_INIT;
+/* Shared by the threads that failed to allocate a block, might lose counts */
+static struct lcrp_stats_block lcrp_stats_fallback;
+
+static const struct {
+	const char *name;
+	const char *help;
+} lcrp_counter_names[LCRP_COUNTER_MAX] = {
+	[LCRP_COUNTER_RECORDS] = {
+		"lcrp_records_total", "Records received from Changelog" },
+	[LCRP_COUNTER_DROPPED] = {
+		"lcrp_records_dropped_total",
+		"Records dropped because they are not access" },
+	[LCRP_COUNTER_FIDS_LINKED] = {
+		"lcrp_fids_linked_total",
+		"FIDs linked into the active epoch" },
+	[LCRP_COUNTER_CLEARS] = {
+		"lcrp_changelog_clears_total", "Calls to clear Changelog" },
+	[LCRP_COUNTER_ROLLOVERS] = {
+		"lcrp_epoch_rollovers_total", "Epoch rollovers" },
+	[LCRP_COUNTER_CLEANUP_FILES] = {
+		"lcrp_cleanup_files_total",
+		"Files merged from epochs into inactive/all or coarser tiers" },
+	[LCRP_COUNTER_CLEANUP_EPOCHS] = {
+		"lcrp_cleanup_epochs_total",
+		"Epochs that have been cleaned up or merged" },
+	[LCRP_COUNTER_DRAINED] = {
+		"lcrp_records_drained_total",
+		"Records of the backlog applied to their epochs in batches" },
+	[LCRP_COUNTER_QUEUE_FULL] = {
+		"lcrp_worker_queue_full_total",
+		"Records that found the queue of their worker full" },
+	[LCRP_COUNTER_QUEUE_EMPTY] = {
+		"lcrp_worker_queue_empty_total",
+		"Waits of workers for works on their empty queues" },
+	[LCRP_COUNTER_SPILL_STARTS] = {
+		"lcrp_spill_starts_total",
+		"Switches from queueing records on workers to spilling them" },
+	[LCRP_COUNTER_SPILLED] = {
+		"lcrp_spilled_records_total",
+		"Records spilled into files as queues of workers are full" },
+	[LCRP_COUNTER_SPILL_REPLAYED] = {
+		"lcrp_spill_replayed_records_total",
+		"Spilled records queued on workers afterwards" },
+	[LCRP_COUNTER_SPILL_ENDS] = {
+		"lcrp_spill_ends_total",
+		"Spills ended with all records queued on workers" },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} lcrp_gauge_names[LCRP_GAUGE_MAX] = {
+	[LCRP_GAUGE_QUEUED_WORKS] = {
+		"lcrp_worker_queued_works",
+		"Records received but not processed by workers yet" },
+	[LCRP_GAUGE_PAUSED] = {
+		"lcrp_inflight_paused",
+		"Changelog threads paused because queues of workers are full" },
+	[LCRP_GAUGE_SPILL_PENDING] = {
+		"lcrp_spill_pending_records",
+		"Spilled records that have not been queued on workers" },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} lcrp_histogram_names[LCRP_HIST_MAX] = {
+	[LCRP_HIST_LINK_FID] = {
+		"lcrp_link_fid_seconds",
+		"Time to link a FID that missed the FID cache" },
+	[LCRP_HIST_CLEAR] = {
+		"lcrp_changelog_clear_seconds", "Time of a Changelog clear" },
+	[LCRP_HIST_ROLLOVER] = {
+		"lcrp_epoch_rollover_seconds", "Time of an epoch rollover" },
+	[LCRP_HIST_RECORD_LAG] = {
+		"lcrp_record_lag_seconds",
+		"Time from record creation to processed" },
+	[LCRP_HIST_CLEANUP_EPOCH] = {
+		"lcrp_cleanup_epoch_seconds",
+		"Time to cleanup or merge an epoch" },
+	[LCRP_HIST_DRAIN_BATCH] = {
+		"lcrp_drain_batch_seconds",
+		"Time to apply a batch of the backlog" },
+};
+
+static void lcrp_stats_sum_block(struct lcrp_stats_block *total,
+				 struct lcrp_stats_block *block)
+{
+	int i;
+	int j;
+	struct lcrp_histogram_data *data;
+
+	for (i = 0; i < LCRP_COUNTER_MAX; i++)
+		total->lsb_counters[i] +=
+			__atomic_load_n(&block->lsb_counters[i],
+					__ATOMIC_RELAXED);
+
+	for (i = 0; i < LCRP_GAUGE_MAX; i++)
+		total->lsb_gauges[i] +=
+			__atomic_load_n(&block->lsb_gauges[i],
+					__ATOMIC_RELAXED);
+
+	for (i = 0; i < LCRP_HIST_MAX; i++) {
+		data = &block->lsb_hists[i];
+		for (j = 0; j < LCRP_HIST_BUCKETS; j++)
+			total->lsb_hists[i].lhd_buckets[j] +=
+				__atomic_load_n(&data->lhd_buckets[j],
+						__ATOMIC_RELAXED);
+		total->lsb_hists[i].lhd_sum +=
+			__atomic_load_n(&data->lhd_sum, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Called when the owner thread exits. Gauges are the current values of
+ * the thread, so they are dropped.
+ */
+static void lcrp_stats_retire(void *arg)
+{
+	struct lcrp_stats_block *block;
+	struct lcrp_stats_block **prev;
+
+	pthread_mutex_lock(&lcrp_stats_mutex);
+	/* The block has been freed if lcrp_stats_fini() has been called */
+	for (prev = &lcrp_stats_blocks; (block = *prev) != NULL;
+	     prev = &block->lsb_next) {
+		if (block != arg)
+			continue;
+		*prev = block->lsb_next;
+		memset(block->lsb_gauges, 0, sizeof(block->lsb_gauges));
+		lcrp_stats_sum_block(&lcrp_stats_retired, block);
+		free(block);
+		break;
+	}
+	pthread_mutex_unlock(&lcrp_stats_mutex);
+}
+
+static void lcrp_stats_key_create(void)
+{
+	int rc;
+
+	rc = pthread_key_create(&lcrp_stats_key, lcrp_stats_retire);
+	if (rc)
+		LERROR("failed to create key of statistics: %s\n",
+		       strerror(rc));
+}
+
+struct lcrp_stats_block *lcrp_stats_register(void)
+{
+	struct lcrp_stats_block *block;
+
+	pthread_once(&lcrp_stats_key_once, lcrp_stats_key_create);
+	block = calloc(1, sizeof(*block));
+	if (block == NULL) {
+		LERROR("failed to allocate statistics of thread\n");
+		lcrp_stats_local = &lcrp_stats_fallback;
+		return lcrp_stats_local;
+	}
+
+	pthread_mutex_lock(&lcrp_stats_mutex);
+	block->lsb_next = lcrp_stats_blocks;
+	lcrp_stats_blocks = block;
+	pthread_mutex_unlock(&lcrp_stats_mutex);
+	pthread_setspecific(lcrp_stats_key, block);
+	lcrp_stats_local = block;
+	return block;
+}
+
+void lcrp_stats_fini(void)
+{
+	struct lcrp_stats_block *block;
+
+	pthread_mutex_lock(&lcrp_stats_mutex);
+	while (lcrp_stats_blocks != NULL) {
+		block = lcrp_stats_blocks;
+		lcrp_stats_blocks = block->lsb_next;
+		free(block);
+	}
+	memset(&lcrp_stats_retired, 0, sizeof(lcrp_stats_retired));
+	pthread_mutex_unlock(&lcrp_stats_mutex);
+	pthread_setspecific(lcrp_stats_key, NULL);
+	lcrp_stats_local = NULL;
+}
+
+static void lcrp_stats_sum(struct lcrp_stats_block *total)
+{
+	struct lcrp_stats_block *block;
+
+	memset(total, 0, sizeof(*total));
+	pthread_mutex_lock(&lcrp_stats_mutex);
+	for (block = lcrp_stats_blocks; block != NULL; block = block->lsb_next)
+		lcrp_stats_sum_block(total, block);
+	lcrp_stats_sum_block(total, &lcrp_stats_retired);
+	pthread_mutex_unlock(&lcrp_stats_mutex);
+	lcrp_stats_sum_block(total, &lcrp_stats_fallback);
+}
+
+static void lcrp_stats_print_header(FILE *fp, const char *name,
+				    const char *help, const char *type)
+{
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void lcrp_stats_print_histogram(FILE *fp, const char *name,
+				       const char *help,
+				       struct lcrp_histogram_data *data)
+{
+	int i;
+	unsigned long long count = 0;
+
+	lcrp_stats_print_header(fp, name, help, "histogram");
+	for (i = 0; i < LCRP_HIST_BUCKETS - 1; i++) {
+		count += data->lhd_buckets[i];
+		fprintf(fp, "%s_bucket{le=\"%.9g\"} %llu\n", name,
+			(double)(1ULL << i) / 1000000000.0, count);
+	}
+	count += data->lhd_buckets[LCRP_HIST_BUCKETS - 1];
+	fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name, count);
+	fprintf(fp, "%s_sum %.9f\n", name, data->lhd_sum / 1000000000.0);
+	fprintf(fp, "%s_count %llu\n", name, count);
+}
+
+/*
+ * Gauges that are read from the status of the daemon
+ */
+static void lcrp_stats_print_gauges(FILE *fp)
+{
+	int i;
+	int queued = 0;
+	struct lcrp_retired_epoch *retired;
+	struct lcrp_changelog_thread_info *info;
+	struct lcrp_inactive_thread_info *inactive;
+
+	lcrp_stats_print_header(fp, "lcrp_changelog_last_index",
+				"Index of the last received record", "gauge");
+	for (i = 0; i < lcrp_status->ls_mdt_count; i++) {
+		info = &lcrp_status->ls_changelog_infos[i];
+		fprintf(fp, "lcrp_changelog_last_index{mdt=\"%s\"} %llu\n",
+			info->lcti_mdt_device,
+			__atomic_load_n(&info->lcti_source.lsrc_last_index,
+					__ATOMIC_RELAXED));
+	}
+
+	lcrp_stats_print_header(fp, "lcrp_changelog_cleared_index",
+				"Index of the last cleared record", "gauge");
+	for (i = 0; i < lcrp_status->ls_mdt_count; i++) {
+		info = &lcrp_status->ls_changelog_infos[i];
+		fprintf(fp, "lcrp_changelog_cleared_index{mdt=\"%s\"} %llu\n",
+			info->lcti_mdt_device,
+			__atomic_load_n(&info->lcti_clear.lcc_cleared,
+					__ATOMIC_RELAXED));
+	}
+
+	inactive = &lcrp_status->ls_inactive_info;
+	pthread_mutex_lock(&inactive->liti_mutex);
+	for (retired = inactive->liti_head; retired != NULL;
+	     retired = retired->lre_next)
+		queued++;
+	pthread_mutex_unlock(&inactive->liti_mutex);
+	lcrp_stats_print_header(fp, "lcrp_cleanup_queued_epochs",
+				"Inactive epochs waiting for cleanup",
+				"gauge");
+	fprintf(fp, "lcrp_cleanup_queued_epochs %d\n", queued);
+
+	lcrp_stats_print_header(fp, "lcrp_epoch_start_seconds",
+				"Start time of the active epoch", "gauge");
+	fprintf(fp, "lcrp_epoch_start_seconds %d\n",
+		__atomic_load_n(&lcrp_status->ls_epoch.le_start,
+				__ATOMIC_RELAXED));
+}
+
+/*
+ * Write the statistics into a file, which is replaced atomically so that
+ * readers never see a partial one
+ */
+int lcrp_stats_dump(const char *path)
+{
+	int i;
+	int rc;
+	FILE *fp;
+	char tmp[PATH_MAX + 1];
+	struct lcrp_stats_block *total;
+
+	total = malloc(sizeof(*total));
+	if (total == NULL) {
+		LERROR("failed to allocate statistics\n");
+		return -ENOMEM;
+	}
+	lcrp_stats_sum(total);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		LERROR("failed to open [%s]: %s\n", tmp, strerror(errno));
+		rc = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < LCRP_COUNTER_MAX; i++) {
+		lcrp_stats_print_header(fp, lcrp_counter_names[i].name,
+					lcrp_counter_names[i].help, "counter");
+		fprintf(fp, "%s %llu\n", lcrp_counter_names[i].name,
+			total->lsb_counters[i]);
+	}
+	for (i = 0; i < LCRP_GAUGE_MAX; i++) {
+		lcrp_stats_print_header(fp, lcrp_gauge_names[i].name,
+					lcrp_gauge_names[i].help, "gauge");
+		fprintf(fp, "%s %llu\n", lcrp_gauge_names[i].name,
+			total->lsb_gauges[i]);
+	}
+	for (i = 0; i < LCRP_HIST_MAX; i++)
+		lcrp_stats_print_histogram(fp, lcrp_histogram_names[i].name,
+					   lcrp_histogram_names[i].help,
+					   &total->lsb_hists[i]);
+	lcrp_stats_print_gauges(fp);
+
+	rc = fclose(fp);
+	if (rc) {
+		LERROR("failed to write [%s]: %s\n", tmp, strerror(errno));
+		rc = -errno;
+		goto out;
+	}
+
+	rc = rename(tmp, path);
+	if (rc) {
+		LERROR("failed to rename [%s] to [%s]: %s\n", tmp, path,
+		       strerror(errno));
+		rc = -errno;
+	}
+out:
+	free(total);
+	return rc;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_STATS_H_
+#define _LCRP_STATS_H_
+
+#include <time.h>
+
+/* Number of buckets of histograms, bucket N counts values < 2^N ns */
+#define LCRP_HIST_BUCKETS 40
+
+enum lcrp_counter {
+	/* Records received from Changelog */
+	LCRP_COUNTER_RECORDS = 0,
+	/* Records dropped by the filter of access */
+	LCRP_COUNTER_DROPPED,
+	/* FIDs linked into the epoch, i.e. missed by the FID cache */
+	LCRP_COUNTER_FIDS_LINKED,
+	/* Calls to clear Changelog */
+	LCRP_COUNTER_CLEARS,
+	/* Epoch rollovers */
+	LCRP_COUNTER_ROLLOVERS,
+	/* Files merged from epochs into inactive/all or coarser tiers */
+	LCRP_COUNTER_CLEANUP_FILES,
+	/* Epochs that have been cleaned up or merged */
+	LCRP_COUNTER_CLEANUP_EPOCHS,
+	/* Records of the backlog applied to their epochs in batches */
+	LCRP_COUNTER_DRAINED,
+	/* Records that found the queue of their worker full */
+	LCRP_COUNTER_QUEUE_FULL,
+	/* Waits of workers for works on their empty queues */
+	LCRP_COUNTER_QUEUE_EMPTY,
+	/* Switches from queueing records on workers to spilling them */
+	LCRP_COUNTER_SPILL_STARTS,
+	/* Records spilled into the spill file */
+	LCRP_COUNTER_SPILLED,
+	/* Spilled records queued on workers afterwards */
+	LCRP_COUNTER_SPILL_REPLAYED,
+	/* Switches from spilling records back to queueing them on workers */
+	LCRP_COUNTER_SPILL_ENDS,
+	LCRP_COUNTER_MAX,
+};
+
+/* Gauges of each thread, summed among all threads */
+enum lcrp_gauge {
+	/* Works queued on the worker, i.e. received but not processed */
+	LCRP_GAUGE_QUEUED_WORKS = 0,
+	/* Changelog thread is paused because the queue of a worker is full */
+	LCRP_GAUGE_PAUSED,
+	/* Spilled records that have not been queued on workers */
+	LCRP_GAUGE_SPILL_PENDING,
+	LCRP_GAUGE_MAX,
+};
+
+enum lcrp_histogram {
+	/* Nanoseconds to link a FID that missed the FID cache */
+	LCRP_HIST_LINK_FID = 0,
+	/* Nanoseconds of a Changelog clear */
+	LCRP_HIST_CLEAR,
+	/* Nanoseconds of an epoch rollover */
+	LCRP_HIST_ROLLOVER,
+	/* Nanoseconds from record time to processed */
+	LCRP_HIST_RECORD_LAG,
+	/* Nanoseconds to cleanup or merge an epoch */
+	LCRP_HIST_CLEANUP_EPOCH,
+	/* Nanoseconds to apply a batch of the backlog */
+	LCRP_HIST_DRAIN_BATCH,
+	LCRP_HIST_MAX,
+};
+
+struct lcrp_histogram_data {
+	/* Number of values in each bucket */
+	unsigned long long	lhd_buckets[LCRP_HIST_BUCKETS];
+	/* Sum of the values */
+	unsigned long long	lhd_sum;
+};
+
+/*
+ * Statistics of one thread. Only the owner thread updates it, so an
+ * update is a plain add published by a relaxed atomic store, and readers
+ * sum the blocks of all threads with relaxed atomic loads.
+ */
+struct lcrp_stats_block {
+	/* Next block in the list of all blocks */
+	struct lcrp_stats_block		*lsb_next;
+	/* Counters, indexed by enum lcrp_counter */
+	unsigned long long		 lsb_counters[LCRP_COUNTER_MAX];
+	/* Gauges, indexed by enum lcrp_gauge */
+	unsigned long long		 lsb_gauges[LCRP_GAUGE_MAX];
+	/* Histograms, indexed by enum lcrp_histogram */
+	struct lcrp_histogram_data	 lsb_hists[LCRP_HIST_MAX];
+};
+
+extern __thread struct lcrp_stats_block *lcrp_stats_local;
+
+struct lcrp_stats_block *lcrp_stats_register(void);
+int lcrp_stats_dump(const char *path);
+void lcrp_stats_fini(void);
+
+/* Statistics block of the calling thread, registered on first use */
+static inline struct lcrp_stats_block *lcrp_stats_block(void)
+{
+	if (__builtin_expect(lcrp_stats_local == NULL, 0))
+		return lcrp_stats_register();
+	return lcrp_stats_local;
+}
+
+static inline void lcrp_stats_add(enum lcrp_counter counter,
+				  unsigned long long value)
+{
+	struct lcrp_stats_block *block = lcrp_stats_block();
+
+	__atomic_store_n(&block->lsb_counters[counter],
+			 block->lsb_counters[counter] + value,
+			 __ATOMIC_RELAXED);
+}
+
+static inline void lcrp_stats_set(enum lcrp_gauge gauge,
+				  unsigned long long value)
+{
+	struct lcrp_stats_block *block = lcrp_stats_block();
+
+	__atomic_store_n(&block->lsb_gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+static inline void lcrp_stats_observe(enum lcrp_histogram hist,
+				      unsigned long long nsec)
+{
+	int bucket = 0;
+	struct lcrp_stats_block *block = lcrp_stats_block();
+	struct lcrp_histogram_data *data = &block->lsb_hists[hist];
+
+	if (nsec > 0)
+		bucket = 64 - __builtin_clzll(nsec);
+	if (bucket >= LCRP_HIST_BUCKETS)
+		bucket = LCRP_HIST_BUCKETS - 1;
+	__atomic_store_n(&data->lhd_buckets[bucket],
+			 data->lhd_buckets[bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&data->lhd_sum, data->lhd_sum + nsec,
+			 __ATOMIC_RELAXED);
+}
+
+/* Monotonic time in nanoseconds, for measuring durations */
+static inline unsigned long long lcrp_stats_nsec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+#endif /* _LCRP_STATS_H_ */
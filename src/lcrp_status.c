@@ -0,0 +1,748 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Status and config of LCRP.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+
+#include <yaml.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <limits.h>
+#include <linux/limits.h>
+#include <sys/resource.h>
+#include <lustre/lustreapi.h>
+
+#include "debug.h"
+#include "lcrp_changelog.h"
+#include "lcrp_stats.h"
+#include "lcrp_worker.h"
+#include "lcrpd.h"
+
+struct lcrp_status *lcrp_status;
+
+void lcrp_fini(void)
+{
+	struct lcrp_epoch *epoch = &lcrp_status->ls_epoch;
+	struct lcrp_inactive_thread_info *inactive;
+	struct lcrp_retired_epoch *retired;
+
+	inactive = &lcrp_status->ls_inactive_info;
+	while (inactive->liti_head != NULL) {
+		retired = inactive->liti_head;
+		inactive->liti_head = retired->lre_next;
+		free(retired);
+	}
+	pthread_cond_destroy(&inactive->liti_cond);
+	pthread_mutex_destroy(&inactive->liti_mutex);
+	if (epoch->le_index != NULL)
+		lcrp_index_close(epoch->le_index);
+	lcrp_epoch_fini(epoch);
+	free(lcrp_status);
+	lcrp_stats_fini();
+}
+
+int lcrp_init(void)
+{
+	char *cwd;
+	int rc = 0;
+	struct lcrp_epoch *epoch;
+	size_t size = sizeof(*lcrp_status);
+
+	lcrp_status = calloc(size, 1);
+	if (lcrp_status == NULL)
+		return -ENOMEM;
+
+	epoch = &lcrp_status->ls_epoch;
+
+	cwd = getcwd(lcrp_status->ls_cwd, sizeof(lcrp_status->ls_cwd));
+	if (cwd == NULL) {
+		LERROR("failed to get cwd: %s\n", strerror(errno));
+		rc = -errno;
+		goto error;
+	}
+	epoch->le_seconds = 3600;
+	lcrp_status->ls_clear_batch_records = LCRP_DEFAULT_CLEAR_BATCH_RECORDS;
+	lcrp_status->ls_clear_batch_msec = LCRP_DEFAULT_CLEAR_BATCH_MSEC;
+	lcrp_status->ls_checkpoint_records = LCRP_DEFAULT_CHECKPOINT_RECORDS;
+	lcrp_status->ls_drain_lag = LCRP_DEFAULT_DRAIN_LAG;
+	lcrp_status->ls_drain_batch_records = LCRP_DEFAULT_DRAIN_BATCH_RECORDS;
+	lcrp_status->ls_fid_cache_size = LCRP_DEFAULT_FID_CACHE_SIZE;
+	lcrp_status->ls_worker_threads = LCRP_DEFAULT_WORKER_THREADS;
+	lcrp_status->ls_worker_queue_depth = LCRP_DEFAULT_WORKER_QUEUE_DEPTH;
+	lcrp_status->ls_inflight_memory = LCRP_DEFAULT_INFLIGHT_MEMORY;
+	lcrp_status->ls_dir_fd_budget = LCRP_DEFAULT_DIR_FD_BUDGET;
+	lcrp_status->ls_io_uring = 1;
+	lcrp_status->ls_cleanup_rate = LCRP_DEFAULT_CLEANUP_RATE;
+	lcrp_status->ls_cleanup_threads = LCRP_DEFAULT_CLEANUP_THREADS;
+	lcrp_status->ls_stats_interval = LCRP_DEFAULT_STATS_INTERVAL;
+	lcrp_status->ls_fid_index = 1;
+	lcrp_status->ls_heat_half_life = LCRP_DEFAULT_HEAT_HALF_LIFE;
+	/* Record types that are not about data access are dropped */
+	lcrp_status->ls_filter.lcf_types[CL_CREATE] = true;
+	lcrp_status->ls_filter.lcf_types[CL_OPEN] = true;
+	lcrp_status->ls_filter.lcf_types[CL_CLOSE] = true;
+	lcrp_status->ls_filter.lcf_types[CL_TRUNC] = true;
+	lcrp_status->ls_filter.lcf_types[CL_MTIME] = true;
+	lcrp_status->ls_filter.lcf_types[CL_ATIME] = true;
+	lcrp_status->ls_filter.lcf_open_modes = LCRP_OPEN_MODE_ALL;
+	lcrp_status->ls_source.lsrc_ops = &lcrp_source_llapi_ops;
+	lcrp_status->ls_source.lsrc_synthetic.lsc_fids =
+		LCRP_DEFAULT_SYNTHETIC_FIDS;
+	lcrp_status->ls_source.lsrc_synthetic.lsc_zipf =
+		LCRP_DEFAULT_SYNTHETIC_ZIPF;
+	lcrp_status->ls_source.lsrc_synthetic.lsc_seed = 1;
+	lcrp_epoch_init(epoch);
+	pthread_mutex_init(&lcrp_status->ls_inactive_info.liti_mutex, NULL);
+	pthread_cond_init(&lcrp_status->ls_inactive_info.liti_cond, NULL);
+	return 0;
+error:
+	lcrp_fini();
+	return rc;
+}
+
+enum lcrp_yaml_status {
+	/* Next one should be YAML_KEY_TOKEN for key */
+	LYS_INIT = 0,
+	/* Next one should be YAML_SCALAR_TOKEN for key */
+	LYS_KEY_INITED,
+	/* Next one should be YAML_VALUE_TOKEN */
+	LYS_KEY_FINISHED,
+	/* Next one should be YAML_SCALAR_TOKEN for value */
+	LYS_VALUE_INITED,
+};
+
+static int lcrp_parse_int(const char *key, const char *value, int min,
+			  int max, int *result)
+{
+	char *end;
+	long number;
+
+	number = strtol(value, &end, 0);
+	if (*value == '\0' || *end != '\0') {
+		LERROR("invalid value of key/value [%s = %s], should be number\n",
+		       key, value);
+		return -EINVAL;
+	}
+	if (number < min) {
+		LERROR("too small value in [%s = %s], should >= %d\n",
+		       key, value, min);
+		return -EINVAL;
+	}
+	if (number > max) {
+		LERROR("too large value in [%s = %s], should <= %d\n",
+		       key, value, max);
+		return -EINVAL;
+	}
+	*result = number;
+	return 0;
+}
+
+static int lcrp_parse_ull(const char *key, const char *value,
+			  unsigned long long *result)
+{
+	char *end;
+
+	*result = strtoull(value, &end, 0);
+	if (*value == '\0' || *value == '-' || *end != '\0') {
+		LERROR("invalid value of key/value [%s = %s], should be number\n",
+		       key, value);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int lcrp_parse_double(const char *key, const char *value,
+			     double min, double max, double *result)
+{
+	char *end;
+
+	*result = strtod(value, &end);
+	if (*value == '\0' || *end != '\0') {
+		LERROR("invalid value of key/value [%s = %s], should be number\n",
+		       key, value);
+		return -EINVAL;
+	}
+	if (*result < min || *result > max) {
+		LERROR("value in [%s = %s] is out of range [%g, %g]\n",
+		       key, value, min, max);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int lcrp_str2type(const char *name)
+{
+	int type;
+	const char *type_name;
+
+	for (type = 0; type < CL_LAST; type++) {
+		type_name = changelog_type2str(type);
+		if (type_name != NULL && strcasecmp(type_name, name) == 0)
+			return type;
+	}
+	return -1;
+}
+
+/*
+ * Parse weights of record types, e.g. "OPEN:60,CLOSE:30,CREAT:10"
+ */
+static int lcrp_parse_type_weights(const char *key, const char *value,
+				   unsigned int *weights)
+{
+	int type;
+	char *end;
+	char *name;
+	char *weight;
+	char *saveptr;
+	char buf[PATH_MAX + 1];
+
+	snprintf(buf, sizeof(buf), "%s", value);
+	memset(weights, 0, sizeof(*weights) * CL_LAST);
+	for (name = strtok_r(buf, ",", &saveptr); name != NULL;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		weight = strchr(name, ':');
+		if (weight == NULL) {
+			LERROR("missing weight of [%s] in [%s = %s]\n",
+			       name, key, value);
+			return -EINVAL;
+		}
+		*weight = '\0';
+		weight++;
+
+		type = lcrp_str2type(name);
+		if (type < 0) {
+			LERROR("unknown record type [%s] in [%s = %s]\n",
+			       name, key, value);
+			return -EINVAL;
+		}
+
+		weights[type] = strtoul(weight, &end, 0);
+		if (*weight == '\0' || *end != '\0') {
+			LERROR("invalid weight [%s] in [%s = %s]\n",
+			       weight, key, value);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Parse list of record types, e.g. "OPEN,CLOSE,CREAT", or "all"
+ */
+static int lcrp_parse_types(const char *key, const char *value, bool *types)
+{
+	int type;
+	char *name;
+	char *saveptr;
+	char buf[PATH_MAX + 1];
+
+	snprintf(buf, sizeof(buf), "%s", value);
+	memset(types, 0, sizeof(*types) * CL_LAST);
+	for (name = strtok_r(buf, ", \t", &saveptr); name != NULL;
+	     name = strtok_r(NULL, ", \t", &saveptr)) {
+		if (strcasecmp(name, "all") == 0) {
+			for (type = 0; type < CL_LAST; type++)
+				types[type] = true;
+			continue;
+		}
+
+		type = lcrp_str2type(name);
+		if (type < 0) {
+			LERROR("unknown record type [%s] in [%s = %s]\n",
+			       name, key, value);
+			return -EINVAL;
+		}
+		types[type] = true;
+	}
+	return 0;
+}
+
+/*
+ * Parse open modes in the format of "lfs changelog", e.g. "rw"
+ */
+static int lcrp_parse_open_modes(const char *key, const char *value,
+				 unsigned int *modes)
+{
+	const char *mode;
+
+	*modes = 0;
+	for (mode = value; *mode != '\0'; mode++) {
+		switch (*mode) {
+		case 'r':
+			*modes |= LCRP_OPEN_MODE_READ;
+			break;
+		case 'w':
+			*modes |= LCRP_OPEN_MODE_WRITE;
+			break;
+		case 'x':
+			*modes |= LCRP_OPEN_MODE_EXEC;
+			break;
+		default:
+			LERROR("unknown open mode [%c] in [%s = %s]\n",
+			       *mode, key, value);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int lcrp_set_path(const char *key, const char *value, char *path,
+			 size_t size)
+{
+	if (strlen(value) + 1 > size) {
+		LERROR("value of key/value [%s = %s] is too long\n",
+		       key, value);
+		return -EINVAL;
+	}
+	strcpy(path, value);
+	return 0;
+}
+
+/*
+ * Parse list of MDT devices, e.g. "lustre-MDT0000,lustre-MDT0001"
+ */
+static int lcrp_parse_mdt_devices(const char *key, const char *value)
+{
+	int i;
+	char *name;
+	char *saveptr;
+	char buf[PATH_MAX + 1];
+	struct lcrp_changelog_thread_info *info;
+
+	snprintf(buf, sizeof(buf), "%s", value);
+	lcrp_status->ls_mdt_count = 0;
+	for (name = strtok_r(buf, ", \t", &saveptr); name != NULL;
+	     name = strtok_r(NULL, ", \t", &saveptr)) {
+		if (strlen(name) + 1 > sizeof(info->lcti_mdt_device)) {
+			LERROR("MDT device [%s] in [%s = %s] is too long\n",
+			       name, key, value);
+			return -EINVAL;
+		}
+
+		for (i = 0; i < lcrp_status->ls_mdt_count; i++) {
+			info = &lcrp_status->ls_changelog_infos[i];
+			if (strcmp(info->lcti_mdt_device, name) == 0) {
+				LERROR("duplicated MDT device [%s] in [%s = %s]\n",
+				       name, key, value);
+				return -EINVAL;
+			}
+		}
+
+		if (lcrp_status->ls_mdt_count >= LCRP_MAX_MDTS) {
+			LERROR("too many MDT devices in [%s = %s], should <= %d\n",
+			       key, value, LCRP_MAX_MDTS);
+			return -EINVAL;
+		}
+
+		i = lcrp_status->ls_mdt_count++;
+		info = &lcrp_status->ls_changelog_infos[i];
+		strcpy(info->lcti_mdt_device, name);
+	}
+	return 0;
+}
+
+int lcrp_set_key_value(const char *key, const char *value)
+{
+	int rc;
+	int number;
+	char *end;
+	struct lcrp_epoch *epoch = &lcrp_status->ls_epoch;
+	struct lcrp_tiers *tiers = &lcrp_status->ls_tiers;
+	struct lcrp_source *source = &lcrp_status->ls_source;
+	struct lcrp_synthetic_config *synthetic = &source->lsrc_synthetic;
+
+	if (strcmp(key, LCRP_STR_CHANGELOG_USER) == 0) {
+		if (strlen(value) + 1 >
+		    sizeof(lcrp_status->ls_changelog_user)) {
+			LERROR("value of key/value [%s = %s] is too long\n",
+			       key, value);
+			return -EINVAL;
+		}
+
+		strcpy(lcrp_status->ls_changelog_user, value);
+	} else if (strcmp(key, LCRP_STR_LCRP_DIR) == 0) {
+		if (strlen(value) + 1 >
+		    sizeof(lcrp_status->ls_dir_access_history)) {
+			LERROR("value of key/value [%s = %s] is too long\n",
+			       key, value);
+			return -EINVAL;
+		}
+
+		strcpy(lcrp_status->ls_dir_access_history, value);
+	} else if (strcmp(key, LCRP_STR_MDT_DEVICE) == 0) {
+		return lcrp_parse_mdt_devices(key, value);
+	}  else if (strcmp(key, LCRP_STR_EPOCH_INTERVAL) == 0) {
+		epoch->le_seconds = strtoul(value, &end, 0);
+		if (*end != '\0') {
+			LERROR("invalid value of key/value [%s = %s], should be number\n",
+			       key, value, LCRP_MIN_EPOCH_INTERVAL);
+			return -EINVAL;
+		}
+		if (epoch->le_seconds < LCRP_MIN_EPOCH_INTERVAL) {
+			LERROR("too small epoch interval in [%s = %s], should >= %d\n",
+			       key, value, LCRP_MIN_EPOCH_INTERVAL);
+			return -EINVAL;
+		}
+		if (epoch->le_seconds > LCRP_MAX_EPOCH_INTERVAL) {
+			LERROR("too large epoch interval in [%s = %s], should <= %d\n",
+			       key, value, LCRP_MAX_EPOCH_INTERVAL);
+			return -EINVAL;
+		}
+	} else if (strcmp(key, LCRP_STR_CLEAR_BATCH_RECORDS) == 0) {
+		return lcrp_parse_int(key, value, 1,
+				      LCRP_MAX_CLEAR_BATCH_RECORDS,
+				      &lcrp_status->ls_clear_batch_records);
+	} else if (strcmp(key, LCRP_STR_CLEAR_BATCH_MSEC) == 0) {
+		return lcrp_parse_int(key, value, 0, LCRP_MAX_CLEAR_BATCH_MSEC,
+				      &lcrp_status->ls_clear_batch_msec);
+	} else if (strcmp(key, LCRP_STR_CHECKPOINT_RECORDS) == 0) {
+		return lcrp_parse_int(key, value, 0,
+				      LCRP_MAX_CHECKPOINT_RECORDS,
+				      &lcrp_status->ls_checkpoint_records);
+	} else if (strcmp(key, LCRP_STR_DRAIN_LAG) == 0) {
+		return lcrp_parse_int(key, value, 0, LCRP_MAX_DRAIN_LAG,
+				      &lcrp_status->ls_drain_lag);
+	} else if (strcmp(key, LCRP_STR_DRAIN_BATCH_RECORDS) == 0) {
+		return lcrp_parse_int(key, value, 1,
+				      LCRP_MAX_DRAIN_BATCH_RECORDS,
+				      &lcrp_status->ls_drain_batch_records);
+	} else if (strcmp(key, LCRP_STR_FID_CACHE_SIZE) == 0) {
+		return lcrp_parse_int(key, value, 0, LCRP_MAX_FID_CACHE_SIZE,
+				      &lcrp_status->ls_fid_cache_size);
+	} else if (strcmp(key, LCRP_STR_WORKER_THREADS) == 0) {
+		return lcrp_parse_int(key, value, 0, LCRP_MAX_WORKER_THREADS,
+				      &lcrp_status->ls_worker_threads);
+	} else if (strcmp(key, LCRP_STR_WORKER_QUEUE_DEPTH) == 0) {
+		return lcrp_parse_int(key, value, 1,
+				      LCRP_MAX_WORKER_QUEUE_DEPTH,
+				      &lcrp_status->ls_worker_queue_depth);
+	} else if (strcmp(key, LCRP_STR_INFLIGHT_MEMORY) == 0) {
+		return lcrp_parse_int(key, value, LCRP_MIN_INFLIGHT_MEMORY,
+				      LCRP_MAX_INFLIGHT_MEMORY,
+				      &lcrp_status->ls_inflight_memory);
+	} else if (strcmp(key, LCRP_STR_INFLIGHT_POLICY) == 0) {
+		if (strcmp(value, LCRP_INFLIGHT_PAUSE) == 0) {
+			lcrp_status->ls_inflight_spill = false;
+		} else if (strcmp(value, LCRP_INFLIGHT_SPILL) == 0) {
+			lcrp_status->ls_inflight_spill = true;
+		} else {
+			LERROR("invalid [%s = %s], should be [%s] or [%s]\n",
+			       key, value, LCRP_INFLIGHT_PAUSE,
+			       LCRP_INFLIGHT_SPILL);
+			return -EINVAL;
+		}
+		return 0;
+	} else if (strcmp(key, LCRP_STR_DIR_FD_BUDGET) == 0) {
+		return lcrp_parse_int(key, value, 0, LCRP_MAX_DIR_FD_BUDGET,
+				      &lcrp_status->ls_dir_fd_budget);
+	} else if (strcmp(key, LCRP_STR_IO_URING) == 0) {
+		return lcrp_parse_int(key, value, 0, 1,
+				      &lcrp_status->ls_io_uring);
+	} else if (strcmp(key, LCRP_STR_CLEANUP_RATE) == 0) {
+		return lcrp_parse_int(key, value, 0, LCRP_MAX_CLEANUP_RATE,
+				      &lcrp_status->ls_cleanup_rate);
+	} else if (strcmp(key, LCRP_STR_ACCESS_TYPES) == 0) {
+		return lcrp_parse_types(key, value,
+					lcrp_status->ls_filter.lcf_types);
+	} else if (strcmp(key, LCRP_STR_ACCESS_OPEN_MODES) == 0) {
+		return lcrp_parse_open_modes(key, value,
+				&lcrp_status->ls_filter.lcf_open_modes);
+	} else if (strcmp(key, LCRP_STR_CLEANUP_THREADS) == 0) {
+		return lcrp_parse_int(key, value, 1, LCRP_MAX_WORKER_THREADS,
+				      &lcrp_status->ls_cleanup_threads);
+	} else if (strcmp(key, LCRP_STR_STATS_INTERVAL) == 0) {
+		return lcrp_parse_int(key, value, 0, LCRP_MAX_STATS_INTERVAL,
+				      &lcrp_status->ls_stats_interval);
+	} else if (strcmp(key, LCRP_STR_FID_INDEX) == 0) {
+		return lcrp_parse_int(key, value, 0, 1,
+				      &lcrp_status->ls_fid_index);
+	} else if (strcmp(key, LCRP_STR_TIERS) == 0) {
+		rc = lcrp_tiers_parse(tiers, key, value);
+		if (rc)
+			return rc;
+		/* The first tier is active, whose duration is the epoch */
+		epoch->le_seconds = tiers->lts_tiers[0].lt_seconds;
+		if (epoch->le_seconds < LCRP_MIN_EPOCH_INTERVAL ||
+		    epoch->le_seconds > LCRP_MAX_EPOCH_INTERVAL) {
+			LERROR("duration of active in [%s = %s] is out of range [%d, %d]\n",
+			       key, value, LCRP_MIN_EPOCH_INTERVAL,
+			       LCRP_MAX_EPOCH_INTERVAL);
+			return -EINVAL;
+		}
+	} else if (strcmp(key, LCRP_STR_HEAT_HALF_LIFE) == 0) {
+		return lcrp_parse_int(key, value, 0, LCRP_MAX_HEAT_HALF_LIFE,
+				      &lcrp_status->ls_heat_half_life);
+	} else if (strcmp(key, LCRP_STR_CHANGELOG_SOURCE) == 0) {
+		return lcrp_source_init(source, value);
+	} else if (strcmp(key, LCRP_STR_SOURCE_RATE) == 0) {
+		rc = lcrp_parse_int(key, value, 0, LCRP_MAX_SOURCE_RATE,
+				    &number);
+		source->lsrc_rate = number;
+		return rc;
+	} else if (strcmp(key, LCRP_STR_SYNTHETIC_FIDS) == 0) {
+		rc = lcrp_parse_int(key, value, 1, LCRP_MAX_SYNTHETIC_FIDS,
+				    &number);
+		synthetic->lsc_fids = number;
+		return rc;
+	} else if (strcmp(key, LCRP_STR_SYNTHETIC_ZIPF) == 0) {
+		return lcrp_parse_double(key, value, 0, LCRP_MAX_SYNTHETIC_ZIPF,
+					 &synthetic->lsc_zipf);
+	} else if (strcmp(key, LCRP_STR_SYNTHETIC_TYPES) == 0) {
+		return lcrp_parse_type_weights(key, value,
+					       synthetic->lsc_type_weights);
+	} else if (strcmp(key, LCRP_STR_SYNTHETIC_RECORDS) == 0) {
+		return lcrp_parse_ull(key, value, &synthetic->lsc_records);
+	} else if (strcmp(key, LCRP_STR_SYNTHETIC_SEED) == 0) {
+		rc = lcrp_parse_int(key, value, 0, INT_MAX, &number);
+		synthetic->lsc_seed = number;
+		return rc;
+	} else if (strcmp(key, LCRP_STR_REPLAY_FILE) == 0) {
+		return lcrp_set_path(key, value, source->lsrc_replay_file,
+				     sizeof(source->lsrc_replay_file));
+	} else if (strcmp(key, LCRP_STR_TRACE_FILE) == 0) {
+		return lcrp_set_path(key, value, source->lsrc_trace_file,
+				     sizeof(source->lsrc_trace_file));
+	} else {
+		LERROR("unknown key %s\n", key);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int lcrp_config_load(const char *config_fpath)
+{
+	int rc = 0;
+	char *scalar;
+	FILE *config;
+	yaml_token_t token;
+	yaml_parser_t parser;
+	char key[PATH_MAX + 1];
+	char value[PATH_MAX + 1];
+	enum lcrp_yaml_status yaml_status = LYS_INIT;
+
+	config = fopen(config_fpath, "rb");
+	if (config == NULL) {
+		LERROR("failed to open [%s]: %s", config_fpath,
+		       strerror(errno));
+		return -errno;
+	}
+
+	yaml_parser_initialize(&parser);
+	yaml_parser_set_input_file(&parser, config);
+	while (rc == 0) {
+		yaml_parser_scan(&parser, &token);
+		if (token.type == YAML_NO_TOKEN)
+			break;
+		switch (token.type) {
+		case YAML_KEY_TOKEN:
+			if (yaml_status != LYS_INIT) {
+				LERROR("unexpected YAML status [%d], expected [%d]\n",
+				       yaml_status, LYS_INIT);
+				rc = -EINVAL;
+				break;
+			}
+			yaml_status = LYS_KEY_INITED;
+			break;
+		case YAML_VALUE_TOKEN:
+			if (yaml_status != LYS_KEY_FINISHED) {
+				LERROR("unexpected YAML status [%d], expected [%d]\n",
+				       yaml_status, LYS_KEY_FINISHED);
+				rc = -EINVAL;
+				break;
+			}
+			yaml_status = LYS_VALUE_INITED;
+			break;
+		case YAML_SCALAR_TOKEN:
+			scalar = (char *)token.data.scalar.value;
+			if (yaml_status != LYS_KEY_INITED &&
+			    yaml_status != LYS_VALUE_INITED) {
+				LERROR("unexpected YAML status [%d], expected [%d] or [%d]\n",
+				       yaml_status, LYS_KEY_FINISHED,
+				       LYS_VALUE_INITED);
+				rc = -EINVAL;
+			} else if (yaml_status == LYS_KEY_INITED) {
+				if (strlen(scalar) + 1 > sizeof(key)) {
+					LERROR("key [%s] is too long\n",
+					       token.data.scalar.value);
+					rc = -EINVAL;
+					break;
+				}
+				strcpy(key, scalar);
+				yaml_status = LYS_KEY_FINISHED;
+			} else {
+				if (strlen(scalar) + 1 > sizeof(value)) {
+					LERROR("value [%s] is too long\n",
+					       token.data.scalar.value);
+					rc = -EINVAL;
+					break;
+				}
+				strcpy(value, scalar);
+				rc = lcrp_set_key_value(key, value);
+				if (rc) {
+					LERROR("failed to set key/value pair [%s = %s]\n",
+					       key, value);
+					rc = -EINVAL;
+					break;
+				}
+				yaml_status = LYS_INIT;
+			}
+			break;
+		default:
+			break;
+		}
+		yaml_token_delete(&token);
+	}
+	yaml_parser_delete(&parser);
+
+	fclose(config);
+	return rc;
+}
+
+int lcrp_thread_stop(struct lcrp_thread_info *info)
+{
+	int rc;
+
+	if (!info->lti_started)
+		return 0;
+
+	info->lti_stopping = true;
+
+	rc = pthread_join(info->lti_thread_id, NULL);
+	if (rc) {
+		LERROR("failed to join thread [%d]\n",
+		       info->lti_thread_id);
+	}
+	return rc;
+}
+
+int lcrp_thread_start(struct lcrp_thread_info *info,
+			     void *(*start_routine)(void *),
+			     void *private_info)
+{
+	int rc;
+	int ret;
+	pthread_attr_t attr;
+
+	rc = pthread_attr_init(&attr);
+	if (rc) {
+		LERROR("failed to set pthread attribute\n");
+		return rc;
+	}
+
+	rc = pthread_create(&info->lti_thread_id, &attr,
+			    start_routine, private_info);
+	if (rc == 0)
+		info->lti_started = true;
+
+	ret = pthread_attr_destroy(&attr);
+	if (ret) {
+		LERROR("failed to destroy thread attribute\n");
+		if (rc == 0)
+			rc = ret;
+	}
+
+	if (rc) {
+		ret = lcrp_thread_stop(info);
+		if (ret)
+			LERROR("failed to stop thread\n");
+	}
+	return rc;
+}
+
+/*
+ * Raise the limit of open files so that the directory caches can keep
+ * ls_dir_fd_budget fds open, shrink the budget if the limit is too low.
+ */
+int lcrp_fd_limit_init(void)
+{
+	int rc;
+	struct rlimit limit;
+	rlim_t wanted = (rlim_t)lcrp_status->ls_dir_fd_budget +
+		LCRP_FD_RESERVED;
+
+	rc = getrlimit(RLIMIT_NOFILE, &limit);
+	if (rc) {
+		LERROR("failed to get limit of open files: %s\n",
+		       strerror(errno));
+		return -errno;
+	}
+
+	if (limit.rlim_cur >= wanted)
+		return 0;
+
+	limit.rlim_cur = limit.rlim_max < wanted ? limit.rlim_max : wanted;
+	rc = setrlimit(RLIMIT_NOFILE, &limit);
+	if (rc) {
+		LERROR("failed to set limit of open files to [%llu]: %s\n",
+		       (unsigned long long)limit.rlim_cur, strerror(errno));
+		return -errno;
+	}
+
+	if (limit.rlim_cur < wanted) {
+		if (limit.rlim_cur > LCRP_FD_RESERVED)
+			lcrp_status->ls_dir_fd_budget = limit.rlim_cur -
+				LCRP_FD_RESERVED;
+		else
+			lcrp_status->ls_dir_fd_budget = 0;
+		LWARN("limit of open files is [%llu], shrinking [%s] to [%d]\n",
+		      (unsigned long long)limit.rlim_cur,
+		      LCRP_STR_DIR_FD_BUDGET, lcrp_status->ls_dir_fd_budget);
+	}
+	return 0;
+}
+
+/*
+ * Return the number of directory fds each reader of epoch can keep open
+ */
+int lcrp_reader_fd_budget(int workers)
+{
+	int readers = lcrp_status->ls_mdt_count;
+
+	if (readers < 1)
+		readers = 1;
+	if (workers > 0)
+		readers *= workers;
+	return lcrp_status->ls_dir_fd_budget / readers;
+}
+
+/*
+ * Return the number of records that can be queued on each worker of a
+ * Changelog thread, so that the queues of all its workers fit in
+ * ls_inflight_memory
+ */
+int lcrp_worker_queue_depth(int workers)
+{
+	int depth = lcrp_status->ls_worker_queue_depth;
+	int limit;
+
+	limit = lcrp_status->ls_inflight_memory / sizeof(struct lcrp_work) /
+		workers;
+	if (limit < 1)
+		limit = 1;
+	if (depth > limit)
+		depth = limit;
+	return depth;
+}
+
+/*
+ * Return the path that the spill files of the workers of the source are
+ * named after, NULL to pause instead of spilling when their queues are
+ * full
+ */
+const char *lcrp_spill_file(struct lcrp_source *source, char *buffer,
+			    int size)
+{
+	const char *name = source->lsrc_mdt_device;
+
+	if (!lcrp_status->ls_inflight_spill)
+		return NULL;
+	/* Other sources than llapi do not have MDT */
+	if (name == NULL || name[0] == '\0')
+		name = source->lsrc_ops->lsop_name;
+	snprintf(buffer, size, "%s/%s", lcrp_status->ls_dir_spill, name);
+	return buffer;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Tiers of the access history, shared by lcrpd and queries.
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/limits.h>
+
+#include "debug.h"
+#include "lcrp_tier.h"
+
+static void lcrp_tier_name(struct lcrp_tier *tier, int index)
+{
+	if (index == 0)
+		snprintf(tier->lt_name, sizeof(tier->lt_name), "active");
+	else if (index == 1)
+		snprintf(tier->lt_name, sizeof(tier->lt_name), "secondary");
+	else
+		snprintf(tier->lt_name, sizeof(tier->lt_name), "tier%d",
+			 index);
+}
+
+/*
+ * Active and secondary of the same interval, then inactive
+ */
+void lcrp_tiers_default(struct lcrp_tiers *tiers, int interval)
+{
+	int i;
+
+	tiers->lts_count = 2;
+	for (i = 0; i < tiers->lts_count; i++) {
+		lcrp_tier_name(&tiers->lts_tiers[i], i);
+		tiers->lts_tiers[i].lt_seconds = interval;
+	}
+}
+
+/*
+ * Parse a duration with an optional unit, e.g. "3600", "6h" or "7d"
+ */
+static int lcrp_tier_parse_seconds(const char *string, int *seconds)
+{
+	char *end;
+	long number;
+	long unit;
+
+	number = strtol(string, &end, 0);
+	if (end == string || number <= 0)
+		return -EINVAL;
+
+	switch (*end) {
+	case '\0':
+	case 's':
+		unit = 1;
+		break;
+	case 'm':
+		unit = 60;
+		break;
+	case 'h':
+		unit = 3600;
+		break;
+	case 'd':
+		unit = 86400;
+		break;
+	case 'w':
+		unit = 604800;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (*end != '\0' && end[1] != '\0')
+		return -EINVAL;
+	if (number > INT_MAX / unit)
+		return -ERANGE;
+	*seconds = number * unit;
+	return 0;
+}
+
+/*
+ * Parse durations of the tiers from active to the oldest, e.g.
+ * "1h,6h,1d,7d". Each duration should be a multiple of the previous one,
+ * so that a directory is merged into exactly one of the next tier.
+ */
+int lcrp_tiers_parse(struct lcrp_tiers *tiers, const char *key,
+		     const char *value)
+{
+	int rc;
+	int seconds;
+	int previous = 0;
+	char *name;
+	char *saveptr;
+	char buf[PATH_MAX + 1];
+	struct lcrp_tier *tier;
+
+	snprintf(buf, sizeof(buf), "%s", value);
+	tiers->lts_count = 0;
+	for (name = strtok_r(buf, ", \t", &saveptr); name != NULL;
+	     name = strtok_r(NULL, ", \t", &saveptr)) {
+		if (tiers->lts_count >= LCRP_MAX_TIERS) {
+			LERROR("too many tiers in [%s = %s], should <= %d\n",
+			       key, value, LCRP_MAX_TIERS);
+			return -EINVAL;
+		}
+
+		rc = lcrp_tier_parse_seconds(name, &seconds);
+		if (rc) {
+			LERROR("invalid duration [%s] in [%s = %s]\n",
+			       name, key, value);
+			return rc;
+		}
+
+		if (previous > 0 && seconds % previous != 0) {
+			LERROR("duration [%s] in [%s = %s] is not a multiple of the previous one\n",
+			       name, key, value);
+			return -EINVAL;
+		}
+
+		tier = &tiers->lts_tiers[tiers->lts_count];
+		lcrp_tier_name(tier, tiers->lts_count);
+		tier->lt_seconds = seconds;
+		tiers->lts_count++;
+		previous = seconds;
+	}
+
+	if (tiers->lts_count == 0) {
+		LERROR("no tier in [%s = %s]\n", key, value);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Save the tiers into a file, one tier per line in the format of
+ * "$NAME $SECONDS"
+ */
+int lcrp_tiers_save(const struct lcrp_tiers *tiers, const char *path)
+{
+	int i;
+	int rc;
+	FILE *fp;
+	char tmp[PATH_MAX + 1];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		LERROR("failed to open [%s]: %s\n", tmp, strerror(errno));
+		return -errno;
+	}
+	for (i = 0; i < tiers->lts_count; i++)
+		fprintf(fp, "%s %d\n", tiers->lts_tiers[i].lt_name,
+			tiers->lts_tiers[i].lt_seconds);
+	rc = fclose(fp);
+	if (rc) {
+		LERROR("failed to write [%s]: %s\n", tmp, strerror(errno));
+		return -errno;
+	}
+
+	rc = rename(tmp, path);
+	if (rc) {
+		LERROR("failed to rename [%s] to [%s]: %s\n", tmp, path,
+		       strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Load the tiers saved by lcrp_tiers_save(). Return -ENOENT if the file
+ * does not exist.
+ */
+int lcrp_tiers_load(struct lcrp_tiers *tiers, const char *path)
+{
+	int rc = 0;
+	FILE *fp;
+	struct lcrp_tier *tier;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			LERROR("failed to open [%s]: %s\n", path,
+			       strerror(errno));
+		return -errno;
+	}
+
+	tiers->lts_count = 0;
+	while (tiers->lts_count < LCRP_MAX_TIERS) {
+		tier = &tiers->lts_tiers[tiers->lts_count];
+		if (fscanf(fp, "%31s %d", tier->lt_name,
+			   &tier->lt_seconds) != 2)
+			break;
+		if (tier->lt_seconds <= 0) {
+			rc = -EINVAL;
+			break;
+		}
+		tiers->lts_count++;
+	}
+	/* Nothing but spaces should be left */
+	if (tiers->lts_count == 0 || fscanf(fp, " %*s") != EOF)
+		rc = -EINVAL;
+	fclose(fp);
+
+	if (rc)
+		LERROR("invalid tiers in [%s]\n", path);
+	return rc;
+}
+
+/*
+ * Return the tier that a directory ending at end belongs to, no earlier
+ * than from. Return lts_count if it is inactive.
+ */
+int lcrp_tier_locate(const struct lcrp_tiers *tiers, int active_start,
+		     int from, int end)
+{
+	int i;
+	int boundary = active_start;
+
+	for (i = 0; i < tiers->lts_count; i++) {
+		if (i > 0)
+			boundary -= tiers->lts_tiers[i].lt_seconds;
+		if (i >= from && end > boundary)
+			return i;
+	}
+	return tiers->lts_count;
+}
+
+/*
+ * Return the start of the directory in the tier to merge an epoch
+ * starting at start into
+ */
+int lcrp_tier_bucket(const struct lcrp_tiers *tiers, int tier, int start)
+{
+	int seconds = tiers->lts_tiers[tier].lt_seconds;
+
+	return start / seconds * seconds;
+}
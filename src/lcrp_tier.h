@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_TIER_H_
+#define _LCRP_TIER_H_
+
+/* Maximum number of tiers, including active */
+#define LCRP_MAX_TIERS 8
+/* Maximum length of the directory name of a tier */
+#define LCRP_TIER_NAMELEN 32
+/* File under lcrp_dir that saves the tiers for queries */
+#define LCRP_NAME_TIERS "tiers"
+
+/*
+ * A tier holds the epoch directories that ended in a window of time. The
+ * window of active is the current epoch, and the window of each following
+ * tier is lt_seconds before the window of the previous one. Directories
+ * older than the last tier are inactive.
+ *
+ * Epochs entering a tier are merged into directories aligned to the
+ * lt_seconds of the tier, so each tier has at most two directories.
+ */
+struct lcrp_tier {
+	/* Directory name of the tier under lcrp_dir */
+	char	lt_name[LCRP_TIER_NAMELEN];
+	/* Seconds of each directory of the tier, and of its window */
+	int	lt_seconds;
+};
+
+struct lcrp_tiers {
+	/* Number of tiers, 0 if not configured */
+	int			lts_count;
+	/* Tiers from active to the oldest */
+	struct lcrp_tier	lts_tiers[LCRP_MAX_TIERS];
+};
+
+void lcrp_tiers_default(struct lcrp_tiers *tiers, int interval);
+int lcrp_tiers_parse(struct lcrp_tiers *tiers, const char *key,
+		     const char *value);
+int lcrp_tiers_save(const struct lcrp_tiers *tiers, const char *path);
+int lcrp_tiers_load(struct lcrp_tiers *tiers, const char *path);
+int lcrp_tier_locate(const struct lcrp_tiers *tiers, int active_start,
+		     int from, int end);
+int lcrp_tier_bucket(const struct lcrp_tiers *tiers, int tier, int start);
+#endif /* _LCRP_TIER_H_ */
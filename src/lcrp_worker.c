@@ -0,0 +1,652 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "lcrp_stats.h"
+#include "lcrp_worker.h"
+
+/*
+ * Wait until any work is queued, return the number of queued works, 0 if
+ * the worker should stop
+ */
+static unsigned long long lcrp_worker_wait_work(struct lcrp_worker *worker)
+{
+	unsigned long long count;
+
+	count = __atomic_load_n(&worker->lwk_tail, __ATOMIC_ACQUIRE) -
+		worker->lwk_head;
+	if (count > 0)
+		return count;
+
+	lcrp_stats_add(LCRP_COUNTER_QUEUE_EMPTY, 1);
+	lcrp_stats_set(LCRP_GAUGE_QUEUED_WORKS, 0);
+	pthread_mutex_lock(&worker->lwk_mutex);
+	/* Either the Changelog thread sees lwk_idle, or this sees the tail */
+	__atomic_store_n(&worker->lwk_idle, true, __ATOMIC_SEQ_CST);
+	while (true) {
+		count = __atomic_load_n(&worker->lwk_tail, __ATOMIC_SEQ_CST) -
+			worker->lwk_head;
+		if (count > 0 || worker->lwk_general.lti_stopping)
+			break;
+		pthread_cond_wait(&worker->lwk_cond_work, &worker->lwk_mutex);
+	}
+	__atomic_store_n(&worker->lwk_idle, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&worker->lwk_mutex);
+	return count;
+}
+
+/* Wake up the Changelog thread if it is waiting for this worker */
+static void lcrp_worker_wake_done(struct lcrp_worker *worker)
+{
+	if (!__atomic_load_n(&worker->lwk_blocked, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&worker->lwk_mutex);
+	pthread_cond_broadcast(&worker->lwk_cond_done);
+	pthread_mutex_unlock(&worker->lwk_mutex);
+}
+
+/*
+ * Add the accesses of the works to the heat of their FIDs. Heat counts
+ * every access, even the ones in the FID cache.
+ */
+static int lcrp_worker_heat(struct lcrp_worker *worker,
+			    struct lcrp_work **works, int count)
+{
+	int i;
+	int rc;
+	int start;
+	struct lcrp_epoch *epoch = worker->lwk_reader.ler_epoch;
+	struct lcrp_index *index = epoch->le_index;
+
+	if (index == NULL || index->li_half_life == 0)
+		return 0;
+
+	start = __atomic_load_n(&epoch->le_start, __ATOMIC_RELAXED);
+	for (i = 0; i < count; i++) {
+		rc = lcrp_index_heat(index, &works[i]->lw_fid, start,
+				     works[i]->lw_time >> 30);
+		if (rc) {
+			LERROR("failed to update heat of fid "DFID"\n",
+			       PFID(&works[i]->lw_fid));
+			return rc;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Queued works are taken in batches, so that their FIDs are linked by one
+ * batch of operations
+ */
+static void *lcrp_worker_thread(void *arg)
+{
+	int i;
+	int rc;
+	int count;
+	unsigned long long queued;
+	struct lu_fid fids[LCRP_LINK_BATCH];
+	struct lcrp_work *works[LCRP_LINK_BATCH];
+	struct lcrp_worker *worker = arg;
+	struct lcrp_worker_pool *pool = worker->lwk_pool;
+	struct lcrp_thread_info *general = &worker->lwk_general;
+
+	while (true) {
+		queued = lcrp_worker_wait_work(worker);
+		if (queued == 0)
+			break;
+		lcrp_stats_set(LCRP_GAUGE_QUEUED_WORKS, queued);
+
+		count = queued < LCRP_LINK_BATCH ? queued : LCRP_LINK_BATCH;
+		for (i = 0; i < count; i++) {
+			works[i] = &worker->lwk_works[(worker->lwk_head + i) %
+						      pool->lwp_depth];
+			fids[i] = works[i]->lw_fid;
+		}
+
+		rc = lcrp_worker_heat(worker, works, count);
+		if (rc == 0)
+			rc = lcrp_update_fids(pool->lwp_dir_fid,
+					      &worker->lwk_reader, fids, count);
+		__atomic_store_n(&worker->lwk_syscall_count,
+				 lcrp_syscall_count, __ATOMIC_RELAXED);
+		if (rc) {
+			LERROR("failed to update access of [%d] fids of records %llu-%llu\n",
+			       count, works[0]->lw_index,
+			       works[count - 1]->lw_index);
+			/* Keep the works so that their records are never cleared */
+			__atomic_store_n(&worker->lwk_error, rc,
+					 __ATOMIC_SEQ_CST);
+			pthread_mutex_lock(&worker->lwk_mutex);
+			pthread_cond_broadcast(&worker->lwk_cond_done);
+			pthread_mutex_unlock(&worker->lwk_mutex);
+			break;
+		}
+		for (i = 0; i < count; i++)
+			lcrp_changelog_record_done(&worker->lwk_reader,
+						   works[i]->lw_time);
+
+		/* The slots can be reused by the Changelog thread from now */
+		__atomic_store_n(&worker->lwk_head, worker->lwk_head + count,
+				 __ATOMIC_SEQ_CST);
+		lcrp_worker_wake_done(worker);
+		/* Make the statistics visible while the worker is idle */
+		if (queued == count)
+			lcrp_epoch_reader_flush(&worker->lwk_reader);
+	}
+	lcrp_stats_set(LCRP_GAUGE_QUEUED_WORKS, 0);
+	pthread_mutex_lock(&worker->lwk_mutex);
+	general->lti_stopped = true;
+	pthread_mutex_unlock(&worker->lwk_mutex);
+	return NULL;
+}
+
+static void lcrp_worker_stop(struct lcrp_worker *worker)
+{
+	int rc;
+
+	pthread_mutex_lock(&worker->lwk_mutex);
+	worker->lwk_general.lti_stopping = true;
+	pthread_cond_broadcast(&worker->lwk_cond_work);
+	pthread_mutex_unlock(&worker->lwk_mutex);
+
+	rc = lcrp_thread_stop(&worker->lwk_general);
+	if (rc)
+		LERROR("failed to stop worker thread\n");
+}
+
+void lcrp_worker_pool_fini(struct lcrp_worker_pool *pool)
+{
+	int i;
+	struct lcrp_worker *worker;
+
+	if (pool->lwp_workers == NULL)
+		return;
+
+	for (i = 0; i < pool->lwp_count; i++) {
+		worker = &pool->lwp_workers[i];
+		lcrp_worker_stop(worker);
+		lcrp_epoch_reader_fini(&worker->lwk_reader);
+		pthread_cond_destroy(&worker->lwk_cond_done);
+		pthread_cond_destroy(&worker->lwk_cond_work);
+		pthread_mutex_destroy(&worker->lwk_mutex);
+		free(worker->lwk_works);
+		if (worker->lwk_spill != NULL) {
+			if (worker->lwk_spill->lsp_fd >= 0) {
+				close(worker->lwk_spill->lsp_fd);
+				unlink(worker->lwk_spill->lsp_path);
+			}
+			free(worker->lwk_spill);
+		}
+	}
+	free(pool->lwp_workers);
+	pool->lwp_workers = NULL;
+}
+
+/*
+ * The spill file of each worker is the one of the pool with the number of
+ * the worker as suffix
+ */
+static int lcrp_spill_init(struct lcrp_worker *worker,
+			   const char *spill_file, int i)
+{
+	struct lcrp_spill *spill;
+
+	spill = calloc(1, sizeof(*spill));
+	if (spill == NULL) {
+		LERROR("failed to allocate spill buffers\n");
+		return -ENOMEM;
+	}
+	worker->lwk_spill = spill;
+
+	snprintf(spill->lsp_path, sizeof(spill->lsp_path), "%s.%d",
+		 spill_file, i);
+	/* Spilled records have never been cleared, they are read again */
+	spill->lsp_fd = open(spill->lsp_path, O_RDWR | O_CREAT | O_TRUNC |
+			     O_APPEND | O_CLOEXEC, 0600);
+	if (spill->lsp_fd < 0) {
+		LERROR("failed to open spill file [%s]: %s\n",
+		       spill->lsp_path, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * The FID cache of cache_size FIDs is split between the workers, which
+ * is fine since each FID is always handled by the same worker. Each
+ * worker can keep fd_budget directory fds open, and queue depth works.
+ * Works are spilled into the spill file of the worker when its queue is
+ * full, or the Changelog thread waits if spill_file is NULL.
+ */
+int lcrp_worker_pool_init(struct lcrp_worker_pool *pool, int count,
+			  int depth, const char *spill_file,
+			  const char *dir_fid, struct lcrp_epoch *epoch,
+			  unsigned long cache_size, int fd_budget)
+{
+	int i;
+	int rc;
+	struct lcrp_worker *worker;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->lwp_dir_fid = dir_fid;
+	pool->lwp_depth = depth;
+	/* Aligned to a line, the workers are padded by lines as well */
+	rc = posix_memalign((void **)&pool->lwp_workers, LCRP_CACHELINE_SIZE,
+			    count * sizeof(*pool->lwp_workers));
+	if (rc) {
+		LERROR("failed to allocate [%d] workers\n", count);
+		pool->lwp_workers = NULL;
+		return -ENOMEM;
+	}
+	memset(pool->lwp_workers, 0, count * sizeof(*pool->lwp_workers));
+
+	for (i = 0; i < count; i++) {
+		worker = &pool->lwp_workers[i];
+		worker->lwk_pool = pool;
+		pthread_mutex_init(&worker->lwk_mutex, NULL);
+		pthread_cond_init(&worker->lwk_cond_work, NULL);
+		pthread_cond_init(&worker->lwk_cond_done, NULL);
+		/* Count the worker so that fini cleans it up */
+		pool->lwp_count++;
+
+		worker->lwk_works = calloc(depth, sizeof(*worker->lwk_works));
+		if (worker->lwk_works == NULL) {
+			LERROR("failed to allocate queue of [%d] works\n",
+			       depth);
+			lcrp_worker_pool_fini(pool);
+			return -ENOMEM;
+		}
+
+		if (spill_file != NULL) {
+			rc = lcrp_spill_init(worker, spill_file, i);
+			if (rc) {
+				lcrp_worker_pool_fini(pool);
+				return rc;
+			}
+		}
+
+		rc = lcrp_epoch_reader_init(&worker->lwk_reader, epoch,
+					    cache_size / count, fd_budget);
+		if (rc) {
+			LERROR("failed to init reader of epoch\n");
+			lcrp_worker_pool_fini(pool);
+			return rc;
+		}
+
+		rc = lcrp_thread_start(&worker->lwk_general,
+				       &lcrp_worker_thread, worker);
+		if (rc) {
+			LERROR("failed to start worker thread\n");
+			lcrp_worker_pool_fini(pool);
+			return -rc;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Wait until no more than limit works are queued on the worker. Return
+ * the error of the worker if it has failed.
+ */
+static int lcrp_worker_wait_done(struct lcrp_worker *worker,
+				 unsigned long long limit)
+{
+	int rc;
+
+	pthread_mutex_lock(&worker->lwk_mutex);
+	/* Either the worker sees lwk_blocked, or this sees the head */
+	__atomic_store_n(&worker->lwk_blocked, true, __ATOMIC_SEQ_CST);
+	while (true) {
+		rc = __atomic_load_n(&worker->lwk_error, __ATOMIC_SEQ_CST);
+		worker->lwk_head_seen = __atomic_load_n(&worker->lwk_head,
+							__ATOMIC_SEQ_CST);
+		if (rc || worker->lwk_tail - worker->lwk_head_seen <= limit)
+			break;
+		pthread_cond_wait(&worker->lwk_cond_done, &worker->lwk_mutex);
+	}
+	__atomic_store_n(&worker->lwk_blocked, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&worker->lwk_mutex);
+	return rc;
+}
+
+/*
+ * Queue the work on the worker. If the queue is full, wait for room if
+ * wait, otherwise return 1. Return the error of the worker if it has
+ * failed.
+ */
+static int lcrp_worker_queue(struct lcrp_worker *worker,
+			     const struct lcrp_work *work, bool wait)
+{
+	int rc;
+	struct lcrp_worker_pool *pool = worker->lwk_pool;
+
+	rc = __atomic_load_n(&worker->lwk_error, __ATOMIC_ACQUIRE);
+	if (rc)
+		return rc;
+
+	/* The head is only read again when the ring looks full */
+	if (worker->lwk_tail - worker->lwk_head_seen == pool->lwp_depth) {
+		worker->lwk_head_seen = __atomic_load_n(&worker->lwk_head,
+							__ATOMIC_ACQUIRE);
+		if (worker->lwk_tail - worker->lwk_head_seen ==
+		    pool->lwp_depth) {
+			if (!wait)
+				return 1;
+			rc = lcrp_worker_wait_done(worker, pool->lwp_depth - 1);
+			if (rc)
+				return rc;
+		}
+	}
+
+	worker->lwk_works[worker->lwk_tail % pool->lwp_depth] = *work;
+	/* Either the worker sees the tail, or this sees lwk_idle */
+	__atomic_store_n(&worker->lwk_tail, worker->lwk_tail + 1,
+			 __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&worker->lwk_idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&worker->lwk_mutex);
+		pthread_cond_signal(&worker->lwk_cond_work);
+		pthread_mutex_unlock(&worker->lwk_mutex);
+	}
+	return 0;
+}
+
+/* Append the buffered works to the spill file */
+static int lcrp_spill_write(struct lcrp_spill *spill)
+{
+	ssize_t nwritten;
+	size_t size = spill->lsp_out_count * sizeof(*spill->lsp_out);
+
+	nwritten = write(spill->lsp_fd, spill->lsp_out, size);
+	if (nwritten != size) {
+		LERROR("failed to write [%zu] bytes into spill file [%s]: %s\n",
+		       size, spill->lsp_path,
+		       nwritten < 0 ? strerror(errno) : "short write");
+		return nwritten < 0 ? -errno : -EIO;
+	}
+	spill->lsp_write_offset += size;
+	spill->lsp_out_count = 0;
+	return 0;
+}
+
+static int lcrp_spill_append(struct lcrp_worker *worker,
+			     const struct lcrp_work *work)
+{
+	int rc;
+	struct lcrp_spill *spill = worker->lwk_spill;
+
+	if (spill->lsp_out_count == LCRP_SPILL_BATCH) {
+		rc = lcrp_spill_write(spill);
+		if (rc)
+			return rc;
+	}
+
+	if (spill->lsp_pending == 0) {
+		LINFO("queue of worker is full, spilling records from %llu into [%s]\n",
+		      work->lw_index, spill->lsp_path);
+		lcrp_stats_add(LCRP_COUNTER_SPILL_STARTS, 1);
+		spill->lsp_replayed = work->lw_index - 1;
+	}
+	spill->lsp_out[spill->lsp_out_count++] = *work;
+	spill->lsp_pending++;
+	worker->lwk_pool->lwp_spill_pending++;
+	lcrp_stats_add(LCRP_COUNTER_SPILLED, 1);
+	return 0;
+}
+
+/*
+ * Get the oldest pending work into lsp_in, reading the spill file if
+ * needed. The file is emptied once all of it has been read back, and the
+ * works not written yet are taken from lsp_out directly.
+ */
+static int lcrp_spill_peek(struct lcrp_spill *spill, struct lcrp_work **work)
+{
+	ssize_t nread;
+
+	if (spill->lsp_in_pos < spill->lsp_in_count)
+		goto out;
+
+	spill->lsp_in_pos = 0;
+	if (spill->lsp_read_offset < spill->lsp_write_offset) {
+		nread = pread(spill->lsp_fd, spill->lsp_in,
+			      sizeof(spill->lsp_in), spill->lsp_read_offset);
+		if (nread < (ssize_t)sizeof(*spill->lsp_in)) {
+			LERROR("failed to read spill file [%s] at [%lld]: %s\n",
+			       spill->lsp_path,
+			       (long long)spill->lsp_read_offset,
+			       nread < 0 ? strerror(errno) : "short read");
+			spill->lsp_in_count = 0;
+			return nread < 0 ? -errno : -EIO;
+		}
+		spill->lsp_in_count = nread / sizeof(*spill->lsp_in);
+		spill->lsp_read_offset += spill->lsp_in_count *
+			sizeof(*spill->lsp_in);
+		goto out;
+	}
+
+	if (spill->lsp_write_offset > 0) {
+		if (ftruncate(spill->lsp_fd, 0)) {
+			LERROR("failed to truncate spill file [%s]: %s\n",
+			       spill->lsp_path, strerror(errno));
+			spill->lsp_in_count = 0;
+			return -errno;
+		}
+		spill->lsp_read_offset = 0;
+		spill->lsp_write_offset = 0;
+	}
+	memcpy(spill->lsp_in, spill->lsp_out,
+	       spill->lsp_out_count * sizeof(*spill->lsp_out));
+	spill->lsp_in_count = spill->lsp_out_count;
+	spill->lsp_out_count = 0;
+out:
+	LASSERT(spill->lsp_in_pos < spill->lsp_in_count);
+	*work = &spill->lsp_in[spill->lsp_in_pos];
+	return 0;
+}
+
+/*
+ * Queue the spilled works on the worker in order. Stop when its queue is
+ * full unless wait.
+ */
+static int lcrp_worker_replay(struct lcrp_worker *worker, bool wait)
+{
+	int rc = 0;
+	struct lcrp_work *work = NULL;
+	struct lcrp_spill *spill = worker->lwk_spill;
+	unsigned long long replayed = 0;
+
+	while (spill->lsp_pending > 0) {
+		rc = lcrp_spill_peek(spill, &work);
+		if (rc)
+			break;
+		rc = lcrp_worker_queue(worker, work, wait);
+		if (rc) {
+			/* Full queue is not an error */
+			if (rc > 0)
+				rc = 0;
+			break;
+		}
+		spill->lsp_replayed = work->lw_index;
+		spill->lsp_in_pos++;
+		spill->lsp_pending--;
+		replayed++;
+		if (spill->lsp_pending == 0) {
+			LINFO("queued all spilled records up to %llu of [%s] on worker\n",
+			      spill->lsp_replayed, spill->lsp_path);
+			lcrp_stats_add(LCRP_COUNTER_SPILL_ENDS, 1);
+		}
+	}
+	worker->lwk_pool->lwp_spill_pending -= replayed;
+	lcrp_stats_add(LCRP_COUNTER_SPILL_REPLAYED, replayed);
+	return rc;
+}
+
+/*
+ * Queue the spilled works of all workers. A worker with a full queue does
+ * not hold back the others.
+ */
+static int lcrp_worker_pool_replay(struct lcrp_worker_pool *pool, bool wait)
+{
+	int i;
+	int rc = 0;
+	struct lcrp_worker *worker;
+
+	if (pool->lwp_spill_pending == 0)
+		return 0;
+
+	for (i = 0; i < pool->lwp_count; i++) {
+		worker = &pool->lwp_workers[i];
+		if (worker->lwk_spill == NULL ||
+		    worker->lwk_spill->lsp_pending == 0)
+			continue;
+		rc = lcrp_worker_replay(worker, wait);
+		if (rc)
+			break;
+	}
+	lcrp_stats_set(LCRP_GAUGE_SPILL_PENDING, pool->lwp_spill_pending);
+	return rc;
+}
+
+/*
+ * Queue the FID of a record on the worker of its bucket. If the queue is
+ * full, either wait for room, which leaves the following records in
+ * Changelog, or spill the work until the workers catch up. Return the
+ * error of the worker if it has failed.
+ */
+int lcrp_worker_pool_dispatch(struct lcrp_worker_pool *pool,
+			      struct lu_fid *fid, unsigned long long index,
+			      unsigned long long time)
+{
+	int rc;
+	struct lcrp_work work;
+	struct lcrp_worker *worker;
+	struct lcrp_spill *spill;
+
+	work.lw_fid = *fid;
+	work.lw_index = index;
+	work.lw_time = time;
+	worker = &pool->lwp_workers[LCRP_FID_BUCKET(fid) % pool->lwp_count];
+	spill = worker->lwk_spill;
+
+	/* Spilled works are queued before the new ones */
+	rc = lcrp_worker_pool_replay(pool, false);
+	if (rc)
+		return rc;
+
+	if (spill == NULL || spill->lsp_pending == 0) {
+		rc = lcrp_worker_queue(worker, &work, false);
+		if (rc < 0)
+			return rc;
+		if (rc > 0) {
+			lcrp_stats_add(LCRP_COUNTER_QUEUE_FULL, 1);
+			if (spill == NULL) {
+				lcrp_stats_set(LCRP_GAUGE_PAUSED, 1);
+				rc = lcrp_worker_queue(worker, &work, true);
+				lcrp_stats_set(LCRP_GAUGE_PAUSED, 0);
+				if (rc)
+					return rc;
+			}
+		}
+	}
+
+	if (rc > 0 || (spill != NULL && spill->lsp_pending > 0)) {
+		rc = lcrp_spill_append(worker, &work);
+		if (rc)
+			return rc;
+		lcrp_stats_set(LCRP_GAUGE_SPILL_PENDING,
+			       pool->lwp_spill_pending);
+	}
+
+	pool->lwp_dispatched = index;
+	return 0;
+}
+
+/*
+ * Record that needs no work is done once the records before it are done.
+ * Spilled works are queued meanwhile, so that they do not wait for the
+ * next dispatched record.
+ */
+int lcrp_worker_pool_skip(struct lcrp_worker_pool *pool,
+			  unsigned long long index)
+{
+	pool->lwp_dispatched = index;
+	return lcrp_worker_pool_replay(pool, false);
+}
+
+/*
+ * Wait until all spilled and queued works are done. Return the error of
+ * the first failed worker if any.
+ */
+int lcrp_worker_pool_drain(struct lcrp_worker_pool *pool)
+{
+	int i;
+	int ret;
+	int rc = 0;
+
+	rc = lcrp_worker_pool_replay(pool, true);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < pool->lwp_count; i++) {
+		ret = lcrp_worker_wait_done(&pool->lwp_workers[i], 0);
+		if (rc == 0)
+			rc = ret;
+	}
+	return rc;
+}
+
+/*
+ * Return the largest index that all records up to it have been done, so
+ * that it is safe to clear them. Called only by the Changelog thread, so
+ * the work at the head is never overwritten while being read.
+ */
+unsigned long long lcrp_worker_pool_watermark(struct lcrp_worker_pool *pool)
+{
+	int i;
+	unsigned long long head;
+	unsigned long long index;
+	unsigned long long watermark = pool->lwp_dispatched;
+	struct lcrp_worker *worker;
+	struct lcrp_spill *spill;
+
+	for (i = 0; i < pool->lwp_count; i++) {
+		worker = &pool->lwp_workers[i];
+		head = __atomic_load_n(&worker->lwk_head, __ATOMIC_ACQUIRE);
+		worker->lwk_head_seen = head;
+		if (head != worker->lwk_tail) {
+			index = worker->lwk_works[head %
+						  pool->lwp_depth].lw_index;
+			if (index - 1 < watermark)
+				watermark = index - 1;
+		}
+
+		/* Spilled works are after the queued ones of the worker */
+		spill = worker->lwk_spill;
+		if (spill != NULL && spill->lsp_pending > 0 &&
+		    spill->lsp_replayed < watermark)
+			watermark = spill->lsp_replayed;
+	}
+	return watermark;
+}
+
+unsigned long long
+lcrp_worker_pool_syscall_count(struct lcrp_worker_pool *pool)
+{
+	int i;
+	unsigned long long count = 0;
+	struct lcrp_worker *worker;
+
+	for (i = 0; i < pool->lwp_count; i++) {
+		worker = &pool->lwp_workers[i];
+		count += __atomic_load_n(&worker->lwk_syscall_count,
+					 __ATOMIC_RELAXED);
+	}
+	return count;
+}
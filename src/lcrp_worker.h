@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2019 DDN Storage, Inc
+ *
+ * Author: Li Xi lixi@ddn.com
+ */
+#ifndef _LCRP_WORKER_H_
+#define _LCRP_WORKER_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <lustre/lustreapi.h>
+#include "lcrp_changelog.h"
+#include "lcrpd.h"
+
+/* Size of cache line, fields written by different threads are kept apart */
+#define LCRP_CACHELINE_SIZE 64
+
+/* FID of a record waiting to be updated by a worker */
+struct lcrp_work {
+	/* FID to update */
+	struct lu_fid		 lw_fid;
+	/* Index of the record */
+	unsigned long long	 lw_index;
+	/* Time of the record, cr_time */
+	unsigned long long	 lw_time;
+};
+
+/* Number of works written into or read from the spill file at once */
+#define LCRP_SPILL_BATCH 1024
+
+/*
+ * Works that could not be queued because the queue of their worker was
+ * full. Each worker has its own spill, so a slow worker never holds back
+ * the works of the others. The works are appended to the spill file in
+ * batches, and queued on the worker in order when there is room again.
+ * Records that have been spilled are not cleared before they are done,
+ * so the file is truncated when the pool starts.
+ */
+struct lcrp_spill {
+	/* Path of the spill file */
+	char			 lsp_path[PATH_MAX + 1];
+	/* Fd of the spill file, opened with O_APPEND */
+	int			 lsp_fd;
+	/* Works to append to the spill file */
+	struct lcrp_work	 lsp_out[LCRP_SPILL_BATCH];
+	/* Number of works in lsp_out */
+	int			 lsp_out_count;
+	/* Works read back from the spill file, or moved from lsp_out */
+	struct lcrp_work	 lsp_in[LCRP_SPILL_BATCH];
+	/* Number of works in lsp_in */
+	int			 lsp_in_count;
+	/* Slot of the next work to queue in lsp_in */
+	int			 lsp_in_pos;
+	/* Offset of the works not read back yet in the spill file */
+	off_t			 lsp_read_offset;
+	/* Size of the spill file */
+	off_t			 lsp_write_offset;
+	/* Number of spilled works that have not been queued on the worker */
+	unsigned long long	 lsp_pending;
+	/* Records up to this index are before the oldest pending work */
+	unsigned long long	 lsp_replayed;
+};
+
+/*
+ * Works are queued on a single-producer/single-consumer ring without any
+ * lock: the Changelog thread is the only one that advances lwk_tail, and
+ * the worker is the only one that advances lwk_head. The mutex and the
+ * conditions are only used to sleep when the ring is empty or full, and
+ * the other side takes them only if lwk_idle or lwk_blocked is set. The
+ * fields written by the worker are padded by a cache line on both sides,
+ * so they never share a line with the ones of the Changelog thread.
+ */
+struct lcrp_worker {
+	/* Pool this worker belongs to */
+	struct lcrp_worker_pool	*lwk_pool;
+	/*
+	 * Ring of lwp_depth works, the head is kept until it has been done
+	 * so that the index of the oldest unfinished record is always known
+	 */
+	struct lcrp_work	*lwk_works;
+	/* Protects sleeping on the conditions */
+	pthread_mutex_t		 lwk_mutex;
+	/* Signaled when a work is queued or the worker should stop */
+	pthread_cond_t		 lwk_cond_work;
+	/* Signaled when a work is done or the worker failed */
+	pthread_cond_t		 lwk_cond_done;
+	/* Error of the failed work at the head, the worker stops on error */
+	int			 lwk_error;
+	/* Number of works that have been queued, atomic */
+	unsigned long long	 lwk_tail;
+	/* Value of lwk_head last seen by the Changelog thread */
+	unsigned long long	 lwk_head_seen;
+	/* Changelog thread is waiting for works to be done, atomic */
+	bool			 lwk_blocked;
+	/* Works spilled when the ring is full, NULL to pause instead */
+	struct lcrp_spill	*lwk_spill;
+	/* Keeps the fields above apart from the ones below */
+	char			 lwk_pad[LCRP_CACHELINE_SIZE];
+	/* Number of works that have been done, atomic */
+	unsigned long long	 lwk_head;
+	/* Worker is waiting for works, atomic */
+	bool			 lwk_idle;
+	/* Number of syscalls done by the worker, atomic */
+	unsigned long long	 lwk_syscall_count;
+	/* Reader of the epoch, used only by the worker thread */
+	struct lcrp_epoch_reader lwk_reader;
+	/* General thread info */
+	struct lcrp_thread_info	 lwk_general;
+	/* Keeps the fields above apart from the ones of the next worker */
+	char			 lwk_pad_end[LCRP_CACHELINE_SIZE];
+};
+
+/*
+ * Workers that update FIDs for a Changelog reader. FIDs are sharded by
+ * the same bucket as the FID directory, so records of the same FID are
+ * always handled in order by the same worker.
+ */
+struct lcrp_worker_pool {
+	/* Directory that saves all fids */
+	const char		*lwp_dir_fid;
+	/* Number of workers */
+	int			 lwp_count;
+	/* Array of workers */
+	struct lcrp_worker	*lwp_workers;
+	/* Number of works that can be queued on each worker */
+	int			 lwp_depth;
+	/* Spilled works of all workers that have not been queued */
+	unsigned long long	 lwp_spill_pending;
+	/* Index of the last dispatched or skipped record */
+	unsigned long long	 lwp_dispatched;
+};
+
+int lcrp_worker_pool_init(struct lcrp_worker_pool *pool, int count,
+			  int depth, const char *spill_file,
+			  const char *dir_fid, struct lcrp_epoch *epoch,
+			  unsigned long cache_size, int fd_budget);
+void lcrp_worker_pool_fini(struct lcrp_worker_pool *pool);
+int lcrp_worker_pool_dispatch(struct lcrp_worker_pool *pool,
+			      struct lu_fid *fid, unsigned long long index,
+			      unsigned long long time);
+int lcrp_worker_pool_skip(struct lcrp_worker_pool *pool,
+			  unsigned long long index);
+int lcrp_worker_pool_drain(struct lcrp_worker_pool *pool);
+unsigned long long lcrp_worker_pool_watermark(struct lcrp_worker_pool *pool);
+unsigned long long
+lcrp_worker_pool_syscall_count(struct lcrp_worker_pool *pool);
+#endif /* _LCRP_WORKER_H_ */
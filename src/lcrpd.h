@@ -8,23 +8,136 @@
 #define _LCRPD_H_
 
 #include "lcrp_changelog.h"
+#include "lcrp_tier.h"
 
 /* Minimal number of epoch interval */
 #define LCRP_MIN_EPOCH_INTERVAL 10
 /* Maximum number of epoch interval, 100 days */
 #define LCRP_MAX_EPOCH_INTERVAL 8640000
 #define LCRP_MAXLEN 64
+/* Maximum number of MDTs to get Changelog from */
+#define LCRP_MAX_MDTS 256
+/* Minimum seconds to wait before restarting a failed Changelog reader */
+#define LCRP_INTERVAL_RESTART_MIN 1
+/* Maximum seconds to wait before restarting a failed Changelog reader */
+#define LCRP_INTERVAL_RESTART_MAX 60
 #define LCRPD_CONFIG "/etc/lcrpd.conf"
 #define LCRP_STR_CHANGELOG_USER	"changelog_user"
 #define LCRP_STR_LCRP_DIR	"lcrp_dir"
 #define LCRP_STR_MDT_DEVICE	"mdt_device"
 #define LCRP_STR_EPOCH_INTERVAL	"epoch_interval"
+#define LCRP_STR_CLEAR_BATCH_RECORDS	"clear_batch_records"
+#define LCRP_STR_CLEAR_BATCH_MSEC	"clear_batch_msec"
+#define LCRP_STR_CHECKPOINT_RECORDS	"checkpoint_records"
+#define LCRP_STR_DRAIN_LAG	"drain_lag"
+#define LCRP_STR_DRAIN_BATCH_RECORDS	"drain_batch_records"
+#define LCRP_STR_FID_CACHE_SIZE	"fid_cache_size"
+#define LCRP_STR_CHANGELOG_SOURCE	"changelog_source"
+#define LCRP_STR_SOURCE_RATE	"source_rate"
+#define LCRP_STR_SYNTHETIC_FIDS	"synthetic_fids"
+#define LCRP_STR_SYNTHETIC_ZIPF	"synthetic_zipf"
+#define LCRP_STR_SYNTHETIC_TYPES	"synthetic_types"
+#define LCRP_STR_SYNTHETIC_RECORDS	"synthetic_records"
+#define LCRP_STR_SYNTHETIC_SEED	"synthetic_seed"
+#define LCRP_STR_REPLAY_FILE	"replay_file"
+#define LCRP_STR_TRACE_FILE	"trace_file"
+#define LCRP_STR_WORKER_THREADS	"worker_threads"
+#define LCRP_STR_WORKER_QUEUE_DEPTH	"worker_queue_depth"
+#define LCRP_STR_INFLIGHT_MEMORY	"inflight_memory"
+#define LCRP_STR_INFLIGHT_POLICY	"inflight_policy"
+#define LCRP_STR_DIR_FD_BUDGET	"dir_fd_budget"
+#define LCRP_STR_IO_URING	"io_uring"
+#define LCRP_STR_CLEANUP_RATE	"cleanup_rate"
+#define LCRP_STR_CLEANUP_THREADS	"cleanup_threads"
+#define LCRP_STR_ACCESS_TYPES	"access_types"
+#define LCRP_STR_ACCESS_OPEN_MODES	"access_open_modes"
+#define LCRP_STR_STATS_INTERVAL	"stats_interval"
+#define LCRP_STR_FID_INDEX	"fid_index"
+#define LCRP_STR_HEAT_HALF_LIFE	"heat_half_life"
+#define LCRP_STR_TIERS		"tiers"
+
+/* Default number of records to clear in one llapi_changelog_clear() */
+#define LCRP_DEFAULT_CLEAR_BATCH_RECORDS 1024
+/* Maximum number of records to clear in one llapi_changelog_clear() */
+#define LCRP_MAX_CLEAR_BATCH_RECORDS 1048576
+/* Default milliseconds between two llapi_changelog_clear() calls */
+#define LCRP_DEFAULT_CLEAR_BATCH_MSEC 1000
+/* Maximum milliseconds between two llapi_changelog_clear() calls */
+#define LCRP_MAX_CLEAR_BATCH_MSEC 3600000
+/* Default number of records between two saves of Changelog checkpoint */
+#define LCRP_DEFAULT_CHECKPOINT_RECORDS 1024
+/* Maximum number of records between two saves of Changelog checkpoint */
+#define LCRP_MAX_CHECKPOINT_RECORDS 1048576
+/* Default seconds behind for a record to start draining the backlog */
+#define LCRP_DEFAULT_DRAIN_LAG 600
+/* Maximum seconds behind for a record to start draining the backlog */
+#define LCRP_MAX_DRAIN_LAG 31536000
+/* Default number of records of a batch of the backlog */
+#define LCRP_DEFAULT_DRAIN_BATCH_RECORDS 262144
+/* Maximum number of records of a batch of the backlog */
+#define LCRP_MAX_DRAIN_BATCH_RECORDS 16777216
+/* Default number of FIDs to remember in each epoch */
+#define LCRP_DEFAULT_FID_CACHE_SIZE 1048576
+/* Maximum number of FIDs to remember in each epoch */
+#define LCRP_MAX_FID_CACHE_SIZE 268435456
+/* Maximum records per second of the Changelog source */
+#define LCRP_MAX_SOURCE_RATE 100000000
+/* Default number of FIDs of synthetic source */
+#define LCRP_DEFAULT_SYNTHETIC_FIDS 1000000
+/* Maximum number of FIDs of synthetic source */
+#define LCRP_MAX_SYNTHETIC_FIDS 268435456
+/* Default exponent of Zipf distribution of synthetic source */
+#define LCRP_DEFAULT_SYNTHETIC_ZIPF 0.99
+/* Maximum exponent of Zipf distribution of synthetic source */
+#define LCRP_MAX_SYNTHETIC_ZIPF 10.0
+/* Default number of worker threads of each Changelog thread */
+#define LCRP_DEFAULT_WORKER_THREADS 4
+/* Maximum number of worker threads of each Changelog thread */
+#define LCRP_MAX_WORKER_THREADS 256
+/* Default number of records that can be queued on each worker */
+#define LCRP_DEFAULT_WORKER_QUEUE_DEPTH 1024
+/* Maximum number of records that can be queued on each worker */
+#define LCRP_MAX_WORKER_QUEUE_DEPTH 16777216
+/* Default bytes of records queued on the workers of each Changelog thread */
+#define LCRP_DEFAULT_INFLIGHT_MEMORY (64 * 1024 * 1024)
+/* Minimum bytes of records queued on the workers of each Changelog thread */
+#define LCRP_MIN_INFLIGHT_MEMORY 4096
+/* Maximum bytes of records queued on the workers of each Changelog thread */
+#define LCRP_MAX_INFLIGHT_MEMORY (1024 * 1024 * 1024)
+/* Stop receiving records when the queue of a worker is full */
+#define LCRP_INFLIGHT_PAUSE "pause"
+/* Spill records into a file when the queue of a worker is full */
+#define LCRP_INFLIGHT_SPILL "spill"
+/* Default number of bucket directory fds to keep open */
+#define LCRP_DEFAULT_DIR_FD_BUDGET 16384
+/* Maximum number of bucket directory fds to keep open */
+#define LCRP_MAX_DIR_FD_BUDGET 1048576
+/* Default files per second to cleanup from inactive epochs */
+#define LCRP_DEFAULT_CLEANUP_RATE 10000
+/* Maximum files per second to cleanup from inactive epochs */
+#define LCRP_MAX_CLEANUP_RATE 100000000
+/* Default number of threads to cleanup an inactive epoch */
+#define LCRP_DEFAULT_CLEANUP_THREADS 4
+/* Default seconds between two dumps of statistics */
+#define LCRP_DEFAULT_STATS_INTERVAL 10
+/* Maximum seconds between two dumps of statistics */
+#define LCRP_MAX_STATS_INTERVAL 3600
+/* Default seconds for the heat of a FID to halve */
+#define LCRP_DEFAULT_HEAT_HALF_LIFE 86400
+/* Maximum seconds for the heat of a FID to halve */
+#define LCRP_MAX_HEAT_HALF_LIFE 31536000
+/* Number of fds reserved for other purposes than the directory caches */
+#define LCRP_FD_RESERVED 1024
 
 #define LCRP_NAME_ACTIVE "active"
 #define LCRP_NAME_FIDS "fids"
 #define LCRP_NAME_INACTIVE "inactive"
 #define LCRP_NAME_INACTIVE_ALL "all"
-#define LCRP_NAME_SECONDARY "secondary"
+#define LCRP_NAME_CLEANUP_CHECKPOINT "cleanup_checkpoint"
+#define LCRP_NAME_CHANGELOG_CHECKPOINT "changelog_checkpoint"
+#define LCRP_NAME_STATS "lcrpd.prom"
+#define LCRP_NAME_FID_INDEX "fid_index"
+#define LCRP_NAME_SPILL "spill"
 
 struct lcrp_thread_info {
 	/* ID returned by pthread_create() */
@@ -37,14 +150,51 @@ struct lcrp_thread_info {
 	bool			 lti_stopped;
 };
 
+/*
+ * Epoch directory to merge into another directory, i.e. an epoch that has
+ * been moved into the inactive directory to merge into inactive/all, or
+ * an epoch to merge into a coarser directory of the next tier.
+ */
+struct lcrp_retired_epoch {
+	/* Next retired epoch in the queue */
+	struct lcrp_retired_epoch	*lre_next;
+	/* Directory name of the epoch */
+	char				 lre_name[LCRP_MAXLEN + 1];
+	/* Directory that the epoch is under */
+	char				 lre_dir[PATH_MAX + 1];
+	/* Directory to merge the epoch into */
+	char				 lre_dest[PATH_MAX + 1];
+};
+
 struct lcrp_inactive_thread_info {
+	/* Protects the queue of retired epochs */
+	pthread_mutex_t			 liti_mutex;
+	/* Signaled when an epoch is retired */
+	pthread_cond_t			 liti_cond;
+	/* Oldest retired epoch to cleanup */
+	struct lcrp_retired_epoch	*liti_head;
+	/* Latest retired epoch */
+	struct lcrp_retired_epoch	*liti_tail;
+	/* Retired epoch being merged */
+	struct lcrp_retired_epoch	*liti_current;
 	/* General thread info */
-	struct lcrp_thread_info	liti_general;
+	struct lcrp_thread_info		 liti_general;
+};
+
+struct lcrp_prepare_thread_info {
+	/* General thread info */
+	struct lcrp_thread_info	lpti_general;
 };
 
 struct lcrp_changelog_thread_info {
 	/* MDT device to get Changelog from */
 	char			lcti_mdt_device[LCRP_MAXLEN + 1];
+	/* Source of Changelog records */
+	struct lcrp_source	lcti_source;
+	/* Batched clear of processed records */
+	struct lcrp_changelog_clear lcti_clear;
+	/* Filter of records that count as access */
+	struct lcrp_changelog_filter lcti_filter;
 	/* General thread info */
 	struct lcrp_thread_info	lcti_general;
 };
@@ -54,28 +204,107 @@ struct lcrp_status {
 	char ls_cwd[PATH_MAX + 1];
 	/* Changelog user */
 	char ls_changelog_user[LCRP_MAXLEN + 1];
-	/* MDT device to get Changelog from */
-	char ls_mdt_device[LCRP_MAXLEN + 1];
 	/* Root directory that saves the access history */
 	char ls_dir_access_history[PATH_MAX + 1];
 	/* Directory that saves all fids */
 	char ls_dir_fid[PATH_MAX + 1];
 	/* Directory of fids that are being actively accessed */
 	char ls_dir_active[PATH_MAX + 1];
-	/* Directory of secondary */
-	char ls_dir_secondary[PATH_MAX + 1];
+	/* Directories of the tiers, the first one is active */
+	char ls_dir_tiers[LCRP_MAX_TIERS][PATH_MAX + 1];
 	/* Directory of inactive */
 	char ls_dir_inactive[PATH_MAX + 1];
 	/* Directory of all inactive FIDs, under inactive directory */
 	char ls_dir_inactive_all[PATH_MAX + 1];
+	/* File that saves the progress of cleaning up an inactive epoch */
+	char ls_cleanup_checkpoint[PATH_MAX + 1];
+	/* Directory of the Changelog checkpoints, one file for each MDT */
+	char ls_dir_changelog_checkpoint[PATH_MAX + 1];
+	/* Directory of the files of spilled records, one for each worker */
+	char ls_dir_spill[PATH_MAX + 1];
+	/* File that saves the statistics */
+	char ls_stats_file[PATH_MAX + 1];
+	/* Directory of the index of FID last access */
+	char ls_dir_fid_index[PATH_MAX + 1];
+	/* Clear the Changelog after this number of records */
+	int ls_clear_batch_records;
+	/* Clear the Changelog after this number of milliseconds */
+	int ls_clear_batch_msec;
+	/* Save Changelog checkpoint after this number of records, 0 for never */
+	int ls_checkpoint_records;
+	/* Drain records this number of seconds behind in batches, 0 to disable */
+	int ls_drain_lag;
+	/* Number of records of each batch of the backlog */
+	int ls_drain_batch_records;
+	/* Number of FIDs to remember in each epoch, 0 to disable */
+	int ls_fid_cache_size;
+	/* Number of worker threads of each Changelog thread, 0 for none */
+	int ls_worker_threads;
+	/* Number of records that can be queued on each worker */
+	int ls_worker_queue_depth;
+	/* Bytes of records queued on the workers of each Changelog thread */
+	int ls_inflight_memory;
+	/* Spill records into a file instead of pausing when queues are full */
+	bool ls_inflight_spill;
+	/* Number of bucket directory fds to keep open by all threads */
+	int ls_dir_fd_budget;
+	/* Whether to link FIDs and cleanup epochs in batches by io_uring */
+	int ls_io_uring;
+	/* Files per second to cleanup from inactive epochs, 0 for unlimited */
+	int ls_cleanup_rate;
+	/* Number of threads to cleanup an inactive epoch */
+	int ls_cleanup_threads;
+	/* Seconds between two dumps of statistics, 0 to disable */
+	int ls_stats_interval;
+	/* Whether to keep the index of FID last access */
+	int ls_fid_index;
+	/* Seconds for the heat of a FID to halve, 0 to disable */
+	int ls_heat_half_life;
+	/* Tiers of the access history, lts_count is 0 until configured */
+	struct lcrp_tiers ls_tiers;
+	/* Index of FID last access, used if ls_fid_index */
+	struct lcrp_index ls_index;
+	/* Config of record filter, copied by Changelog thread */
+	struct lcrp_changelog_filter ls_filter;
+	/* Config of Changelog source, copied by Changelog thread */
+	struct lcrp_source ls_source;
 	/* Singal recieved so stopping */
 	bool ls_stopping;
-	/* Info of Changlog thread */
-	struct lcrp_changelog_thread_info ls_changelog_info;
+	/* Number of MDTs to get Changelog from */
+	int ls_mdt_count;
+	/* Info of Changlog threads, one for each MDT */
+	struct lcrp_changelog_thread_info ls_changelog_infos[LCRP_MAX_MDTS];
 	/* Info of inactive thread */
 	struct lcrp_inactive_thread_info ls_inactive_info;
+	/* Info of thread that prepares the directory of the next epoch */
+	struct lcrp_prepare_thread_info ls_prepare_info;
 	/* Epoch that could change from to time */
 	struct lcrp_epoch ls_epoch;
 };
 
+extern struct lcrp_status *lcrp_status;
+
+int lcrp_init(void);
+void lcrp_fini(void);
+int lcrp_set_key_value(const char *key, const char *value);
+int lcrp_config_load(const char *config_fpath);
+int lcrp_thread_start(struct lcrp_thread_info *info,
+		      void *(*start_routine)(void *),
+		      void *private_info);
+int lcrp_thread_stop(struct lcrp_thread_info *info);
+int lcrp_fd_limit_init(void);
+int lcrp_reader_fd_budget(int workers);
+int lcrp_worker_queue_depth(int workers);
+const char *lcrp_spill_file(struct lcrp_source *source, char *buffer,
+			    int size);
+int lcrp_init_dir(void);
+int lcrp_merge_epoch(const char *dir, const char *name, const char *dest);
+int lcrp_retire_epoch(const char *name);
+int lcrp_inactive_scan(void);
+int lcrp_inactive_cleanup(int rate, bool *stopping);
+void *lcrp_inactive_thread(void *arg);
+int lcrp_epoch_prepare(struct lcrp_epoch *epoch, int start);
+void *lcrp_prepare_thread(void *arg);
+int _lcrp_epoch_update(struct lcrp_epoch *epoch, int current_second);
+int lcrp_epoch_update(void);
 #endif /* _LCRPD_H_ */